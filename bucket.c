@@ -0,0 +1,248 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Rate limits shared by all the connections, in all the processes.
+ *
+ * Every domain of [rates] has a token bucket in shared memory. A bucket is a
+ * single word: the time, on the monotonic clock, at which it will be full
+ * again (a "theoretical arrival time"). Taking n bytes pushes that time
+ * n / rate further; the bucket is empty, and the caller has to wait, when it
+ * lies more than burst / rate in the future. Takers only compare-and-swap
+ * the word, so no process ever waits on another one.
+ *
+ * The buckets are found by domain in an open-addressing table, so that the
+ * processes that reload the configuration on their own still share them. The
+ * rate and the burst come from the caller: connections that started before a
+ * reload keep charging at the old rate.
+ */
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "bucket.h"
+#include "dbg.h"
+#include "http.h"
+#include "webproxy.h"
+
+#define NSECOND_PER_SECOND 1000000000ULL
+
+/*
+ * The table has at least that many slots, and twice as many as the rules
+ * it starts with, to leave room for the rules added by reloads.
+ */
+#define MIN_SLOTS 1024
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_CLAIMED,               /* Its name is being written */
+    SLOT_READY
+};
+
+struct bucket {
+    uint64_t        full;       /* When the bucket is full again, in ns */
+    uint32_t        state;
+    uint32_t        hash;
+    char            domain[HOSTNAME_LENGTH + 1];
+} __attribute__ ((aligned(64)));
+
+static struct bucket *buckets = NULL;
+static uint32_t mask = 0;
+
+/*
+ * The buckets of the domains the shared table had no room for. They are
+ * kept for the life of the process and found again by the reloads.
+ */
+struct private_bucket {
+    struct bucket   bucket;
+    char           *domain;
+    struct private_bucket *next;
+};
+
+static struct private_bucket *private_buckets = NULL;
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSECOND_PER_SECOND + ts.tv_nsec;
+}
+
+static uint32_t
+hash(const char *name)
+{
+    uint32_t        h = 2166136261u;
+
+    while (*name != '\0')
+        h = (h ^ (unsigned char) tolower((unsigned char) *name++))
+            * 16777619u;
+    return h;
+}
+
+int
+bucket_init(const int count)
+{
+    uint32_t        size;
+
+    for (size = MIN_SLOTS; size < (uint32_t) count * 2; size <<= 1);
+
+    buckets = mmap(NULL, size * sizeof(struct bucket),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    check(buckets != MAP_FAILED, "Cannot map the rate buckets");
+    mask = size - 1;
+
+    return 0;
+
+  error:
+    buckets = NULL;
+    return -1;
+}
+
+/*
+ * Returns the bucket of `domain` private to the process, creating it if
+ * needed, or NULL on failure.
+ */
+static struct bucket *
+private_get(const char *domain)
+{
+    struct private_bucket *p;
+
+    for (p = private_buckets; p != NULL; p = p->next)
+        if (strcasecmp(p->domain, domain) == 0)
+            return &p->bucket;
+
+    /*
+     * Better a limit per process than none.
+     */
+    log_warn("No shared rate bucket left for %s", domain);
+    p = calloc(1, sizeof(*p));
+    check_mem(p);
+    p->domain = strdup(domain);
+    check_mem(p->domain);
+    p->bucket.full = monotonic_ns();
+    p->next = private_buckets;
+    private_buckets = p;
+    return &p->bucket;
+
+  error:
+    free(p);
+    return NULL;
+}
+
+struct bucket  *
+bucket_get(const char *domain)
+{
+    struct bucket  *b;
+    uint32_t        h,
+                    state,
+                    i,
+                    n;
+
+    if (buckets == NULL || strlen(domain) > HOSTNAME_LENGTH)
+        goto private;
+
+    h = hash(domain);
+    for (i = h & mask, n = 0; n <= mask;) {
+        b = &buckets[i];
+        state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+
+        if (state == SLOT_FREE) {
+            /*
+             * Another process may claim it first: look at it again.
+             */
+            if (!__atomic_compare_exchange_n(&b->state, &state, SLOT_CLAIMED,
+                                             0, __ATOMIC_ACQUIRE,
+                                             __ATOMIC_ACQUIRE))
+                continue;
+            strcpy(b->domain, domain);
+            b->hash = h;
+            b->full = monotonic_ns();   /* Start full */
+            __atomic_store_n(&b->state, SLOT_READY, __ATOMIC_RELEASE);
+            return b;
+        }
+
+        /*
+         * Claims do not take long.
+         */
+        while (state == SLOT_CLAIMED) {
+            sched_yield();
+            state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+        }
+
+        if (b->hash == h && strcasecmp(b->domain, domain) == 0)
+            return b;
+
+        i = (i + 1) & mask;
+        n++;
+    }
+
+  private:
+    return private_get(domain);
+}
+
+long
+bucket_take(struct bucket *b, const size_t n, const int rate,
+            const int burst)
+{
+    uint64_t        t,
+                    full,
+                    next,
+                    ahead;
+
+    if (b == NULL || rate <= 0)
+        return 0;
+
+    /*
+     * The bucket holds `burst` kbytes, that is `ahead` ns of `rate`.
+     */
+    ahead = (uint64_t) (burst > 0 ? burst : rate) * NSECOND_PER_SECOND
+        / rate;
+
+    t = monotonic_ns();
+    full = __atomic_load_n(&b->full, __ATOMIC_RELAXED);
+    do {
+        next = (full > t ? full : t)
+            + n * NSECOND_PER_SECOND / ((uint64_t) rate * 1024);
+    } while (!__atomic_compare_exchange_n(&b->full, &full, next, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    if (next <= t + ahead)
+        return 0;
+    return (long) ((next - t - ahead) / 1000);
+}
@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BUCKET_H_
+#define BUCKET_H_
+
+#include <stddef.h>
+
+/*
+ * A token bucket in shared memory, one per domain of [rates].
+ */
+struct bucket;
+
+/*
+ * Creates room in shared memory for the buckets of `count` domains and more.
+ * It must be called before the processes that use the buckets are forked.
+ * Returns 0 on success, -1 on failure.
+ */
+int             bucket_init(const int count);
+
+/*
+ * Returns the bucket of `domain`, shared by all the processes, creating it
+ * if needed. When there is no room left, the bucket is private to the
+ * process, which keeps it for the next reloads.
+ */
+struct bucket  *bucket_get(const char *domain);
+
+/*
+ * Takes `n` bytes from `b`, which is filled at `rate` kbytes/sec and holds
+ * at most `burst` kbytes, or a second of `rate` if `burst` is 0. The bucket
+ * may go into debt. A rate of 0 or less is no limit.
+ * Returns how long the caller must wait before sending the bytes, in
+ * microseconds.
+ */
+long            bucket_take(struct bucket *b, const size_t n, const int rate,
+                            const int burst);
+
+#endif                          /* BUCKET_H_ */
@@ -0,0 +1,198 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The pool of the I/O buffers of the connections, shared by all the
+ * processes. The buffers are carved out of one shared mapping, made before
+ * the processes are forked, whose size is the budget: no process can take
+ * more than what is left, and the buffers a child of the fork engine leaves
+ * behind are the next child's. They are whole pages, so they do not
+ * fragment any heap.
+ *
+ * Every buffer records the pid of the process that holds it, 0 if it is
+ * free. The buffers of a process that dies without giving them back are
+ * freed when its parent reaps it (bufpool_release()).
+ */
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "dbg.h"
+#include "utils.h"
+#include "webproxy.h"
+
+/*
+ * The head of the mapping, before the buffers.
+ */
+struct bufpool {
+    uint32_t        num_free;   /* A hint for bufpool_can() */
+    uint32_t        next;       /* Where the search for a free one starts */
+    pid_t           owners[];
+};
+
+static struct bufpool *pool = NULL;
+static char    *buffers = NULL;
+static uint32_t num_buffers = 0;
+static size_t   buffer_size = 0;
+static size_t   mapped = 0;
+
+int
+bufpool_init(const size_t budget)
+{
+    size_t          page,
+                    head;
+
+    page = (size_t) sysconf(_SC_PAGESIZE);
+    buffer_size = (PEER_BUFFER_SIZE + page - 1) / page * page;
+
+    /*
+     * At least one connection of the fork engine must get through.
+     */
+    num_buffers = max(budget / buffer_size, 3);
+    head = (sizeof(*pool) + num_buffers * sizeof(pid_t) + page - 1)
+        / page * page;
+    mapped = head + num_buffers * buffer_size;
+
+    pool = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    check(pool != MAP_FAILED, "Cannot map the connection buffers");
+    buffers = (char *) pool + head;
+    pool->num_free = num_buffers;
+
+    return 0;
+
+  error:
+    pool = NULL;
+    num_buffers = 0;
+    return -1;
+}
+
+void
+bufpool_destroy(void)
+{
+    if (pool != NULL)
+        munmap(pool, mapped);
+    pool = NULL;
+    num_buffers = 0;
+}
+
+int
+bufpool_can(const int n)
+{
+    return pool != NULL
+        && __atomic_load_n(&pool->num_free, __ATOMIC_RELAXED) >= (uint32_t) n;
+}
+
+char           *
+bufpool_get(void)
+{
+    pid_t           self,
+                    owner;
+    uint32_t        start,
+                    i,
+                    n;
+
+    if (pool == NULL)
+        return NULL;
+
+    self = getpid();
+    start = __atomic_load_n(&pool->next, __ATOMIC_RELAXED);
+    for (n = 0; n < num_buffers; n++) {
+        i = (start + n) % num_buffers;
+        owner = 0;
+        if (__atomic_load_n(&pool->owners[i], __ATOMIC_RELAXED) != 0
+            || !__atomic_compare_exchange_n(&pool->owners[i], &owner, self,
+                                            0, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+            continue;
+
+        __atomic_sub_fetch(&pool->num_free, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool->next, (i + 1) % num_buffers,
+                         __ATOMIC_RELAXED);
+        return buffers + i * buffer_size;
+    }
+
+    return NULL;
+}
+
+void
+bufpool_put(char *buf)
+{
+    uint32_t        i;
+
+    if (buf == NULL || pool == NULL)
+        return;
+
+    i = (buf - buffers) / buffer_size;
+    __atomic_store_n(&pool->owners[i], 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pool->num_free, 1, __ATOMIC_RELAXED);
+}
+
+void
+bufpool_hand(char *buf, const pid_t pid)
+{
+    pid_t           self = getpid();
+    uint32_t        i;
+
+    if (buf == NULL || pool == NULL)
+        return;
+
+    /*
+     * Unless the child has already given it back.
+     */
+    i = (buf - buffers) / buffer_size;
+    __atomic_compare_exchange_n(&pool->owners[i], &self, pid, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void
+bufpool_release(const pid_t pid)
+{
+    pid_t           owner;
+    uint32_t        i,
+                    n = 0;
+
+    if (pool == NULL || pid <= 0)
+        return;
+
+    for (i = 0; i < num_buffers; i++) {
+        owner = pid;
+        if (__atomic_compare_exchange_n(&pool->owners[i], &owner, 0, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            n++;
+    }
+
+    if (n > 0) {
+        __atomic_add_fetch(&pool->num_free, n, __ATOMIC_RELAXED);
+        log_info("Released %u buffers of process %ld", n, (long) pid);
+    }
+}
@@ -0,0 +1,77 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BUFPOOL_H_
+#define BUFPOOL_H_
+
+#include <sys/types.h>
+
+/*
+ * Default budget of the I/O buffers of all the processes, in megabytes.
+ */
+#define BUFPOOL_DEFAULT_BUDGET  64
+
+/*
+ * Maps `budget` bytes of buffers, shared by all the processes. It must be
+ * called before the processes that use them are forked.
+ * Returns 0 on success, -1 on failure.
+ */
+int             bufpool_init(const size_t budget);
+
+/*
+ * Unmaps the buffers.
+ */
+void            bufpool_destroy(void);
+
+/*
+ * Returns a page-aligned buffer of PEER_BUFFER_SIZE bytes at least, or NULL
+ * if the budget is spent.
+ */
+char           *bufpool_get(void);
+
+/*
+ * Gives `buf`, which may be NULL, back to the pool.
+ */
+void            bufpool_put(char *buf);
+
+/*
+ * Makes `pid`, a child this process has just forked, the holder of `buf`.
+ */
+void            bufpool_hand(char *buf, const pid_t pid);
+
+/*
+ * Gives back the buffers `pid` held when it died. The parent calls it once
+ * it has reaped `pid`.
+ */
+void            bufpool_release(const pid_t pid);
+
+/*
+ * Returns 1 if `n` more buffers are likely to be had within the budget, 0
+ * otherwise.
+ */
+int             bufpool_can(const int n);
+
+#endif                          /* BUFPOOL_H_ */
@@ -0,0 +1,925 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Response cache in POSIX shared memory, shared by all the processes.
+ *
+ * The memory is cut into pages of CACHE_PAGE_SIZE bytes, which are handed to
+ * slab classes as they need them. A class cuts its pages into slots of one
+ * size, the sizes of the classes growing by a quarter from one to the next,
+ * so a response wastes less than a quarter of its slot. Once all the pages
+ * are taken, the least recently used response of all goes: if it is of
+ * another class, with the whole page it is on, which then changes class. The
+ * pages thus follow the sizes of the responses as they change.
+ *
+ * A response is found through a hash table of its key, the method and the
+ * absolute URL. Several responses may have the same key if the server said
+ * they vary with some fields of the request (Vary); each keeps the values of
+ * those fields in the request it answered, and is only served to requests
+ * with the same values.
+ *
+ * Responses are large and served by copying them out, so unlike the DNS
+ * cache, readers and writers all take the one lock. It is robust: if a
+ * process dies while holding it, the next one to take it empties the cache
+ * rather than trusting lists that may be half updated.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>           /* Defines mode constants */
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>              /* Defines O_* constants */
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "dbg.h"
+#include "http.h"
+#include "utils.h"
+#include "webproxy.h"
+
+#define SHM_NAME "webcache_shm"
+
+#define CACHE_PAGE_SIZE KBYTES_TO_BYTES(1024)
+#define SMALLEST_SLOT   256
+#define MAX_CLASSES     64
+#define FREE_SLOT       UINT32_MAX      /* The class of a free slot */
+
+/*
+ * Bytes of cache per bucket of the hash table.
+ */
+#define BUCKET_BYTES    8192
+
+/*
+ * A cached response. Items are linked by their offsets in the shared memory,
+ * which are the same in every process; 0 is the end of a list.
+ */
+struct item {
+    uint32_t        hash_next;  /* Or the next free slot of the class */
+    uint32_t        lru_prev;
+    uint32_t        lru_next;
+    uint32_t        hash;
+    uint32_t        class;
+    uint32_t        key_length; /* With its NUL */
+    uint32_t        vary_length;
+    uint32_t        length;     /* Of the response */
+    uint32_t        line_length;        /* Of its status line */
+    uint32_t        age;        /* When it was stored */
+    int64_t         stored;
+    int64_t         expires;
+    int64_t         used;       /* Last served */
+    char            data[];     /* Key, vary, response */
+};
+
+struct slab_class {
+    uint32_t        size;       /* Of a slot */
+    uint32_t        free;       /* First free slot */
+    uint32_t        head;       /* Most recently used */
+    uint32_t        tail;       /* Least recently used */
+};
+
+struct region {
+    pthread_mutex_t lock;
+    uint32_t        num_buckets;
+    uint32_t        num_pages;
+    uint32_t        pages_used;
+    uint32_t        num_classes;
+    uint32_t        pages;      /* Offset of the first page */
+    struct slab_class classes[MAX_CLASSES];
+    uint32_t        buckets[];
+};
+
+static struct region *region = NULL;
+static size_t   region_size = 0;
+static size_t   max_object = 0;
+
+#define ITEM(offset) ((struct item *) ((char *) region + (offset)))
+
+/*
+ * FNV-1a of the key.
+ */
+static uint32_t
+hash(const char *key)
+{
+    uint32_t        h = 2166136261u;
+
+    while (*key != '\0')
+        h = (h ^ (unsigned char) *key++) * 16777619u;
+
+    return h;
+}
+
+/*
+ * Finds the next field `name`, which includes the colon, in the header from
+ * `*p` to `end`, and moves `*p` past it. `value` and `length` are set to its
+ * value, without the white space around it.
+ * Returns 1 if found, 0 otherwise.
+ */
+static int
+next_field(const char **p, const char *end, const char *name,
+           const char **value, size_t *length)
+{
+    size_t          n = strlen(name);
+    const char     *line,
+                   *eol,
+                   *v,
+                   *e;
+
+    while (*p < end) {
+        line = *p;
+        eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+        *p = eol < end ? eol + 1 : end;
+
+        if ((size_t) (eol - line) < n || strncasecmp(line, name, n) != 0)
+            continue;
+
+        for (v = line + n; v < eol && (*v == ' ' || *v == '\t'); v++);
+        for (e = eol; e > v && isspace((unsigned char) e[-1]); e--);
+        *value = v;
+        *length = e - v;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the number at the start of `s`, or -1 if there is none.
+ */
+static long
+number(const char *s, const char *end)
+{
+    long            n = 0;
+
+    if (s >= end || !isdigit((unsigned char) *s))
+        return -1;
+    for (; s < end && isdigit((unsigned char) *s); s++)
+        n = n < LONG_MAX / 10 ? n * 10 + (*s - '0') : LONG_MAX;
+    return n;
+}
+
+/*
+ * Looks for `directive` in the Cache-Control fields of the header from
+ * `head` to `end`. If it has an argument, `seconds` is set to it.
+ * Returns 1 if found, 0 otherwise.
+ */
+static int
+cache_control(const char *head, const char *end, const char *directive,
+              long *seconds)
+{
+    const char     *p = head,
+                   *value,
+                   *stop,
+                   *token;
+    size_t          length,
+                    n = strlen(directive),
+                    k;
+
+    while (next_field(&p, end, "Cache-Control:", &value, &length)) {
+        for (stop = value + length; value < stop; value += k) {
+            while (value < stop && (*value == ' ' || *value == ','))
+                value++;
+            token = value;
+            for (k = 0; value + k < stop && value[k] != ','; k++);
+
+            if (k < n || strncasecmp(token, directive, n) != 0
+                || (k > n && token[n] != '=' && token[n] != ' '))
+                continue;
+            if (seconds != NULL) {
+                token += n;
+                while (token < value + k && (*token == '=' || *token == '"'))
+                    token++;
+                *seconds = number(token, value + k);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the time of the field `name` of the header, or -1.
+ */
+static time_t
+field_date(const char *head, const char *end, const char *name)
+{
+    const char     *p = head,
+                   *value;
+    char            date[64];
+    size_t          length;
+    struct tm       tm;
+    char           *rest;
+
+    if (!next_field(&p, end, name, &value, &length)
+        || length >= sizeof(date))
+        return -1;
+    memcpy(date, value, length);
+    date[length] = '\0';
+
+    memset(&tm, 0, sizeof(tm));
+    rest = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (rest == NULL || *rest != '\0')
+        return -1;
+    return timegm(&tm);
+}
+
+/*
+ * RFC 7231 6.1: the status codes that may be cached without being told to.
+ * Only those are cached, and then only when told for how long.
+ */
+static int
+is_cacheable(const int status)
+{
+    switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Copies to `vary` the fields of the request `head` the response varies
+ * with, as "name:value" lines.
+ * Returns the length, or -1 if the response cannot be cached.
+ */
+static int
+vary_fields(char *vary, const char *response, const char *response_end,
+            const char *head, const char *head_end)
+{
+    const char     *p = response,
+                   *q,
+                   *value,
+                   *stop,
+                   *field;
+    size_t          length,
+                    k,
+                    n;
+    int             used = 0;
+    char            name[64];
+
+    while (next_field(&p, response_end, "Vary:", &value, &length)) {
+        for (stop = value + length; value < stop; value += k) {
+            while (value < stop && (*value == ' ' || *value == ','))
+                value++;
+            for (k = 0; value + k < stop && value[k] != ','
+                 && value[k] != ' '; k++);
+            if (k == 0)
+                continue;
+            if (k == 1 && *value == '*')
+                return -1;
+            if (k + 2 > sizeof(name))
+                return -1;
+
+            for (n = 0; n < k; n++)
+                name[n] = tolower((unsigned char) value[n]);
+            name[k] = ':';
+            name[k + 1] = '\0';
+
+            q = head;
+            if (!next_field(&q, head_end, name, &field, &n))
+                n = 0;
+            if (used + k + n + 2 > CACHE_VARY_LENGTH)
+                return -1;
+            memcpy(vary + used, name, k + 1);
+            memcpy(vary + used + k + 1, field, n);
+            used += k + 1 + n;
+            vary[used++] = '\n';
+        }
+    }
+    return used;
+}
+
+int
+cache_vary_match(const char *vary, const size_t vary_length,
+                 const char *head, const size_t length)
+{
+    const char     *p = vary,
+                   *end = vary + vary_length,
+                   *colon,
+                   *eol,
+                   *q,
+                   *value;
+    size_t          n;
+    char            name[64];
+
+    for (; p < end; p = eol + 1) {
+        colon = memchr(p, ':', end - p);
+        eol = memchr(p, '\n', end - p);
+        memcpy(name, p, colon + 1 - p);
+        name[colon + 1 - p] = '\0';
+
+        q = head;
+        if (!next_field(&q, head + length, name, &value, &n))
+            n = 0;
+        if (n != (size_t) (eol - colon - 1)
+            || memcmp(value, colon + 1, n) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static void
+lru_unlink(struct slab_class *c, const uint32_t offset)
+{
+    struct item    *it = ITEM(offset);
+
+    if (it->lru_prev != 0)
+        ITEM(it->lru_prev)->lru_next = it->lru_next;
+    else
+        c->head = it->lru_next;
+    if (it->lru_next != 0)
+        ITEM(it->lru_next)->lru_prev = it->lru_prev;
+    else
+        c->tail = it->lru_prev;
+}
+
+static void
+lru_push(struct slab_class *c, const uint32_t offset)
+{
+    struct item    *it = ITEM(offset);
+
+    it->lru_prev = 0;
+    it->lru_next = c->head;
+    if (c->head != 0)
+        ITEM(c->head)->lru_prev = offset;
+    else
+        c->tail = offset;
+    c->head = offset;
+}
+
+/*
+ * Removes the item at `offset` and frees its slot. The lock must be held.
+ */
+static void
+item_free(const uint32_t offset)
+{
+    struct item    *it = ITEM(offset);
+    struct slab_class *c = &region->classes[it->class];
+    uint32_t       *p;
+
+    p = &region->buckets[it->hash & (region->num_buckets - 1)];
+    while (*p != offset)
+        p = &ITEM(*p)->hash_next;
+    *p = it->hash_next;
+
+    lru_unlink(c, offset);
+    it->class = FREE_SLOT;
+    it->hash_next = c->free;
+    c->free = offset;
+}
+
+/*
+ * Cuts the page at `page` into free slots of `class`.
+ */
+static void
+page_carve(const uint32_t page, const uint32_t class)
+{
+    struct slab_class *c = &region->classes[class];
+    uint32_t        offset;
+
+    for (offset = page; offset + c->size <= page + CACHE_PAGE_SIZE;
+         offset += c->size) {
+        ITEM(offset)->class = FREE_SLOT;
+        ITEM(offset)->hash_next = c->free;
+        c->free = offset;
+    }
+}
+
+/*
+ * Takes the page of the item at `victim` from its class, with all the items
+ * on it.
+ * Returns the offset of the page.
+ */
+static uint32_t
+page_steal(const uint32_t victim)
+{
+    struct slab_class *c = &region->classes[ITEM(victim)->class];
+    uint32_t        page,
+                    offset,
+                   *p;
+
+    page = victim - (victim - region->pages) % CACHE_PAGE_SIZE;
+    for (offset = page; offset + c->size <= page + CACHE_PAGE_SIZE;
+         offset += c->size) {
+        if (ITEM(offset)->class != FREE_SLOT)
+            item_free(offset);
+    }
+
+    for (p = &c->free; *p != 0;) {
+        if (*p >= page && *p < page + CACHE_PAGE_SIZE)
+            *p = ITEM(*p)->hash_next;
+        else
+            p = &ITEM(*p)->hash_next;
+    }
+    return page;
+}
+
+/*
+ * Returns the offset of a slot of at least `size` bytes, making room for it
+ * if there is no free one, or 0. The lock must be held.
+ */
+static uint32_t
+item_alloc(const size_t size, uint32_t *class)
+{
+    struct slab_class *c;
+    uint32_t        i,
+                    j,
+                    offset,
+                    victim = 0;
+
+    for (i = 0; i < region->num_classes; i++) {
+        if (region->classes[i].size >= size)
+            break;
+    }
+    if (i == region->num_classes)
+        return 0;
+    c = &region->classes[i];
+    *class = i;
+
+    if (c->free == 0 && region->pages_used < region->num_pages)
+        page_carve(region->pages + region->pages_used++ * CACHE_PAGE_SIZE,
+                   i);
+
+    if (c->free == 0) {
+        for (j = 0; j < region->num_classes; j++) {
+            offset = region->classes[j].tail;
+            if (offset != 0
+                && (victim == 0 || ITEM(offset)->used < ITEM(victim)->used))
+                victim = offset;
+        }
+        if (victim == 0)
+            return 0;
+        if (ITEM(victim)->class == i)
+            item_free(victim);
+        else
+            page_carve(page_steal(victim), i);
+    }
+
+    offset = c->free;
+    c->free = ITEM(offset)->hash_next;
+    return offset;
+}
+
+/*
+ * Empties the cache. The lock must be held.
+ */
+static void
+cache_reset(void)
+{
+    uint32_t        i;
+
+    memset(region->buckets, 0,
+           region->num_buckets * sizeof(region->buckets[0]));
+    for (i = 0; i < region->num_classes; i++) {
+        region->classes[i].free = 0;
+        region->classes[i].head = 0;
+        region->classes[i].tail = 0;
+    }
+    region->pages_used = 0;
+}
+
+static void
+cache_lock(void)
+{
+    if (pthread_mutex_lock(&region->lock) != EOWNERDEAD)
+        return;
+
+    log_warn("A process died while updating the response cache");
+    cache_reset();
+    pthread_mutex_consistent(&region->lock);
+}
+
+static void
+cache_unlock(void)
+{
+    pthread_mutex_unlock(&region->lock);
+}
+
+int
+cache_init(const size_t size, const size_t max)
+{
+    pthread_mutexattr_t attr;
+    struct region   r;
+    size_t          header;
+    uint32_t        slot;
+    int             fd = -1;
+
+    memset(&r, 0, sizeof(r));
+    r.num_pages = size / CACHE_PAGE_SIZE;
+    check(r.num_pages > 0, "The response cache must have at least %d KB",
+          BYTES_TO_KBYTES(CACHE_PAGE_SIZE));
+
+    for (r.num_buckets = 64; r.num_buckets < size / BUCKET_BYTES;
+         r.num_buckets <<= 1);
+    header = sizeof(r) + r.num_buckets * sizeof(r.buckets[0]);
+    header = (header + 63) & ~(size_t) 63;
+    check((uint64_t) header + (uint64_t) r.num_pages * CACHE_PAGE_SIZE
+          <= UINT32_MAX, "The response cache must be smaller than 4 GB");
+    r.pages = header;
+    region_size = header + (size_t) r.num_pages * CACHE_PAGE_SIZE;
+
+    for (slot = SMALLEST_SLOT; slot < CACHE_PAGE_SIZE;
+         slot = (slot + slot / 4 + 63) & ~63U)
+        r.classes[r.num_classes++].size = slot;
+    r.classes[r.num_classes++].size = CACHE_PAGE_SIZE;
+
+    max_object = min(max, CACHE_PAGE_SIZE - sizeof(struct item)
+                     - CACHE_KEY_LENGTH - CACHE_VARY_LENGTH);
+    if (max_object != max)
+        log_info("Responses of up to %zu bytes are cached", max_object);
+
+    fd = shm_open(SHM_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    check(fd != -1, "Cannot create shared memory.");
+
+    check(ftruncate(fd, region_size) != -1, "Cannot resize the object");
+
+    /*
+     * The pages are only backed by memory once they are used.
+     */
+    region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                  0);
+    check(region != MAP_FAILED, "Cannot map?!");
+    close(fd);
+
+    memcpy(region, &r, sizeof(r));
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&region->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return 0;
+
+  error:
+    region = NULL;
+    max_object = 0;
+    CLOSEFD(fd);
+    shm_unlink(SHM_NAME);
+    return -1;
+}
+
+void
+cache_destroy(void)
+{
+    if (region == NULL)
+        return;
+    shm_unlink(SHM_NAME);
+}
+
+size_t
+cache_max_object(void)
+{
+    return max_object;
+}
+
+int
+cache_key(char *key, const char *head, const size_t length,
+          const char *hostname, const char *port)
+{
+    const char     *end = head + length,
+                   *target,
+                   *stop,
+                   *p;
+    size_t          n;
+    int             k;
+
+    if (length < 4 || strncmp(head, "GET ", 4) != 0)
+        return -1;
+
+    /*
+     * RFC 7234 3.2: a shared cache does not keep the responses to
+     * authenticated requests.
+     */
+    p = head;
+    if (cache_control(head, end, "no-store", NULL)
+        || next_field(&p, end, "Authorization:", &target, &n))
+        return -1;
+
+    target = head + 4;
+    stop = memchr(target, ' ', end - target);
+    if (stop == NULL)
+        return -1;
+
+    /*
+     * The request line may have the absolute URL or only its path.
+     */
+    if (stop - target > (int) strlen(HTTP_SCHEME_PREFIX)
+        && strncasecmp(target, HTTP_SCHEME_PREFIX,
+                       strlen(HTTP_SCHEME_PREFIX)) == 0) {
+        target += strlen(HTTP_SCHEME_PREFIX);
+        while (target < stop && *target != '/')
+            target++;
+    }
+
+    k = snprintf(key, CACHE_KEY_LENGTH, "GET %s%s:%s%s%.*s",
+                 HTTP_SCHEME_PREFIX, hostname, port, target == stop ? "/" : "",
+                 (int) (stop - target), target);
+    if (k < 0 || k >= CACHE_KEY_LENGTH)
+        return -1;
+
+    /*
+     * Host names are case-insensitive.
+     */
+    for (p = key + 4 + strlen(HTTP_SCHEME_PREFIX); *p != ':'; p++)
+        key[p - key] = tolower((unsigned char) *p);
+    return 0;
+}
+
+int
+cache_accepts(const char *head, const size_t length, long *max_age)
+{
+    const char     *end = head + length,
+                   *p = head,
+                   *value;
+    size_t          n;
+
+    if (cache_control(head, end, "no-cache", NULL)
+        || (next_field(&p, end, "Pragma:", &value, &n)
+            && n >= 8 && strncasecmp(value, "no-cache", 8) == 0))
+        return 0;
+    *max_age = -1;
+    cache_control(head, end, "max-age", max_age);
+    return 1;
+}
+
+char           *
+cache_get(const char *key, const char *head, const size_t length,
+          size_t *response_length)
+{
+    const char     *p;
+    struct item    *it;
+    struct slab_class *c;
+    uint32_t        h,
+                    offset,
+                    next;
+    time_t          t = time(NULL);
+    long            age,
+                    max_age;
+    char           *copy = NULL;
+    int             k;
+
+    if (region == NULL || !cache_accepts(head, length, &max_age))
+        return NULL;
+
+    h = hash(key);
+    cache_lock();
+    for (offset = region->buckets[h & (region->num_buckets - 1)];
+         offset != 0; offset = next) {
+        it = ITEM(offset);
+        next = it->hash_next;
+        if (it->hash != h || strcmp(it->data, key) != 0)
+            continue;
+        if (it->expires <= t) {
+            item_free(offset);
+            continue;
+        }
+        age = it->age + (t - it->stored);
+        if (!cache_vary_match(it->data + it->key_length, it->vary_length,
+                              head, length)
+            || (max_age >= 0 && age > max_age))
+            continue;
+
+        /*
+         * RFC 7234 5.1: with an Age field, after the status line.
+         */
+        copy = malloc(it->length + 32);
+        if (copy == NULL)
+            break;
+        p = it->data + it->key_length + it->vary_length;
+        memcpy(copy, p, it->line_length);
+        k = sprintf(copy + it->line_length, "Age: %ld\r\n", age);
+        memcpy(copy + it->line_length + k, p + it->line_length,
+               it->length - it->line_length);
+        *response_length = it->length + k;
+
+        it->used = t;
+        c = &region->classes[it->class];
+        lru_unlink(c, offset);
+        lru_push(c, offset);
+        break;
+    }
+    cache_unlock();
+    return copy;
+}
+
+/*
+ * Hop-by-hop fields, and Age, which is worked out again for every hit.
+ */
+static int
+is_dropped(const char *line, const char *eol)
+{
+    static const char *const names[] = {
+        "Connection:", "Keep-Alive:", "Proxy-Connection:", "Age:", NULL
+    };
+    int             i;
+
+    for (i = 0; names[i] != NULL; i++) {
+        if ((size_t) (eol - line) >= strlen(names[i])
+            && strncasecmp(line, names[i], strlen(names[i])) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+size_t
+cache_header_length(const char *response, const size_t n)
+{
+    const char     *end = memmem(response, n, "\r\n\r\n", 4);
+
+    return end == NULL ? 0 : end + 4 - response;
+}
+
+int
+cache_policy(struct cache_policy *policy, const char *head,
+             const size_t length, const char *response,
+             const size_t response_length)
+{
+    const char     *end,
+                   *p,
+                   *value;
+    time_t          t = time(NULL),
+                    date,
+                    expires;
+    size_t          n;
+
+    policy->header_length = cache_header_length(response, response_length);
+    if (policy->header_length < 12 || strncmp(response, "HTTP/", 5) != 0
+        || !is_cacheable(atoi(response + 9)))
+        return -1;
+    end = response + policy->header_length;
+
+    /*
+     * RFC 7234 3: only what the server says may be kept in a shared cache,
+     * and for how long. Set-Cookie is meant for one client only.
+     */
+    p = response;
+    if (cache_control(response, end, "no-store", NULL)
+        || cache_control(response, end, "no-cache", NULL)
+        || cache_control(response, end, "private", NULL)
+        || next_field(&p, end, "Set-Cookie:", &value, &n))
+        return -1;
+
+    date = field_date(response, end, "Date:");
+    policy->lifetime = -1;
+    if (!cache_control(response, end, "s-maxage", &policy->lifetime))
+        cache_control(response, end, "max-age", &policy->lifetime);
+    if (policy->lifetime < 0) {
+        expires = field_date(response, end, "Expires:");
+        if (expires == -1)
+            return -1;
+        policy->lifetime = expires - (date == -1 ? t : date);
+    }
+
+    policy->age = 0;
+    p = response;
+    if (next_field(&p, end, "Age:", &value, &n))
+        policy->age = max(0, number(value, value + n));
+    if (date != -1 && t > date)
+        policy->age = max(policy->age, t - date);
+    if (policy->lifetime <= policy->age)
+        return -1;
+
+    policy->vary_length = vary_fields(policy->vary, response, end, head,
+                                      head + length);
+    return policy->vary_length == -1 ? -1 : 0;
+}
+
+size_t
+cache_header(char *out, const char *response, const size_t header_length,
+             size_t *line_length)
+{
+    const char     *end = response + header_length,
+                   *line,
+                   *eol;
+    size_t          used = 0;
+
+    for (line = response; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        if (line == response)
+            *line_length = eol + 1 - line;
+        else if (is_dropped(line, eol))
+            continue;
+        memcpy(out + used, line, eol + 1 - line);
+        used += eol + 1 - line;
+    }
+    return used;
+}
+
+void
+cache_put(const char *key, const char *head, const size_t length,
+          const char *response, const size_t response_length)
+{
+    struct cache_policy policy;
+    struct item    *it;
+    uint32_t        h,
+                    offset,
+                    next,
+                    class;
+    time_t          t = time(NULL);
+    size_t          used,
+                    line_length;
+    char           *out;
+
+    if (region == NULL || response_length > max_object
+        || cache_policy(&policy, head, length, response,
+                        response_length) == -1)
+        return;
+
+    h = hash(key);
+    cache_lock();
+
+    /*
+     * The new response replaces the one it is fresher than.
+     */
+    for (offset = region->buckets[h & (region->num_buckets - 1)];
+         offset != 0; offset = next) {
+        it = ITEM(offset);
+        next = it->hash_next;
+        if (it->hash == h && strcmp(it->data, key) == 0
+            && it->vary_length == (uint32_t) policy.vary_length
+            && memcmp(it->data + it->key_length, policy.vary,
+                      policy.vary_length) == 0)
+            item_free(offset);
+    }
+
+    offset = item_alloc(sizeof(struct item) + strlen(key) + 1
+                        + policy.vary_length + response_length, &class);
+    if (offset == 0) {
+        cache_unlock();
+        return;
+    }
+
+    it = ITEM(offset);
+    it->hash = h;
+    it->class = class;
+    it->key_length = strlen(key) + 1;
+    it->vary_length = policy.vary_length;
+    it->age = policy.age;
+    it->stored = t;
+    it->expires = t + policy.lifetime - policy.age;
+    it->used = t;
+    memcpy(it->data, key, it->key_length);
+    memcpy(it->data + it->key_length, policy.vary, policy.vary_length);
+
+    /*
+     * The header, without the fields that are not the server's to keep.
+     */
+    out = it->data + it->key_length + policy.vary_length;
+    used = cache_header(out, response, policy.header_length, &line_length);
+    it->line_length = line_length;
+    memcpy(out + used, response + policy.header_length,
+           response_length - policy.header_length);
+    it->length = used + (response_length - policy.header_length);
+
+    it->hash_next = region->buckets[h & (region->num_buckets - 1)];
+    region->buckets[h & (region->num_buckets - 1)] = offset;
+    lru_push(&region->classes[class], offset);
+    cache_unlock();
+}
@@ -0,0 +1,138 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <sys/types.h>
+
+/*
+ * Default bounds of the response cache.
+ */
+#define CACHE_DEFAULT_SIZE       0      /* In megabytes, 0 for no cache */
+#define CACHE_DEFAULT_MAX_OBJECT 512    /* In kbytes */
+
+/*
+ * The longest key, with its NUL.
+ */
+#define CACHE_KEY_LENGTH 1024
+
+/*
+ * The longest list of request fields a response varies with, as kept.
+ */
+#define CACHE_VARY_LENGTH 512
+
+/*
+ * What a response says about being kept by a shared cache.
+ */
+struct cache_policy {
+    long            lifetime;   /* Seconds it is fresh for */
+    long            age;        /* Its age when received */
+    size_t          header_length;
+    int             vary_length;
+    char            vary[CACHE_VARY_LENGTH];    /* "name:value" lines */
+};
+
+/*
+ * Creates the cache of `size` bytes in shared memory, for responses of up to
+ * `max_object` bytes. It must be called before the processes that use the
+ * cache are forked.
+ * Returns 0 on success, -1 on failure.
+ */
+int             cache_init(const size_t size, const size_t max_object);
+void            cache_destroy(void);
+
+/*
+ * Returns the size of the largest response that can be cached, 0 if there
+ * is no cache.
+ */
+size_t          cache_max_object(void);
+
+/*
+ * Copies to `key` the key of the request whose header is the `length` bytes
+ * of `head`: its method and absolute URL on `hostname`:`port`.
+ * Returns 0, or -1 if the response to the request cannot be cached at all.
+ */
+int             cache_key(char *key, const char *head, const size_t length,
+                          const char *hostname, const char *port);
+
+/*
+ * Returns 1 if the request `head` may be answered from a cache, with
+ * `max_age` set to the oldest response it takes or -1; 0 otherwise.
+ */
+int             cache_accepts(const char *head, const size_t length,
+                              long *max_age);
+
+/*
+ * Returns the length of the header at the start of the `n` bytes of
+ * `response`, or 0 if it is not all there.
+ */
+size_t          cache_header_length(const char *response, const size_t n);
+
+/*
+ * Fills `policy` from the header of `response`, the response to the request
+ * `head`, which must be complete in its `response_length` bytes.
+ * Returns 0, or -1 if the response may not be kept.
+ */
+int             cache_policy(struct cache_policy *policy, const char *head,
+                             const size_t length, const char *response,
+                             const size_t response_length);
+
+/*
+ * Returns 1 if the request `head` has the values of `vary`, as filled by
+ * cache_policy(), for the fields a response varies with; 0 otherwise.
+ */
+int             cache_vary_match(const char *vary, const size_t vary_length,
+                                 const char *head, const size_t length);
+
+/*
+ * Copies to `out` the `header_length` bytes of header at the start of
+ * `response`, without the fields that are not the server's to keep, and
+ * sets `line_length` to the length of its status line.
+ * Returns the length copied, never more than `header_length`.
+ */
+size_t          cache_header(char *out, const char *response,
+                             const size_t header_length,
+                             size_t *line_length);
+
+/*
+ * Looks up a fresh response to the request `head`, whose key is `key`, that
+ * the request allows to be served from the cache.
+ * Returns a copy of the response, with its length in `response_length`, to
+ * be freed by the caller; or NULL.
+ */
+char           *cache_get(const char *key, const char *head,
+                          const size_t length, size_t *response_length);
+
+/*
+ * Caches `response`, the complete response to the request `head` whose key
+ * is `key`, if it says for how long it may be.
+ */
+void            cache_put(const char *key, const char *head,
+                          const size_t length, const char *response,
+                          const size_t response_length);
+
+#endif                          /* CACHE_H_ */
@@ -0,0 +1,302 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Collapsed forwarding: a response that may be cached is fetched by one child
+ * or connection at a time, the leader. The others that want it meanwhile, the
+ * followers, wait for it in the table of the fetches under way, in shared
+ * memory, rather than connecting to the server too. A follower of the event
+ * engine cannot wait: it polls the table instead.
+ *
+ * A response that goes to the disk cache is streamed to the followers from
+ * there as the leader writes it. Any other one is looked up in the cache once
+ * the leader is done. If it turns out not to be cached, or the leader gives
+ * up or dies, the followers fetch it themselves.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>           /* Defines mode constants */
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>              /* Defines O_* constants */
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "collapse.h"
+#include "dbg.h"
+#include "disk.h"
+#include "utils.h"
+#include "webproxy.h"
+
+#define SHM_NAME "webcollapse_shm"
+
+/*
+ * The followers of a streamed response are woken up every time this many
+ * more bytes are written, rather than at every write.
+ */
+#define WAKE_BYTES      KBYTES_TO_BYTES(256)
+
+struct flight {
+    pid_t           leader;     /* 0 once it is gone */
+    int             users;      /* The leader and the followers, 0 if free */
+    enum flight_state state;
+    struct disk_hit hit;        /* Where it is streamed */
+    size_t          written;
+    size_t          woken;      /* `written` when the followers last were */
+    pthread_cond_t  cond;
+    char            key[CACHE_KEY_LENGTH];
+};
+
+struct table {
+    pthread_mutex_t lock;
+    int             num_flights;
+    struct flight   flights[];
+};
+
+static struct table *table = NULL;
+
+static void
+collapse_lock(void)
+{
+    if (pthread_mutex_lock(&table->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&table->lock);
+}
+
+static void
+collapse_unlock(void)
+{
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Wakes up the followers. The lock must be held.
+ */
+static void
+wake(struct flight *f, const enum flight_state state)
+{
+    f->state = state;
+    f->woken = f->written;
+    pthread_cond_broadcast(&f->cond);
+}
+
+/*
+ * Fails the fetch if its leader has died without leaving. The lock must be
+ * held.
+ */
+static void
+check_leader(struct flight *f)
+{
+    if ((f->state == FLIGHT_FETCHING || f->state == FLIGHT_STREAMING)
+        && f->leader > 0 && kill(f->leader, 0) == -1 && errno == ESRCH) {
+        wake(f, FLIGHT_FAILED);
+        f->leader = 0;
+        f->users--;
+    }
+}
+
+int
+collapse_init(const int size)
+{
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    size_t          table_size;
+    int             fd = -1,
+                    i;
+
+    table_size = sizeof(struct table) + size * sizeof(struct flight);
+
+    fd = shm_open(SHM_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    check(fd != -1, "Cannot create shared memory.");
+
+    check(ftruncate(fd, table_size) != -1, "Cannot resize the object");
+
+    table = mmap(NULL, table_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 0);
+    check(table != MAP_FAILED, "Cannot map?!");
+    close(fd);
+
+    table->num_flights = size;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&table->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    for (i = 0; i < size; i++)
+        pthread_cond_init(&table->flights[i].cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    return 0;
+
+  error:
+    table = NULL;
+    CLOSEFD(fd);
+    shm_unlink(SHM_NAME);
+    return -1;
+}
+
+void
+collapse_destroy(void)
+{
+    if (table == NULL)
+        return;
+    shm_unlink(SHM_NAME);
+}
+
+int
+collapse_join(const char *key, int *leader)
+{
+    struct flight  *f,
+                   *unused = NULL;
+    int             i;
+
+    *leader = 0;
+    if (table == NULL || strlen(key) >= CACHE_KEY_LENGTH)
+        return -1;
+
+    collapse_lock();
+    for (i = 0; i < table->num_flights; i++) {
+        f = &table->flights[i];
+        if (f->users == 0) {
+            if (unused == NULL)
+                unused = f;
+        } else if ((f->state == FLIGHT_FETCHING
+                    || f->state == FLIGHT_STREAMING)
+                   && strcmp(f->key, key) == 0) {
+            f->users++;
+            collapse_unlock();
+            return i;
+        }
+    }
+
+    if (unused == NULL) {
+        collapse_unlock();
+        return -1;
+    }
+    f = unused;
+    f->leader = getpid();
+    f->users = 1;
+    f->state = FLIGHT_FETCHING;
+    memset(&f->hit, 0, sizeof(f->hit));
+    f->written = 0;
+    f->woken = 0;
+    strcpy(f->key, key);
+    collapse_unlock();
+
+    *leader = 1;
+    return f - table->flights;
+}
+
+void
+collapse_stream(const int ticket, const struct disk_write *w)
+{
+    struct flight  *f = &table->flights[ticket];
+
+    collapse_lock();
+    disk_pending(w, &f->hit, &f->written);
+    if (f->state == FLIGHT_FETCHING || f->written - f->woken >= WAKE_BYTES)
+        wake(f, FLIGHT_STREAMING);
+    collapse_unlock();
+}
+
+void
+collapse_done(const int ticket)
+{
+    struct flight  *f = &table->flights[ticket];
+
+    collapse_lock();
+    wake(f, FLIGHT_DONE);
+    f->leader = 0;
+    f->users--;
+    collapse_unlock();
+}
+
+void
+collapse_leave(const int ticket, const int leader)
+{
+    struct flight  *f = &table->flights[ticket];
+
+    collapse_lock();
+    if (leader && f->leader == getpid()) {
+        if (f->state == FLIGHT_FETCHING || f->state == FLIGHT_STREAMING)
+            wake(f, FLIGHT_FAILED);
+        f->leader = 0;
+    }
+    f->users--;
+    collapse_unlock();
+}
+
+enum flight_state
+collapse_wait(const int ticket, const size_t seen, struct disk_hit *hit,
+              size_t *written)
+{
+    struct flight  *f = &table->flights[ticket];
+    struct timespec ts;
+    enum flight_state state;
+    int             k;
+
+    collapse_lock();
+    while (f->state == FLIGHT_FETCHING
+           || (f->state == FLIGHT_STREAMING && f->written <= seen)) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += 1;
+        k = pthread_cond_timedwait(&f->cond, &table->lock, &ts);
+        if (k == EOWNERDEAD)
+            pthread_mutex_consistent(&table->lock);
+        else if (k == ETIMEDOUT)
+            check_leader(f);
+    }
+    *hit = f->hit;
+    *written = f->written;
+    state = f->state;
+    collapse_unlock();
+    return state;
+}
+
+enum flight_state
+collapse_poll(const int ticket, struct disk_hit *hit, size_t *written)
+{
+    struct flight  *f = &table->flights[ticket];
+    enum flight_state state;
+
+    collapse_lock();
+    check_leader(f);
+    *hit = f->hit;
+    *written = f->written;
+    state = f->state;
+    collapse_unlock();
+    return state;
+}
@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef COLLAPSE_H_
+#define COLLAPSE_H_
+
+#include <sys/types.h>
+
+#include "disk.h"
+
+/*
+ * Default number of responses fetched for several clients at a time.
+ */
+#define COLLAPSE_DEFAULT_SIZE 64
+
+enum flight_state {
+    FLIGHT_FETCHING,            /* By the leader */
+    FLIGHT_STREAMING,           /* To the disk cache, as it comes */
+    FLIGHT_DONE,                /* In the cache, if it may be */
+    FLIGHT_FAILED               /* Not to be waited for */
+};
+
+/*
+ * Creates the table of the `size` responses that may be fetched at a time
+ * in shared memory. It must be called before the processes that use the
+ * table are forked.
+ * Returns 0 on success, -1 on failure.
+ */
+int             collapse_init(const int size);
+void            collapse_destroy(void);
+
+/*
+ * Joins the fetch of the response whose key is `key`, or starts it, in which
+ * case `leader` is set to 1: the caller fetches it for all.
+ * Returns the ticket of the fetch, or -1 if it is not shared.
+ */
+int             collapse_join(const char *key, int *leader);
+
+/*
+ * The leader: the response is being written to the disk cache as `w`.
+ */
+void            collapse_stream(const int ticket,
+                                const struct disk_write *w);
+
+/*
+ * The leader: the response has been received, and cached if it may be.
+ */
+void            collapse_done(const int ticket);
+
+/*
+ * Leaves the fetch, as its `leader` or as a follower. The fetch fails if the
+ * leader leaves before it is done.
+ */
+void            collapse_leave(const int ticket, const int leader);
+
+/*
+ * Waits for the fetch to be over, or, if the response is streamed, for more
+ * than `seen` of its bytes to be written. `hit` and `written` are then set
+ * to where they are.
+ * Returns the state of the fetch.
+ */
+enum flight_state collapse_wait(const int ticket, const size_t seen,
+                                struct disk_hit *hit, size_t *written);
+
+/*
+ * Like collapse_wait(), but returns at once, for a follower that cannot
+ * block.
+ */
+enum flight_state collapse_poll(const int ticket, struct disk_hit *hit,
+                                size_t *written);
+
+#endif                          /* COLLAPSE_H_ */
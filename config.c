@@ -162,6 +162,21 @@ config_get_value(struct config_sect *sects, char *section, char *token,
     return NULL;
 }                               /* config_get_value () */
 
+int
+config_count(struct config_sect *sects, char *section)
+{
+    struct config_token *tokens;
+    int             count = 0;
+
+    for (; sects != NULL; sects = sects->next) {
+        if (strcasecmp(section, sects->name) != 0)
+            continue;
+        for (tokens = sects->tokens; tokens != NULL; tokens = tokens->next)
+            count++;
+    }
+    return count;
+}                               /* config_count () */
+
 void
 config_dump(struct config_sect *sects)
 {
@@ -28,6 +28,7 @@ struct config_sect {
 struct config_sect *config_load(char *filename);
 char           *config_get_value(struct config_sect *sect, char *section,
                                  char *token, int icase);
+int             config_count(struct config_sect *sects, char *section);
 void            config_dump(struct config_sect *sects);
 void            config_destroy(struct config_sect *sects);
 
@@ -0,0 +1,733 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Disk tier of the response cache, for the responses too large to be kept in
+ * memory.
+ *
+ * The responses are written one after another to a store file used as a
+ * ring: once its end is reached, writing starts over from the beginning, over
+ * the oldest responses. Nothing is evicted to make room; a response is simply
+ * gone once the write position has come a whole store past it. The record it
+ * leaves in the index is ignored from then on, and dropped by the
+ * housekeeping process as it sweeps the index (disk_sweep()).
+ *
+ * The index is a hash table with open addressing, in a file that every
+ * process maps, so it lasts across restarts along with the store. A record is
+ * only added once its response is written. The housekeeping process regularly
+ * writes the store out, then the index, and only then lets the writers go a
+ * quarter of the ring further (the lease). When the cache is opened again,
+ * the records added since the store was last written out are dropped, as are
+ * those the lease let be overwritten: even after a crash, the records left
+ * are those of the responses in the store.
+ *
+ * Hits are sent from the page cache with sendfile(2). A response can still be
+ * overwritten while it is sent, so it goes in pieces, and the connection is
+ * given up on if the write position has come around to the piece just sent.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>           /* Defines mode constants */
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>              /* Defines O_* constants */
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "dbg.h"
+#include "disk.h"
+#include "utils.h"
+#include "webproxy.h"
+
+#define DISK_MAGIC      0x57504443u     /* "WPDC" */
+#define DISK_VERSION    1
+#define RECORD_MAGIC    0x57505243u     /* "WPRC" */
+
+/*
+ * Records start on a page of the store.
+ */
+#define DISK_ALIGN      4096
+
+/*
+ * Bytes of store per slot of the index, and the most slots a key is looked
+ * for in.
+ */
+#define SLOT_BYTES      KBYTES_TO_BYTES(64)
+#define MAX_PROBE       16
+
+/*
+ * A hit is sent in pieces of this many bytes.
+ */
+#define SEND_PIECE      KBYTES_TO_BYTES(1024)
+
+/*
+ * Seconds between the times the cache is written out, and the number of
+ * slices the index is swept in, one a second.
+ */
+#define SYNC_INTERVAL   30
+#define SWEEP_SLICES    60
+
+enum slot_state {
+    SLOT_FREE = 0,
+    SLOT_USED,
+    SLOT_DELETED                /* Free, but the probe goes on */
+};
+
+struct slot {
+    uint64_t        hash;       /* Of the key */
+    uint64_t        vary_hash;  /* Of the request fields it varies with */
+    uint64_t        position;   /* Of the record */
+    uint64_t        sequence;   /* In which the records were added */
+    uint64_t        length;     /* Of the response */
+    int64_t         stored;
+    int64_t         expires;
+    uint32_t        age;        /* When it was stored */
+    uint32_t        line_length;
+    uint32_t        data;       /* Offset of the response in the record */
+    uint32_t        state;
+};
+
+/*
+ * Positions only grow. A position is at its remainder by the capacity in the
+ * store.
+ */
+struct index {
+    uint32_t        magic;
+    uint32_t        version;
+    uint64_t        capacity;   /* Of the store */
+    uint64_t        num_slots;
+    uint64_t        position;   /* Where the next record goes */
+    uint64_t        limit;      /* Which the records may not go past */
+    uint64_t        lease;      /* The limit, as written out */
+    uint64_t        sequence;   /* Of the next record */
+    uint64_t        synced;     /* The records before it are written out */
+    uint64_t        sweep;      /* The next slot swept */
+    pthread_mutex_t lock;
+    struct slot     slots[];
+};
+
+/*
+ * The start of a record in the store, followed by the key, the request
+ * fields the response varies with, and the response.
+ */
+struct record {
+    uint32_t        magic;
+    uint32_t        key_length; /* With its NUL */
+    uint32_t        vary_length;
+    uint32_t        reserved;
+    uint64_t        position;
+};
+
+struct disk_write {
+    struct slot     slot;
+    size_t          size;       /* Of the record */
+    size_t          written;
+};
+
+static struct index *idx = NULL;
+static size_t   index_size = 0;
+static int      index_fd = -1;
+static int      store_fd = -1;
+static size_t   max_object = 0;
+static time_t   synced_at = 0;
+
+/*
+ * FNV-1a of the `n` bytes of `s`.
+ */
+static uint64_t
+hash64(const char *s, size_t n)
+{
+    uint64_t        h = 14695981039346656037ull;
+
+    while (n-- > 0)
+        h = (h ^ (unsigned char) *s++) * 1099511628211ull;
+
+    return h;
+}
+
+static void
+disk_lock(void)
+{
+    /*
+     * A slot is filled in before it is marked used, so whatever a dead
+     * process left is consistent.
+     */
+    if (pthread_mutex_lock(&idx->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&idx->lock);
+}
+
+static void
+disk_unlock(void)
+{
+    pthread_mutex_unlock(&idx->lock);
+}
+
+/*
+ * Returns 1 if the record at `position` has not been written over, 0
+ * otherwise.
+ */
+static int
+is_intact(const uint64_t position)
+{
+    return __atomic_load_n(&idx->position, __ATOMIC_ACQUIRE)
+        <= position + idx->capacity;
+}
+
+/*
+ * Returns 1 if `s` holds a fresh response, 0 otherwise.
+ */
+static int
+is_live(const struct slot *s, const time_t t)
+{
+    return s->state == SLOT_USED && s->expires > t && is_intact(s->position);
+}
+
+/*
+ * Writes the store out, then the index with it, and lets the writers go
+ * `ahead` bytes past the write position.
+ */
+static void
+flush(const uint64_t ahead)
+{
+    uint64_t        sequence;
+
+    disk_lock();
+    sequence = idx->sequence;
+    disk_unlock();
+
+    if (fdatasync(store_fd) == -1) {
+        log_warn("Cannot write the disk cache out");
+        return;
+    }
+
+    disk_lock();
+    idx->synced = sequence;
+    idx->lease = idx->position + ahead;
+    disk_unlock();
+
+    /*
+     * The lease is written out before it is used.
+     */
+    if (msync(idx, index_size, MS_SYNC) == -1) {
+        log_warn("Cannot write the index of the disk cache out");
+        return;
+    }
+
+    disk_lock();
+    idx->limit = idx->lease;
+    disk_unlock();
+    synced_at = time(NULL);
+}
+
+int
+disk_open(const char *dir, const size_t size, const size_t max)
+{
+    pthread_mutexattr_t attr;
+    char            path[PATH_MAX];
+    struct stat     st;
+    struct flock    fl;
+    struct slot    *s;
+    uint64_t        capacity,
+                    num_slots,
+                    i;
+    int             fresh,
+                    kept = 0;
+
+    capacity = size / DISK_ALIGN * DISK_ALIGN;
+    check(capacity >= KBYTES_TO_BYTES(1024),
+          "The disk cache must have at least 1 MB");
+    for (num_slots = 1024; num_slots < capacity / SLOT_BYTES;
+         num_slots <<= 1);
+    index_size = sizeof(struct index) + num_slots * sizeof(struct slot);
+
+    snprintf(path, sizeof(path), "%s/store", dir);
+    store_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    check(store_fd != -1, "Cannot open %s", path);
+    check(fstat(store_fd, &st) != -1, "Cannot stat %s", path);
+    fresh = (uint64_t) st.st_size != capacity;
+    if (fresh)
+        check(ftruncate(store_fd, capacity) != -1, "Cannot resize %s", path);
+
+    snprintf(path, sizeof(path), "%s/index", dir);
+    index_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    check(index_fd != -1, "Cannot open %s", path);
+
+    /*
+     * Held by this process only, not by the children it forks: those still
+     * serving once it exits do not keep the next one from opening the cache.
+     */
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    check(fcntl(index_fd, F_SETLK, &fl) != -1,
+          "The disk cache in %s is in use", dir);
+    check(fstat(index_fd, &st) != -1, "Cannot stat %s", path);
+    if ((size_t) st.st_size != index_size) {
+        fresh = 1;
+        check(ftruncate(index_fd, index_size) != -1, "Cannot resize %s",
+              path);
+    }
+
+    idx = mmap(NULL, index_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               index_fd, 0);
+    check(idx != MAP_FAILED, "Cannot map %s", path);
+
+    if (fresh || idx->magic != DISK_MAGIC || idx->version != DISK_VERSION
+        || idx->capacity != capacity || idx->num_slots != num_slots) {
+        memset(idx, 0, index_size);
+        idx->magic = DISK_MAGIC;
+        idx->version = DISK_VERSION;
+        idx->capacity = capacity;
+        idx->num_slots = num_slots;
+    } else {
+        /*
+         * Nothing was written past the lease, so writing goes on from
+         * there.
+         */
+        for (i = 0; i < num_slots; i++) {
+            s = &idx->slots[i];
+            if (s->state != SLOT_USED)
+                continue;
+            if (s->sequence >= idx->synced
+                || s->position + capacity < idx->lease)
+                s->state = SLOT_DELETED;
+            else
+                kept++;
+        }
+        idx->position = idx->lease;
+        if (kept > 0)
+            log_info("Kept %d responses in the disk cache", kept);
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&idx->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    max_object = min(max, capacity / 8);
+    if (max_object != max)
+        log_info("Responses of up to %zu bytes are cached on disk",
+                 max_object);
+
+    flush(capacity / 4);
+    return 0;
+
+  error:
+    if (idx != NULL && idx != MAP_FAILED)
+        munmap(idx, index_size);
+    idx = NULL;
+    max_object = 0;
+    CLOSEFD(index_fd);
+    CLOSEFD(store_fd);
+    return -1;
+}
+
+void
+disk_close(void)
+{
+    if (idx == NULL)
+        return;
+
+    /*
+     * Without a lease, so that the next disk_open() keeps all it can.
+     */
+    flush(0);
+    munmap(idx, index_size);
+    idx = NULL;
+    max_object = 0;
+    CLOSEFD(index_fd);
+    CLOSEFD(store_fd);
+}
+
+size_t
+disk_max_object(void)
+{
+    return max_object;
+}
+
+int
+disk_get(const char *key, const char *head, const size_t length,
+         struct disk_hit *hit)
+{
+    struct slot     found[MAX_PROBE],
+                   *s;
+    uint64_t        h,
+                    mask,
+                    i;
+    time_t          t = time(NULL);
+    long            age,
+                    max_age;
+    int             n = 0,
+                    k;
+
+    if (idx == NULL || !cache_accepts(head, length, &max_age))
+        return -1;
+
+    h = hash64(key, strlen(key));
+    mask = idx->num_slots - 1;
+    disk_lock();
+    for (i = 0; i < MAX_PROBE; i++) {
+        s = &idx->slots[(h + i) & mask];
+        if (s->state == SLOT_FREE)
+            break;
+        if (s->hash == h && is_live(s, t))
+            found[n++] = *s;
+    }
+    disk_unlock();
+
+    for (k = 0; k < n; k++) {
+        s = &found[k];
+        age = s->age + (t - s->stored);
+        if (max_age >= 0 && age > max_age)
+            continue;
+
+        hit->position = s->position;
+        hit->offset = s->position % idx->capacity + s->data;
+        hit->length = s->length;
+        hit->line_length = s->line_length;
+        hit->age = age;
+        if (disk_matches(hit, key, head, length))
+            return 0;
+    }
+    return -1;
+}
+
+int
+disk_matches(const struct disk_hit *hit, const char *key, const char *head,
+             const size_t length)
+{
+    char            buf[sizeof(struct record) + CACHE_KEY_LENGTH
+                        + CACHE_VARY_LENGTH];
+    struct record  *r = (struct record *) buf;
+    size_t          key_length = strlen(key) + 1,
+                    data = hit->offset - hit->position % idx->capacity;
+
+    /*
+     * The key and the request fields are in the record.
+     */
+    if (data > sizeof(buf)
+        || pread(store_fd, buf, data, hit->position % idx->capacity)
+        != (ssize_t) data)
+        return 0;
+    return r->magic == RECORD_MAGIC && r->position == hit->position
+        && r->key_length == key_length
+        && sizeof(*r) + r->key_length + r->vary_length == data
+        && memcmp(buf + sizeof(*r), key, key_length) == 0
+        && cache_vary_match(buf + sizeof(*r) + key_length, r->vary_length,
+                            head, length)
+        && is_intact(hit->position);
+}
+
+ssize_t
+disk_head(const struct disk_hit *hit, char *buf, const size_t size)
+{
+    int             k;
+
+    if (hit->line_length + 32 > size
+        || pread(store_fd, buf, hit->line_length, hit->offset)
+        != (ssize_t) hit->line_length)
+        return -1;
+
+    /*
+     * RFC 7234 5.1: with an Age field, after the status line.
+     */
+    k = snprintf(buf + hit->line_length, size - hit->line_length,
+                 "Age: %ld\r\n", hit->age);
+    return hit->line_length + k;
+}
+
+ssize_t
+disk_read(const struct disk_hit *hit, const size_t from, char *buf,
+          const size_t n)
+{
+    size_t          left = hit->length - hit->line_length - from;
+    ssize_t         k;
+
+    if (left == 0)
+        return 0;
+    k = pread(store_fd, buf, min(n, left),
+              hit->offset + hit->line_length + from);
+    if (k == -1 || !is_intact(hit->position))
+        return -1;
+    return k;
+}
+
+int
+disk_send(const struct disk_hit *hit, int sfd)
+{
+    char            buf[DISK_HEAD_SIZE];
+    ssize_t         k;
+
+    k = disk_head(hit, buf, sizeof(buf));
+    if (k == -1 || send(sfd, buf, k, MSG_MORE | MSG_NOSIGNAL) != k)
+        return -1;
+    return disk_send_part(hit, sfd, hit->line_length, hit->length);
+}
+
+int
+disk_send_part(const struct disk_hit *hit, int sfd, const size_t from,
+               const size_t to)
+{
+    size_t          sent;
+    ssize_t         k;
+
+    for (sent = from; sent < to; sent += k) {
+        k = disk_send_some(hit, sfd, sent, to);
+        if (k == -1 && errno == EINTR)
+            k = 0;
+        else if (k <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+ssize_t
+disk_send_some(const struct disk_hit *hit, int sfd, const size_t from,
+               const size_t to)
+{
+    off_t           offset = hit->offset + from;
+    ssize_t         k;
+
+    k = sendfile(sfd, store_fd, &offset, min((size_t) SEND_PIECE, to - from));
+    if (k > 0 && !is_intact(hit->position)) {
+        errno = ESTALE;
+        return -1;
+    }
+    return k;
+}
+
+int
+disk_write(struct disk_write *w, const char *buf, const size_t n)
+{
+    off_t           offset;
+    size_t          done;
+    ssize_t         k;
+
+    if (w->written + n > w->size)
+        return -1;
+
+    offset = w->slot.position % idx->capacity + w->written;
+    for (done = 0; done < n; done += k) {
+        k = pwrite(store_fd, buf + done, n - done, offset + done);
+        if (k == -1 && errno == EINTR)
+            k = 0;
+        else if (k <= 0)
+            return -1;
+    }
+    w->written += n;
+    return 0;
+}
+
+struct disk_write *
+disk_begin(const char *key, const char *head, const size_t length,
+           const char *response, const size_t n, const size_t total)
+{
+    struct cache_policy policy;
+    struct disk_write *w = NULL;
+    struct record   r;
+    char           *header = NULL;
+    size_t          key_length = strlen(key) + 1,
+                    used,
+                    line_length;
+    uint64_t        at;
+    time_t          t = time(NULL);
+
+    if (idx == NULL || total < n
+        || cache_policy(&policy, head, length, response, n) == -1
+        || sizeof(r) + key_length + policy.vary_length + total > max_object)
+        return NULL;
+
+    header = malloc(policy.header_length);
+    w = calloc(1, sizeof(*w));
+    if (header == NULL || w == NULL)
+        goto error;
+    used = cache_header(header, response, policy.header_length,
+                        &line_length);
+    if (line_length > DISK_LINE_LENGTH)
+        goto error;
+
+    w->slot.hash = hash64(key, key_length - 1);
+    w->slot.vary_hash = hash64(policy.vary, policy.vary_length);
+    w->slot.length = used + (total - policy.header_length);
+    w->slot.stored = t;
+    w->slot.expires = t + policy.lifetime - policy.age;
+    w->slot.age = policy.age;
+    w->slot.line_length = line_length;
+    w->slot.data = sizeof(r) + key_length + policy.vary_length;
+    w->size = w->slot.data + w->slot.length;
+
+    /*
+     * A record does not go round the end of the store: the rest of it is
+     * skipped.
+     */
+    disk_lock();
+    at = idx->position;
+    if (at % idx->capacity + w->size > idx->capacity)
+        at += idx->capacity - at % idx->capacity;
+    if (at + w->size > idx->limit) {
+        disk_unlock();
+        goto error;
+    }
+    __atomic_store_n(&idx->position,
+                     (at + w->size + DISK_ALIGN - 1)
+                     & ~(uint64_t) (DISK_ALIGN - 1), __ATOMIC_RELEASE);
+    disk_unlock();
+    w->slot.position = at;
+
+    memset(&r, 0, sizeof(r));
+    r.magic = RECORD_MAGIC;
+    r.key_length = key_length;
+    r.vary_length = policy.vary_length;
+    r.position = at;
+    if (disk_write(w, (char *) &r, sizeof(r)) == -1
+        || disk_write(w, key, key_length) == -1
+        || disk_write(w, policy.vary, policy.vary_length) == -1
+        || disk_write(w, header, used) == -1
+        || disk_write(w, response + policy.header_length,
+                      n - policy.header_length) == -1)
+        goto error;
+
+    free(header);
+    return w;
+
+  error:
+    FREEMEM(header);
+    FREEMEM(w);
+    return NULL;
+}
+
+void
+disk_commit(struct disk_write *w)
+{
+    struct slot    *s,
+                   *victim = NULL;
+    uint64_t        mask,
+                    i;
+    time_t          t = time(NULL);
+
+    if (w->written != w->size) {
+        disk_abort(w);
+        return;
+    }
+
+    mask = idx->num_slots - 1;
+    disk_lock();
+    if (!is_intact(w->slot.position)) {
+        disk_unlock();
+        disk_abort(w);
+        return;
+    }
+
+    /*
+     * The response replaces the one it is fresher than, or takes the first
+     * slot without a live one, or the oldest.
+     */
+    for (i = 0; i < MAX_PROBE; i++) {
+        s = &idx->slots[(w->slot.hash + i) & mask];
+        if (s->state == SLOT_USED && s->hash == w->slot.hash
+            && s->vary_hash == w->slot.vary_hash) {
+            victim = s;
+            break;
+        }
+        if (victim == NULL
+            || (is_live(victim, t)
+                && (!is_live(s, t) || s->position < victim->position)))
+            victim = s;
+        if (s->state == SLOT_FREE)
+            break;
+    }
+
+    victim->state = SLOT_DELETED;
+    w->slot.sequence = idx->sequence++;
+    w->slot.state = SLOT_DELETED;
+    *victim = w->slot;
+    __atomic_store_n(&victim->state, SLOT_USED, __ATOMIC_RELEASE);
+    disk_unlock();
+    free(w);
+}
+
+void
+disk_pending(const struct disk_write *w, struct disk_hit *hit,
+             size_t *written)
+{
+    hit->position = w->slot.position;
+    hit->offset = w->slot.position % idx->capacity + w->slot.data;
+    hit->length = w->slot.length;
+    hit->line_length = w->slot.line_length;
+    hit->age = w->slot.age;
+    *written = w->written - w->slot.data;
+}
+
+void
+disk_abort(struct disk_write *w)
+{
+    /*
+     * The space it took is written over in time.
+     */
+    free(w);
+}
+
+void
+disk_sweep(void)
+{
+    struct slot    *s;
+    uint64_t        n,
+                    i;
+    time_t          t = time(NULL);
+
+    if (idx == NULL)
+        return;
+
+    n = (idx->num_slots + SWEEP_SLICES - 1) / SWEEP_SLICES;
+    disk_lock();
+    for (i = 0; i < n; i++) {
+        s = &idx->slots[idx->sweep++ & (idx->num_slots - 1)];
+        if (s->state == SLOT_USED && !is_live(s, t))
+            s->state = SLOT_DELETED;
+    }
+    disk_unlock();
+
+    /*
+     * Early if the writers are about to run out of their lease.
+     */
+    if (t - synced_at >= SYNC_INTERVAL
+        || idx->position + idx->capacity / 8 > idx->limit)
+        flush(idx->capacity / 4);
+}
@@ -0,0 +1,175 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef DISK_H_
+#define DISK_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Default bounds of the disk cache.
+ */
+#define DISK_DEFAULT_SIZE       0       /* In megabytes, 0 for no disk cache */
+#define DISK_DEFAULT_MAX_OBJECT 64      /* In megabytes */
+
+/*
+ * The longest status line of a response kept, and the most disk_head()
+ * copies.
+ */
+#define DISK_LINE_LENGTH 1024
+#define DISK_HEAD_SIZE   (DISK_LINE_LENGTH + 32)
+
+/*
+ * A response that is being written to the disk cache.
+ */
+struct disk_write;
+
+/*
+ * A response found in the disk cache.
+ */
+struct disk_hit {
+    uint64_t        position;   /* Of its record */
+    off_t           offset;     /* Of the response in the store */
+    size_t          length;
+    size_t          line_length;        /* Of its status line */
+    long            age;
+};
+
+/*
+ * Opens the cache of `size` bytes in the directory `dir`, keeping what it
+ * held when it was last closed, for responses of up to `max_object` bytes.
+ * It must be called before the processes that use the cache are forked.
+ * Returns 0 on success, -1 on failure.
+ */
+int             disk_open(const char *dir, const size_t size,
+                          const size_t max_object);
+
+/*
+ * Writes out what is cached, so that the next disk_open() finds it.
+ */
+void            disk_close(void);
+
+/*
+ * Returns the size of the largest response that can be cached, 0 if there
+ * is no disk cache.
+ */
+size_t          disk_max_object(void);
+
+/*
+ * Looks up a fresh response to the request `head`, whose key is `key`, that
+ * the request allows to be served from the cache.
+ * Returns 0 and fills `hit`, or -1.
+ */
+int             disk_get(const char *key, const char *head,
+                         const size_t length, struct disk_hit *hit);
+
+/*
+ * Returns 1 if `hit` is still the response to the request `head`, whose key
+ * is `key`, 0 otherwise.
+ */
+int             disk_matches(const struct disk_hit *hit, const char *key,
+                             const char *head, const size_t length);
+
+/*
+ * Sends the response of `hit`, with its Age, to the socket `sfd`.
+ * Returns 0 on success, -1 on failure, which may be after a part of it.
+ */
+int             disk_send(const struct disk_hit *hit, int sfd);
+
+/*
+ * Sends the bytes of the response of `hit` from `from` to `to`, as they
+ * are in the store, to the socket `sfd`.
+ * Returns 0 on success, -1 on failure, which may be after a part of it.
+ */
+int             disk_send_part(const struct disk_hit *hit, int sfd,
+                               const size_t from, const size_t to);
+
+/*
+ * Like disk_send_part(), but makes one attempt, for a non-blocking `sfd`.
+ * Returns the number of bytes sent, or -1 with errno set, EAGAIN if `sfd`
+ * is full and ESTALE if the response has been overwritten.
+ */
+ssize_t         disk_send_some(const struct disk_hit *hit, int sfd,
+                               const size_t from, const size_t to);
+
+/*
+ * Copies to `buf` the status line of the response of `hit` and its Age
+ * field, `size` bytes at most.
+ * Returns their length, or -1.
+ */
+ssize_t         disk_head(const struct disk_hit *hit, char *buf,
+                          const size_t size);
+
+/*
+ * Copies to `buf` up to `n` bytes of the response of `hit`, from `from`
+ * bytes past its status line.
+ * Returns the number of bytes copied, 0 at the end, or -1 if the response
+ * has been overwritten.
+ */
+ssize_t         disk_read(const struct disk_hit *hit, const size_t from,
+                          char *buf, const size_t n);
+
+/*
+ * Starts caching the response to the request `head`, whose key is `key`.
+ * The `n` bytes of `response` have been received and hold its header, and
+ * `total` is its whole length.
+ * Returns the response being written, or NULL if it is not to be cached.
+ */
+struct disk_write *disk_begin(const char *key, const char *head,
+                              const size_t length, const char *response,
+                              const size_t n, const size_t total);
+
+/*
+ * Writes the next `n` bytes of the response.
+ * Returns 0 on success, -1 on failure.
+ */
+int             disk_write(struct disk_write *w, const char *buf,
+                           const size_t n);
+
+/*
+ * Fills `hit` for the response being written, and sets `written` to how
+ * many of its bytes are.
+ */
+void            disk_pending(const struct disk_write *w,
+                             struct disk_hit *hit, size_t *written);
+
+/*
+ * Adds the response, which must be complete, to the cache; or gives up on
+ * it. Either frees `w`.
+ */
+void            disk_commit(struct disk_write *w);
+void            disk_abort(struct disk_write *w);
+
+/*
+ * Housekeeping, to be called every second by one process: drops a slice of
+ * the responses that have expired or been overwritten, and regularly
+ * writes the cache out.
+ */
+void            disk_sweep(void);
+
+#endif                          /* DISK_H_ */
@@ -0,0 +1,703 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * DNS cache in POSIX shared memory, shared by all the processes.
+ *
+ * The cache is an N-way set-associative table: a name hashes to one set of
+ * WAYS records and may live in any of them. When a set is full, the least
+ * recently used record of the set is replaced. Every set keeps a short tag
+ * and the time of last use of each of its records next to its lock, so a
+ * lookup only reads one line before it touches the record that matches.
+ *
+ * Lookups are far more frequent than updates, so readers take no lock. Every
+ * record has a sequence number that is odd while the record is being written
+ * (a seqlock): a reader copies the record and retries if the sequence number
+ * was odd or has changed. The only thing a reader writes is the time of last
+ * use, and only once a second per record.
+ *
+ * Writers serialise on a per-set mutex. The mutexes are robust: if a process
+ * dies while holding one, the next writer gets EOWNERDEAD and throws the
+ * possibly half-written record away instead of waiting forever.
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>           /* Defines mode constants */
+#include <sys/time.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>              /* Defines O_* constants */
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "dnscache.h"
+#include "utils.h"
+#include "webproxy.h"
+
+#define RECORD_HOSTNAME_LENGTH 50
+
+#define SHM_NAME "dnscache_shm"
+
+/*
+ * Records per set. A power of two, at most the number of records.
+ */
+#define WAYS 8
+
+/*
+ * How many times a reader retries a record that is being written before it
+ * gives up and takes it as a miss.
+ */
+#define READ_RETRIES 64
+
+/*
+ * The part of a record that readers copy.
+ */
+struct entry {
+    char            valid;      /* 1 if valid, 0 if invalid */
+    char            hostname[RECORD_HOSTNAME_LENGTH + 1];
+    int             family;
+    socklen_t       addrlen;
+    struct sockaddr_storage sock;       /* Use sockaddr_storage to support
+                                         * both IPv4 and IPv6 */
+    struct timeval  tv;         /* When this record was written */
+};
+
+/*
+ * DNS record. Records are cache-line aligned so that writing one does not
+ * disturb readers of its neighbours.
+ */
+struct record {
+    uint32_t        seq;        /* Odd while the record is being written */
+    struct entry    e;
+} __attribute__ ((aligned(64)));
+
+/*
+ * A snapshot is a header followed by records, in the byte order of the host.
+ */
+#define SNAPSHOT_MAGIC "WPDNS\0\0\1"
+
+struct snapshot_header {
+    char            magic[8];
+    uint32_t        record_size;        /* Of the records that follow */
+    uint32_t        reserved;
+};
+
+struct snapshot_record {
+    char            hostname[RECORD_HOSTNAME_LENGTH + 1];
+    int32_t         family;
+    uint32_t        addrlen;
+    struct sockaddr_storage sock;
+    int64_t         resolved;   /* When the address was resolved */
+};
+
+struct set {
+    pthread_mutex_t lock;       /* Held by writers */
+    uint32_t        tag[WAYS];  /* Hash of the name, 0 if invalid */
+    uint32_t        used[WAYS]; /* When the record was last used */
+    struct record   way[WAYS];
+};
+
+static struct set *sets = NULL;
+static uint32_t num_sets = 0;
+
+/*
+ * FNV-1a of the lower-cased name, as names are compared case-insensitively.
+ * Never 0, which marks an invalid record.
+ */
+static uint32_t
+hash(const char *name)
+{
+    uint32_t        h = 2166136261u;
+
+    while (*name != '\0')
+        h = (h ^ (unsigned char) tolower((unsigned char) *name++))
+            * 16777619u;
+
+    return h | 1;
+}
+
+static struct set *
+set_of(const uint32_t h)
+{
+    /*
+     * The low bit is always set, so it does not pick the set.
+     */
+    return &sets[(h >> 1) & (num_sets - 1)];
+}
+
+static uint32_t
+now(void)
+{
+    return (uint32_t) time(NULL);
+}
+
+/*
+ * Called with the lock held, around any change to a record.
+ */
+static void
+write_begin(struct record *r)
+{
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+write_end(struct record *r)
+{
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+invalidate(struct set *s, const int i)
+{
+    write_begin(&s->way[i]);
+    s->way[i].e.valid = 0;
+    __atomic_store_n(&s->tag[i], 0, __ATOMIC_RELAXED);
+    write_end(&s->way[i]);
+}
+
+static void
+set_lock(struct set *s)
+{
+    int             i;
+
+    if (pthread_mutex_lock(&s->lock) != EOWNERDEAD)
+        return;
+
+    /*
+     * The previous writer died, possibly half way through a record, which
+     * is then the one with an odd sequence number.
+     */
+    log_warn("A process died while updating the DNS cache");
+    for (i = 0; i < WAYS; i++) {
+        if ((s->way[i].seq & 1) == 0)
+            continue;
+        s->way[i].e.valid = 0;
+        s->tag[i] = 0;
+        write_end(&s->way[i]);
+    }
+    pthread_mutex_consistent(&s->lock);
+}
+
+static void
+set_unlock(struct set *s)
+{
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Takes a consistent copy of `r->e`.
+ * Returns 0 on success, -1 if the record is being written.
+ */
+static int
+record_read(const struct record *r, struct entry *e)
+{
+    uint32_t        seq;
+    int             i;
+
+    for (i = 0; i < READ_RETRIES; i++) {
+        seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        memcpy(e, &r->e, sizeof(*e));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * Returns the way of `s` that holds `name`, or -1. The lock must be held.
+ */
+static int
+set_find(const struct set *s, const uint32_t h, const char *name)
+{
+    int             i;
+
+    for (i = 0; i < WAYS; i++) {
+        if (s->tag[i] == h && s->way[i].e.valid != 0
+            && strcasecmp(s->way[i].e.hostname, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Returns the way of `s` to replace: an invalid record if there is one,
+ * otherwise the least recently used. The lock must be held.
+ */
+static int
+set_victim(const struct set *s)
+{
+    uint32_t        t = now();
+    int             i,
+                    victim = 0;
+
+    for (i = 0; i < WAYS; i++) {
+        if (s->tag[i] == 0)
+            return i;
+        if (t - s->used[i] > t - s->used[victim])
+            victim = i;
+    }
+    return victim;
+}
+
+static void
+set_port(struct sockaddr_storage *sock, const char *port)
+{
+    in_port_t       p;
+
+    p = htons((in_port_t) strtol(port, (char **) NULL, 10));
+    if (sock->ss_family == AF_INET)
+        ((struct sockaddr_in *) sock)->sin_port = p;
+    else if (sock->ss_family == AF_INET6)
+        ((struct sockaddr_in6 *) sock)->sin6_port = p;
+}
+
+int
+dns_cache_init(const int num)
+{
+    pthread_mutexattr_t attr;
+    size_t          size;
+    int             fd = -1;
+    uint32_t        i;
+
+    check(num > 0, "The DNS cache must have at least one record");
+
+    /*
+     * Round up to a power of two, so that a set is picked with a mask.
+     */
+    for (num_sets = 1; num_sets * WAYS < (uint32_t) num; num_sets <<= 1);
+    if (num_sets * WAYS != (uint32_t) num)
+        log_info("The DNS cache has %u records", num_sets * WAYS);
+
+    size = num_sets * sizeof(struct set);
+
+    fd = shm_open(SHM_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    check(fd != -1, "Cannot create shared memory.");
+
+    check(ftruncate(fd, size) != -1, "Cannot resize the object");
+
+    sets = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    check(sets != MAP_FAILED, "Cannot map?!");
+    close(fd);
+
+    /*
+     * The object is new (O_EXCL), and ftruncate(2) filled it with zeros,
+     * which is an empty table.
+     */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < num_sets; i++)
+        pthread_mutex_init(&sets[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return 0;
+
+  error:
+    sets = NULL;
+    CLOSEFD(fd);
+    shm_unlink(SHM_NAME);
+    return -1;
+}
+
+void
+dns_cache_destroy(void)
+{
+    shm_unlink(SHM_NAME);
+}
+
+int
+dns_cache_get(const char *name, const char *port,
+              struct sockaddr_storage *sock, socklen_t * len, int *family)
+{
+    struct set     *s;
+    struct entry    e;
+    uint32_t        h,
+                    t;
+    int             i;
+
+    if (sets == NULL)
+        return -1;
+
+    h = hash(name);
+    s = set_of(h);
+
+    for (i = 0; i < WAYS; i++) {
+        if (__atomic_load_n(&s->tag[i], __ATOMIC_RELAXED) != h)
+            continue;
+        if (record_read(&s->way[i], &e) == -1 || e.valid == 0
+            || strcasecmp(e.hostname, name) != 0)
+            continue;
+
+        /*
+         * Only written when it changes, so that the line stays shared
+         * between the readers.
+         */
+        t = now();
+        if (__atomic_load_n(&s->used[i], __ATOMIC_RELAXED) != t)
+            __atomic_store_n(&s->used[i], t, __ATOMIC_RELAXED);
+
+        memcpy(sock, &e.sock, e.addrlen);
+        *len = e.addrlen;
+        *family = e.family;
+        set_port(sock, port);
+
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Caches `sa` as the address of `name`, resolved at `tv`, and marks it as
+ * last used at `used`.
+ */
+static void
+store(const char *name, const int family, const struct sockaddr *sa,
+      const socklen_t len, const struct timeval *tv, const uint32_t used)
+{
+    struct set     *s;
+    struct record  *r;
+    uint32_t        h;
+    int             i;
+
+    if (sets == NULL || strlen(name) > RECORD_HOSTNAME_LENGTH
+        || len > sizeof(r->e.sock))
+        return;
+
+    h = hash(name);
+    s = set_of(h);
+
+    set_lock(s);
+    i = set_find(s, h, name);
+    if (i == -1)
+        i = set_victim(s);
+    r = &s->way[i];
+
+    write_begin(r);
+    r->e.valid = 1;
+    strcpy(r->e.hostname, name);
+    r->e.family = family;
+    r->e.addrlen = len;
+    memcpy(&r->e.sock, sa, len);
+    r->e.tv = *tv;
+    __atomic_store_n(&s->tag[i], h, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->used[i], used, __ATOMIC_RELAXED);
+    write_end(r);
+    set_unlock(s);
+}
+
+void
+dns_cache_put(const char *name, const int family, const struct sockaddr *sa,
+              const socklen_t len)
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    store(name, family, sa, len, &tv, now());
+}
+
+void
+dns_cache_drop(const char *name)
+{
+    struct set     *s;
+    uint32_t        h;
+    int             i;
+
+    if (sets == NULL)
+        return;
+
+    h = hash(name);
+    s = set_of(h);
+
+    set_lock(s);
+    i = set_find(s, h, name);
+    if (i != -1)
+        invalidate(s, i);
+    set_unlock(s);
+}
+
+/*
+ * Whether `a` and `b` are the same address, whatever their ports.
+ */
+static int
+same_address(const struct sockaddr_storage *a,
+             const struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family)
+        return 0;
+    if (a->ss_family == AF_INET)
+        return memcmp(&((const struct sockaddr_in *) a)->sin_addr,
+                      &((const struct sockaddr_in *) b)->sin_addr,
+                      sizeof(struct in_addr)) == 0;
+    if (a->ss_family == AF_INET6)
+        return memcmp(&((const struct sockaddr_in6 *) a)->sin6_addr,
+                      &((const struct sockaddr_in6 *) b)->sin6_addr,
+                      sizeof(struct in6_addr)) == 0;
+    return 0;
+}
+
+int
+dns_cache_sweep(const int ttl, const int ahead, const int slices,
+                char (*names)[HOSTNAME_LENGTH], const int max)
+{
+    static uint32_t cursor = 0;
+    struct set     *s;
+    struct record  *r;
+    struct timeval  tv;
+    uint32_t        t,
+                    count,
+                    n;
+    int             found = 0;
+    int             i;
+
+    if (sets == NULL)
+        return 0;
+
+    gettimeofday(&tv, NULL);
+    t = now();
+    count = (num_sets + slices - 1) / (slices > 0 ? slices : 1);
+
+    for (n = 0; n < count; n++) {
+        s = &sets[cursor];
+        cursor = (cursor + 1) & (num_sets - 1);
+
+        for (i = 0; i < WAYS; i++) {
+            r = &s->way[i];
+            if (__atomic_load_n(&s->tag[i], __ATOMIC_RELAXED) == 0)
+                continue;
+
+            /*
+             * Only the sets with expired records are locked.
+             */
+            if (tv.tv_sec - r->e.tv.tv_sec > ttl) {
+                set_lock(s);
+                if (s->tag[i] != 0 && tv.tv_sec - r->e.tv.tv_sec > ttl)
+                    invalidate(s, i);
+                set_unlock(s);
+                continue;
+            }
+
+            /*
+             * About to expire, but still in use: worth resolving again.
+             */
+            if (found < max && ahead > 0
+                && tv.tv_sec - r->e.tv.tv_sec >= ttl - ahead
+                && t - __atomic_load_n(&s->used[i], __ATOMIC_RELAXED)
+                <= (uint32_t) ahead) {
+                set_lock(s);
+                if (s->tag[i] != 0
+                    && strlen(r->e.hostname) < HOSTNAME_LENGTH)
+                    strcpy(names[found++], r->e.hostname);
+                set_unlock(s);
+            }
+        }
+    }
+
+    return found;
+}
+
+void
+dns_cache_refresh(const char *name, const struct resolver_answer *answer)
+{
+    const struct resolver_addr *p;
+    struct set     *s;
+    struct record  *r;
+    uint32_t        h;
+    int             i,
+                    k;
+
+    if (sets == NULL || answer->error != 0 || answer->count == 0)
+        return;
+
+    h = hash(name);
+    s = set_of(h);
+
+    set_lock(s);
+    i = set_find(s, h, name);
+    if (i != -1) {
+        r = &s->way[i];
+
+        /*
+         * Keep the address in use if the name still has it.
+         */
+        p = &answer->addr[0];
+        for (k = 0; k < answer->count; k++) {
+            if (same_address(&answer->addr[k].addr, &r->e.sock)) {
+                p = &answer->addr[k];
+                break;
+            }
+        }
+
+        write_begin(r);
+        if (p->len <= sizeof(r->e.sock)) {
+            r->e.family = p->family;
+            r->e.addrlen = p->len;
+            memcpy(&r->e.sock, &p->addr, p->len);
+        }
+        gettimeofday(&r->e.tv, NULL);
+        write_end(r);
+    }
+    set_unlock(s);
+}
+
+int
+dns_cache_save(const char *path)
+{
+    struct snapshot_header header;
+    struct snapshot_record rec;
+    struct entry    e;
+    struct set     *s;
+    char            tmp[PATH_MAX];
+    FILE           *fp = NULL;
+    uint32_t        n;
+    int             i,
+                    count = 0;
+
+    if (sets == NULL)
+        return 0;
+
+    /*
+     * Written aside and renamed, so that a crash never leaves half a
+     * snapshot behind.
+     */
+    check(snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid())
+          < (int) sizeof(tmp), "The snapshot path is too long");
+    fp = fopen(tmp, "w");
+    check(fp != NULL, "Cannot create %s", tmp);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(rec);
+    check(fwrite(&header, sizeof(header), 1, fp) == 1, "Cannot write %s",
+          tmp);
+
+    for (n = 0; n < num_sets; n++) {
+        s = &sets[n];
+        for (i = 0; i < WAYS; i++) {
+            if (__atomic_load_n(&s->tag[i], __ATOMIC_RELAXED) == 0
+                || record_read(&s->way[i], &e) == -1 || e.valid == 0)
+                continue;
+
+            memset(&rec, 0, sizeof(rec));
+            memcpy(rec.hostname, e.hostname, sizeof(rec.hostname));
+            rec.family = e.family;
+            rec.addrlen = e.addrlen;
+            memcpy(&rec.sock, &e.sock, sizeof(rec.sock));
+            rec.resolved = e.tv.tv_sec;
+            check(fwrite(&rec, sizeof(rec), 1, fp) == 1, "Cannot write %s",
+                  tmp);
+            count++;
+        }
+    }
+
+    check(fclose(fp) == 0, "Cannot write %s", tmp);
+    fp = NULL;
+    check(rename(tmp, path) == 0, "Cannot rename %s", tmp);
+
+    return count;
+
+  error:
+    if (fp != NULL)
+        fclose(fp);
+    unlink(tmp);
+    return -1;
+}
+
+int
+dns_cache_load(const char *path, const int ttl)
+{
+    struct snapshot_header header;
+    struct snapshot_record rec;
+    struct timeval  tv;
+    FILE           *fp;
+    time_t          t;
+    int             count = 0;
+
+    if (sets == NULL)
+        return 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL && errno == ENOENT)
+        return 0;
+    check(fp != NULL, "Cannot open %s", path);
+
+    check(fread(&header, sizeof(header), 1, fp) == 1
+          && memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0
+          && header.record_size == sizeof(rec),
+          "%s is not a DNS snapshot of this version", path);
+
+    t = time(NULL);
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        /*
+         * The records keep the time they were resolved at, so they expire
+         * as if the proxy had never stopped.
+         */
+        if (rec.resolved > t || t - rec.resolved >= ttl)
+            continue;
+        rec.hostname[RECORD_HOSTNAME_LENGTH] = '\0';
+        if ((rec.family != AF_INET && rec.family != AF_INET6)
+            || rec.addrlen > sizeof(rec.sock)
+            || rec.sock.ss_family != rec.family)
+            continue;
+
+        tv.tv_sec = rec.resolved;
+        tv.tv_usec = 0;
+
+        /*
+         * Not used yet in this run, so they are the first to be replaced.
+         */
+        store(rec.hostname, rec.family, (struct sockaddr *) &rec.sock,
+              rec.addrlen, &tv, 0);
+        count++;
+    }
+
+    fclose(fp);
+    return count;
+
+  error:
+    if (fp != NULL)
+        fclose(fp);
+    return -1;
+}
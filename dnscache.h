@@ -0,0 +1,98 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef DNSCACHE_H_
+#define DNSCACHE_H_
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "http.h"
+#include "resolver.h"
+
+/*
+ * Creates the cache of `records` records in shared memory, rounded up to a
+ * power of two. It must be called before the processes that use the cache
+ * are forked.
+ * Returns 0 on success, -1 on failure.
+ */
+int             dns_cache_init(const int records);
+void            dns_cache_destroy(void);
+
+/*
+ * Copies the cached address of `name` to `sock`, with `port` as its port.
+ * Returns 0 on a cache hit, -1 otherwise.
+ */
+int             dns_cache_get(const char *name, const char *port,
+                              struct sockaddr_storage *sock,
+                              socklen_t * len, int *family);
+
+/*
+ * Caches `sa`, an address of `name` that has been connected to successfully.
+ */
+void            dns_cache_put(const char *name, const int family,
+                              const struct sockaddr *sa, const socklen_t len);
+
+/*
+ * Invalidates the cached record of `name`, e.g. because it is unreachable.
+ */
+void            dns_cache_drop(const char *name);
+
+/*
+ * Sweeps the next 1/`slices` of the cache: invalidates the records older than
+ * `ttl` seconds, and copies to `names` the names of at most `max` records
+ * that will expire within `ahead` seconds but were used in the last `ahead`
+ * seconds.
+ * Returns the number of names copied.
+ */
+int             dns_cache_sweep(const int ttl, const int ahead,
+                                const int slices,
+                                char (*names)[HOSTNAME_LENGTH],
+                                const int max);
+
+/*
+ * Updates the cached record of `name`, if it is still there, with a fresh
+ * answer of the resolver. The cached address is kept if it is still in the
+ * answer.
+ */
+void            dns_cache_refresh(const char *name,
+                                  const struct resolver_answer *answer);
+
+/*
+ * Writes the valid records to the snapshot file `path`, replacing it
+ * atomically.
+ * Returns the number of records written, or -1 on failure.
+ */
+int             dns_cache_save(const char *path);
+
+/*
+ * Fills the cache with the records of the snapshot file `path` that are
+ * younger than `ttl` seconds. A missing file is an empty snapshot.
+ * Returns the number of records loaded, or -1 on failure.
+ */
+int             dns_cache_load(const char *path, const int ttl);
+
+#endif                          /* DNSCACHE_H_ */
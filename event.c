@@ -0,0 +1,2257 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * An edge-triggered epoll(7) engine.
+ *
+ * Instead of forking a child that runs proxy() for every accepted socket, one
+ * process drives all the client/server pairs. Every connection is a small
+ * state machine:
+ *
+ *      CONN_IDLE ---> CONN_HEADER ---> CONN_CONNECTING ---> CONN_RELAY
+ *          ^                |   |             ^                 ^ |
+ *          |                |   +--> CONN_RESOLVING             | |
+ *          |                +------> CONN_POOLING --------------+ |
+ *          |                +-------------------------------------+
+ *          |                |   (same server, keep-alive)       |
+ *          |                +------> CONN_HIT <--> CONN_FOLLOWING
+ *          |                            |                       |
+ *          +----------------------------+-----------------------+
+ *                  (an actual response has been relayed and the
+ *                   client sends more data)
+ *
+ * CONN_IDLE        waits for the first byte of the next request.
+ * CONN_HEADER      accumulates the request header.
+ * CONN_HIT         sends a response from the cache (cache.c).
+ * CONN_FOLLOWING   waits for another connection, or process, to fetch the
+ *                  response (collapse.c), and then fetches it itself if it
+ *                  is not to be had from the cache after all.
+ * CONN_POOLING     waits for the pool to lend an idle server connection.
+ * CONN_RESOLVING   waits for the resolver, if the name is not cached.
+ * CONN_CONNECTING  waits for the non-blocking connect(2) to the server.
+ * CONN_RELAY       echoes bytes back and forth.
+ *
+ * The requests and responses are framed (framing.c), so the data the client
+ * sends after a request is the next one, which is sent right behind it if it
+ * can be pipelined, or waits until the responses have been relayed. Without
+ * framing, the logic is the one described in DESIGNS: if the server has sent
+ * any response other than "100 Continue", data from the client belongs to
+ * the next request.
+ *
+ * All sockets are registered once, for both EPOLLIN and EPOLLOUT, in
+ * edge-triggered mode. The readiness reported by epoll_wait(2) is latched in
+ * `struct endpoint` and only cleared when recv(2) or send(2) returns EAGAIN,
+ * so a direction that was stopped because the other side was not writable
+ * simply resumes when the other side becomes writable again.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bucket.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "collapse.h"
+#include "dbg.h"
+#include "disk.h"
+#include "dnscache.h"
+#include "event.h"
+#include "framing.h"
+#include "http.h"
+#include "pool.h"
+#include "race.h"
+#include "relay.h"
+#include "resolver.h"
+#include "scan.h"
+#include "utils.h"
+#include "webproxy.h"
+
+#define MAX_EVENTS       256
+
+/*
+ * Timeouts, in seconds.
+ */
+#define IDLE_TIMEOUT     2      /* Waiting for the (next) request */
+#define HEADER_TIMEOUT   5      /* Receiving the rest of the header */
+#define RESPONSE_TIMEOUT 5      /* Waiting for the server to respond */
+#define POOL_TIMEOUT     1      /* Waiting for the pool to lend a connection */
+#define RELAY_TIMEOUT    2      /* The server is quiet after responding */
+#define SEND_TIMEOUT     30     /* The client does not read */
+#define FOLLOW_TIMEOUT   30     /* The leader of a fetch makes no progress */
+
+#define SWEEP_INTERVAL   1      /* How often the timeouts are checked */
+
+/*
+ * How often a follower looks at the fetch it waits for, in milliseconds.
+ */
+#define FOLLOW_INTERVAL  10
+
+#define HEADER_END        "\r\n\r\n"
+#define HEADER_END_LENGTH 4
+
+/*
+ * The most requests sent to the server ahead of their responses.
+ */
+#define MAX_PIPELINE     16
+
+enum conn_state {
+    CONN_IDLE,
+    CONN_HEADER,
+    CONN_HIT,
+    CONN_FOLLOWING,
+    CONN_POOLING,
+    CONN_RESOLVING,
+    CONN_CONNECTING,
+    CONN_RELAY,
+    CONN_CLOSED
+};
+
+struct conn;
+
+/*
+ * A request whose response may come from the cache, or go to it. The
+ * response is copied to `collected` as it is relayed, and cached once it is
+ * complete; or, once its header is in, written to the disk cache if it is
+ * known to be too large for memory.
+ */
+struct fetch {
+    char            key[CACHE_KEY_LENGTH];
+    char           *head;       /* The request, as it was looked up */
+    size_t          head_length;
+
+    char           *hit;        /* The response, or the head of `disk` */
+    size_t          hit_length;
+    size_t          hit_sent;
+    int             on_disk;
+    struct disk_hit disk;
+    size_t          disk_sent;  /* Of `disk`, as it is in the store */
+    size_t          disk_end;   /* Up to where `disk` has been written */
+
+    /*
+     * The ticket of the fetch the connection leads or follows, or -1.
+     */
+    int             flight;
+    int             leader;
+    int             joined;
+
+    /*
+     * The client of the leader has gone away: the response is still fetched,
+     * for the followers and the cache, but sent to no one.
+     */
+    int             orphaned;
+
+    int             collecting;
+    char           *collected;
+    size_t          collected_length;
+    size_t          collected_size;
+    size_t          total;      /* The length of the response, once known */
+    struct disk_write *filling;
+};
+
+/*
+ * One side of a connection, as seen by epoll(7).
+ */
+struct endpoint {
+    struct conn    *conn;
+    uint32_t        events;     /* Latched readiness */
+};
+
+struct conn {
+    enum conn_state state;
+
+    struct peer     client;     /* client.buffer: data to the server */
+    struct peer     server;     /* server.buffer: data to the client */
+    struct relay_pipe pipe;     /* Used instead of server.buffer if open */
+    struct endpoint cep;
+    struct endpoint sep;
+
+    int             client_sent;        /* Bytes of client.buffer sent */
+    int             server_sent;        /* Bytes of server.buffer sent */
+    int             header_length;
+    int             server_eof; /* The server has closed or failed */
+
+    /*
+     * The server connection had been idle before this request, so the server
+     * may have closed it meanwhile. Until the server responds, a safe request
+     * is kept in client.buffer to be sent again on a new connection.
+     */
+    int             replay;
+
+    /*
+     * If the server sends actual response
+     */
+    int             content_flag;
+
+    /*
+     * Pipelining. The requests in client.buffer up to `request_end` have been
+     * (or are being) sent to the server, and the client may have sent the
+     * next ones after them. Their responses are followed in `response`, so
+     * that the next request that has to wait for them starts as soon as they
+     * have been relayed.
+     */
+    struct frame    request;    /* The last request sent */
+    struct frame    response;   /* The response being relayed */
+    int             request_end;
+    int             outstanding;        /* Requests sent, not responded */
+    uint32_t        heads;      /* Which of them are HEAD, oldest first */
+    int             safe;       /* All of them are GET or HEAD */
+    int             unframed;   /* The boundaries are unknown */
+    size_t          response_fed;       /* Framed, but still to be spliced */
+    int             keeps_alive;        /* The server connection persists */
+    int             held;       /* The next request waits for the responses */
+    int             next_length;        /* Its header, if processed */
+    int             next_code;  /* The error response to it */
+    char            next_hostname[HOSTNAME_LENGTH];
+    char            next_port[PORT_LENGTH];
+
+    /*
+     * Hostname and port of the current request.
+     */
+    char            hostname[HOSTNAME_LENGTH];
+    char            port[PORT_LENGTH];
+    char            server_hostname[HOSTNAME_LENGTH];
+    char            server_port[PORT_LENGTH];
+
+    int             pool_fd;    /* The pool answers on it */
+
+    /*
+     * Set until the end of the exchange if the response may come from the
+     * cache or go to it. The response is then copied, not spliced.
+     */
+    struct fetch   *fetch;
+
+    /*
+     * Candidate addresses of the server. The cached address is tried first,
+     * then the ones from the resolver, which answers on `resolver_fd`.
+     */
+    int             tried_cache;
+    int             from_cache; /* `answer` is the cached address */
+    int             resolver_fd;
+    struct resolver_answer *answer;
+    struct race     race;       /* Connection attempts to `answer` */
+
+    /*
+     * Rate-limiting related variables
+     */
+    int             rate;
+    struct rate_rule *rule;     /* Of [rates], with the shared bucket */
+    int             paced;      /* The client socket is paced */
+    int             chunk_size;
+    struct timeval  resume;     /* Do not read from the server before */
+    int             throttled;  /* On the `throttled` list */
+
+    struct timeval  deadline;
+    struct settings *settings;  /* The version it started with */
+
+    struct conn    *prev;
+    struct conn    *next;
+    struct conn    *throttle_next;
+};
+
+static int      epfd = -1;
+static struct timeval now;
+static int      accept_paused = 0;
+
+static struct conn *conns = NULL;       /* Open connections */
+static struct conn *throttled = NULL;   /* Waiting for their `resume` */
+static struct conn *closed = NULL;      /* Freed after each batch */
+
+/*
+ * Scratch space for process_request_line() and extract().
+ */
+static char     request_hostname[HOSTNAME_LENGTH];
+static char     request_port[PORT_LENGTH];
+static char     host_hostname[HOSTNAME_LENGTH];
+static char     host_port[PORT_LENGTH];
+static struct http_tokens tokens;
+
+static void     conn_drive(struct conn *c);
+static void     server_ready(struct conn *c);
+static void     try_connect(struct conn *c);
+
+static int
+set_nonblocking(int fd)
+{
+    int             flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void
+deadline_in(struct conn *c, int seconds)
+{
+    c->deadline = now;
+    c->deadline.tv_sec += seconds;
+}
+
+/*
+ * Drives `c` again at `t`. The list of throttled connections doubles as the
+ * timer of the connection attempts.
+ */
+static void
+wake_at(struct conn *c, const struct timeval *t)
+{
+    c->resume = *t;
+    if (!c->throttled) {
+        c->throttled = 1;
+        c->throttle_next = throttled;
+        throttled = c;
+    }
+}
+
+static void
+unthrottle(struct conn *c)
+{
+    struct conn   **pp;
+
+    if (!c->throttled)
+        return;
+
+    for (pp = &throttled; *pp != NULL; pp = &(*pp)->throttle_next) {
+        if (*pp == c) {
+            *pp = c->throttle_next;
+            break;
+        }
+    }
+    c->throttle_next = NULL;
+    c->throttled = 0;
+}
+
+/*
+ * Forgets about the cache for the current request of `c`.
+ */
+static void
+end_fetch(struct conn *c)
+{
+    if (c->fetch == NULL)
+        return;
+
+    if (c->fetch->filling != NULL)
+        disk_abort(c->fetch->filling);
+    if (c->fetch->flight != -1)
+        collapse_leave(c->fetch->flight, c->fetch->leader);
+    FREEMEM(c->fetch->head);
+    FREEMEM(c->fetch->hit);
+    FREEMEM(c->fetch->collected);
+    FREEMEM(c->fetch);
+}
+
+/*
+ * Gives up the server connection of `c`. It goes back to the pool if the
+ * server has responded and everything in between has been relayed.
+ */
+static void
+release_server(struct conn *c)
+{
+    if (c->server.socketfd == -1)
+        return;
+
+    /*
+     * The pool keeps the socket open, so it stays registered unless removed.
+     */
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->server.socketfd, NULL);
+
+    if (c->state != CONN_CONNECTING && !c->server_eof
+        && c->content_flag == 1 && (c->unframed || c->keeps_alive)
+        && c->pipe.pending == 0
+        && c->server_sent == c->server.bytes_read
+        && (c->state != CONN_RELAY || c->client_sent == c->client.bytes_read))
+        pool_put(c->server.hostname, c->server_port, c->server.socketfd);
+    else
+        close(c->server.socketfd);
+
+    c->server.socketfd = -1;
+    c->server.bytes_read = 0;
+    c->server_sent = 0;
+}
+
+/*
+ * Closes both sides of `c`. The memory is released by reap() once the current
+ * batch of events, which may still refer to `c`, has been processed. Only the
+ * client is closed if it is the one a fetch is led for: the response is
+ * still fetched for the others.
+ */
+static void
+conn_close(struct conn *c)
+{
+    if (c->state == CONN_CLOSED)
+        return;
+
+    if (c->fetch != NULL && c->fetch->flight != -1 && c->fetch->leader
+        && !c->fetch->orphaned && c->state == CONN_RELAY && !c->server_eof
+        && c->server.socketfd != -1) {
+        log_info("Fetching %s for the others", c->fetch->key);
+        close(c->client.socketfd);
+        c->client.socketfd = -1;
+        c->cep.events = 0;
+        c->fetch->orphaned = 1;
+        return;
+    }
+
+    /*
+     * The rest of the response would be taken for the next one.
+     */
+    if (c->outstanding > 0)
+        c->server_eof = 1;
+
+    release_server(c);
+    CLOSEFD(c->client.socketfd);
+    c->client.socketfd = -1;
+    relay_pipe_close(&c->pipe);
+    end_fetch(c);
+
+    CLOSEFD(c->resolver_fd);
+    c->resolver_fd = -1;
+    CLOSEFD(c->pool_fd);
+    c->pool_fd = -1;
+    if (c->state == CONN_CONNECTING)
+        race_cancel(&c->race);
+    FREEMEM(c->answer);
+
+    unthrottle(c);
+
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        conns = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+
+    c->state = CONN_CLOSED;
+    c->next = closed;
+    closed = c;
+}
+
+/*
+ * Sends an error response to the client and closes the connection.
+ */
+static void
+conn_fail(struct conn *c, const int code)
+{
+    const char     *head = error_head(code);
+    const char     *tail = RESPONSE_HEADER_TAIL;
+
+    send(c->client.socketfd, head, strlen(head), MSG_NOSIGNAL);
+    send(c->client.socketfd, tail, strlen(tail), MSG_NOSIGNAL);
+    conn_close(c);
+}
+
+static void
+reap(void)
+{
+    struct conn    *c;
+
+    while (closed != NULL) {
+        c = closed;
+        closed = c->next;
+        settings_put(c->settings);
+        bufpool_put(c->client.buffer);
+        bufpool_put(c->server.buffer);
+        FREEMEM(c);
+    }
+}
+
+static struct conn *
+conn_new(int sfd)
+{
+    struct conn    *c;
+    struct epoll_event ev;
+
+    c = malloc(sizeof(*c));
+    check_mem(c);
+    memset(c, 0, sizeof(*c));
+
+    c->client.buffer = bufpool_get();
+    check_mem(c->client.buffer);
+    c->server.buffer = bufpool_get();
+    check_mem(c->server.buffer);
+
+    c->client.socketfd = sfd;
+    c->server.socketfd = -1;
+    c->resolver_fd = -1;
+    c->pool_fd = -1;
+    relay_pipe_init(&c->pipe);
+    c->settings = settings_get();
+    if (c->settings->use_splice == 1 && relay_pipe_open(&c->pipe) == -1)
+        log_warn("Cannot create a pipe, the response will be copied.");
+    c->server.hostname = c->server_hostname;
+    c->cep.conn = c;
+    c->sep.conn = c;
+    c->state = CONN_IDLE;
+    c->rate = -1;
+    deadline_in(c, IDLE_TIMEOUT);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &c->cep;
+    check(epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) == 0,
+          "Cannot watch the client");
+
+    c->next = conns;
+    if (conns != NULL)
+        conns->prev = c;
+    conns = c;
+
+    return c;
+
+  error:
+    if (c != NULL) {
+        settings_put(c->settings);
+        relay_pipe_close(&c->pipe);
+        bufpool_put(c->client.buffer);
+        bufpool_put(c->server.buffer);
+        FREEMEM(c);
+    }
+    return NULL;
+}
+
+/*
+ * Processes the complete request header at `start` in client.buffer, which
+ * is `*header_length` bytes long, in place, the way proxy() processes it line
+ * by line. The server goes to `hostname` and `port`.
+ * Returns 0 on success, or the status code of the error response.
+ */
+static int
+process_header(struct conn *c, const int start, int *header_length,
+               char *hostname, char *port)
+{
+    char           *buffer = c->client.buffer + start;
+    struct scan_field *f;
+    int             length,
+                    count,
+                    shift,
+                    i;
+
+    if (http_tokenize(buffer, *header_length, &tokens) <= 0) {
+        log_warn("The HTTP request header is malformed");
+        return 400;
+    }
+    if (tokens.num_headers > SCAN_MAX_HEADERS) {
+        log_warn("Too many header fields");
+        return 400;
+    }
+
+    /*
+     * HTTP Request-Line
+     */
+    length = scan_find(buffer, *header_length, '\n') + 1;
+
+    request_hostname[0] = '\0';
+    request_port[0] = '\0';
+    count = process_request_line(request_hostname, request_port, buffer,
+                                 length, c->settings->use_abs_url);
+    if (count == -1) {
+        log_warn("The HTTP request line is malformed");
+        return 400;
+    }
+
+    /*
+     * The Request-URI may have been rewritten to its shorter abs_path form.
+     */
+    shift = length - count;
+    if (shift != 0) {
+        memmove(buffer + count, buffer + length,
+                c->client.bytes_read - start - length);
+        c->client.bytes_read -= shift;
+        *header_length -= shift;
+    }
+
+    hostname[0] = '\0';
+    for (i = 0; i < tokens.num_headers; i++) {
+        f = &tokens.headers[i];
+
+        /*
+         * The field name is HOST_PREFIX without the colon.
+         */
+        if (f->name.length != HOST_PREFIX_LENGTH - 1
+            || strncasecmp(buffer + f->name.offset - shift, HOST_PREFIX,
+                           HOST_PREFIX_LENGTH - 1) != 0)
+            continue;
+
+        /*
+         * Check if the request line is seen
+         */
+        if (strlen(request_hostname) == 0)
+            return 400;
+
+        if (extract(host_hostname, host_port,
+                    buffer + f->name.offset - shift,
+                    f->value.offset + f->value.length - f->name.offset)
+            == -1)
+            return 400;
+
+        /*
+         * Consistence check
+         */
+        if (strcasecmp(request_hostname, host_hostname) != 0) {
+            log_warn("Hostname is inconsistent");
+            return 400;
+        }
+        if (strcasecmp(request_port, host_port) != 0) {
+            log_warn("Port is inconsistent");
+            return 400;
+        }
+
+        strcpy(hostname, host_hostname);
+        strcpy(port, host_port);
+    }
+
+    if (hostname[0] == '\0') {
+        log_err("Cannot connect to the real server.");
+        return 503;
+    }
+
+    return 0;
+}
+
+/*
+ * Starts the next connection attempt to the server if one is due, and makes
+ * sure that `c` is woken up for the one after it.
+ */
+static void
+race_next(struct conn *c)
+{
+    struct epoll_event ev;
+    int             sfd;
+
+    if (c->race.pending > 0 && timercmp(&now, &c->race.next, <))
+        return;
+
+    sfd = race_start(&c->race, &now);
+    if (sfd == -1)
+        return;
+
+    /*
+     * Without epoll(7), the attempt is still checked on the next wake-up.
+     */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &c->sep;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) == -1)
+        log_warn("Cannot watch a connection to %s", c->hostname);
+
+    if (c->race.started < c->answer->count)
+        wake_at(c, &c->race.next);
+}
+
+/*
+ * Every address in `c->answer` has failed.
+ */
+static void
+race_failed(struct conn *c)
+{
+    FREEMEM(c->answer);
+
+    /*
+     * The cached address may be stale: resolve the name again.
+     */
+    if (c->from_cache) {
+        dns_cache_drop(c->hostname);
+        try_connect(c);
+        return;
+    }
+
+    log_err("Cannot connect to %s", c->hostname);
+    conn_fail(c, 503);
+}
+
+/*
+ * Races the connections to the addresses in `c->answer`.
+ */
+static void
+start_race(struct conn *c)
+{
+    race_init(&c->race, c->answer);
+    c->sep.events = 0;
+    c->state = CONN_CONNECTING;
+    deadline_in(c, c->settings->connect_timeout);
+
+    race_next(c);
+    if (race_lost(&c->race))
+        race_failed(c);
+}
+/*
+ * Asks the pool for an idle connection to the server, without waiting.
+ * Returns -1 if there is no pool, or it cannot be reached.
+ */
+static int
+ask_pool(struct conn *c)
+{
+    struct epoll_event ev;
+    int             fd;
+
+    fd = pool_ask(c->hostname, c->port);
+    if (fd == -1)
+        return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &c->sep;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    c->pool_fd = fd;
+    c->sep.events = 0;
+    c->state = CONN_POOLING;
+    deadline_in(c, POOL_TIMEOUT);
+
+    return 0;
+}
+
+/*
+ * Relays through the connection `sfd` the pool has lent.
+ * Returns -1 if it cannot be used.
+ */
+static int
+use_pooled(struct conn *c, int sfd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &c->sep;
+    if (set_nonblocking(sfd) == -1
+        || epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) == -1) {
+        close(sfd);
+        return -1;
+    }
+
+    c->server.socketfd = sfd;
+    c->sep.events = 0;
+    server_ready(c);
+    c->replay = c->safe;
+
+    return 0;
+}
+
+/*
+ * Takes the answer of the pool: the connection it lends, or none, in which
+ * case a new one is opened.
+ */
+static void
+finish_pool(struct conn *c)
+{
+    int             sfd;
+
+    if (!(c->sep.events & EPOLLIN))
+        return;
+
+    if (pool_answer(c->pool_fd, &sfd) == -1) {
+        c->sep.events &= ~EPOLLIN;
+        return;
+    }
+    close(c->pool_fd);
+    c->pool_fd = -1;
+
+    if (sfd != -1 && use_pooled(c, sfd) == 0)
+        return;
+    try_connect(c);
+}
+
+/*
+ * Asks the resolver for the addresses of the server, without waiting.
+ * Returns -1 if there is no resolver, or it cannot be reached.
+ */
+static int
+ask_resolver(struct conn *c)
+{
+    struct epoll_event ev;
+    int             fd;
+
+    fd = resolver_submit(c->hostname);
+    if (fd == -1)
+        return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &c->sep;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    c->resolver_fd = fd;
+    c->sep.events = 0;
+    c->state = CONN_RESOLVING;
+    deadline_in(c, RESPONSE_TIMEOUT);
+
+    return 0;
+}
+
+/*
+ * Connects to the server, through the cached address first.
+ */
+static void
+try_connect(struct conn *c)
+{
+    struct resolver_addr *p;
+
+    c->answer = malloc(sizeof(*c->answer));
+    if (c->answer == NULL) {
+        log_err("Out of memory");
+        conn_fail(c, 503);
+        return;
+    }
+
+    if (!c->tried_cache) {
+        c->tried_cache = 1;
+        p = &c->answer->addr[0];
+        if (dns_cache_get(c->hostname, c->port, &p->addr, &p->len,
+                          &p->family) == 0) {
+            log_info("Reusing DNS record of host:%s", c->hostname);
+            c->answer->error = 0;
+            c->answer->count = 1;
+            c->from_cache = 1;
+            start_race(c);
+            return;
+        }
+    }
+    c->from_cache = 0;
+
+    if (ask_resolver(c) == 0)
+        return;
+
+    /*
+     * Resolving inline would stall every connection of the process, so it
+     * is only done when the configuration asks for it (resolvers = 0).
+     */
+    if (resolver_enabled()) {
+        log_err("Cannot reach the resolver for %s", c->hostname);
+        conn_fail(c, 503);
+        return;
+    }
+    if (resolve(c->hostname, c->port, c->answer) == -1) {
+        log_err("Cannot resolve %s: %s", c->hostname,
+                gai_strerror(c->answer->error));
+        conn_fail(c, 503);
+        return;
+    }
+    start_race(c);
+}
+static void
+finish_resolve(struct conn *c)
+{
+    if (!(c->sep.events & EPOLLIN))
+        return;
+
+    if (resolver_read(c->resolver_fd, c->port, c->answer) == -1) {
+        c->sep.events &= ~EPOLLIN;
+        return;
+    }
+    close(c->resolver_fd);
+    c->resolver_fd = -1;
+
+    if (c->answer->error != 0) {
+        log_err("Cannot resolve %s: %s", c->hostname,
+                gai_strerror(c->answer->error));
+        conn_fail(c, 503);
+        return;
+    }
+
+    start_race(c);
+}
+
+/*
+ * Sends the request again on a new connection if the server closed the
+ * connection it had been idle on before responding. Only GET and HEAD are
+ * sent again, since the server may have acted on the others (RFC 7230
+ * 6.3.1).
+ * Returns -1 if the request cannot be sent again.
+ */
+static int
+retry_request(struct conn *c)
+{
+    if (!c->replay || !c->safe)
+        return -1;
+
+    log_info("The connection to %s was closed, reconnecting", c->hostname);
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->server.socketfd, NULL);
+    close(c->server.socketfd);
+    c->server.socketfd = -1;
+    c->replay = 0;
+    c->tried_cache = 0;
+    try_connect(c);
+
+    return 0;
+}
+
+static void
+finish_connect(struct conn *c)
+{
+    struct resolver_addr *p;
+    int             i,
+                    sfd;
+
+    /*
+     * The readiness may be that of any attempt, so all are checked.
+     */
+    c->sep.events = 0;
+
+    i = race_check(&c->race, &sfd);
+    if (i == -1) {
+        race_next(c);
+        if (race_lost(&c->race))
+            race_failed(c);
+        return;
+    }
+
+    log_info("Connected to %s", c->hostname);
+
+    p = &c->answer->addr[i];
+    if (!c->from_cache)
+        dns_cache_put(c->hostname, p->family, (struct sockaddr *) &p->addr,
+                      p->len);
+    FREEMEM(c->answer);
+
+    c->server.socketfd = sfd;
+    c->sep.events = EPOLLOUT;
+    server_ready(c);
+}
+/*
+ * The server connection of `c` is established: starts relaying.
+ */
+static void
+server_ready(struct conn *c)
+{
+    strcpy(c->server.hostname, c->hostname);
+    strcpy(c->server_port, c->port);
+    c->server.bytes_read = 0;
+    c->server_sent = 0;
+    c->server_eof = 0;
+    c->replay = 0;
+    frame_init(&c->response, 1, c->heads & 1);
+    c->response_fed = 0;
+    c->keeps_alive = 0;
+
+    c->rule = rate_table_match(c->settings->rates, c->hostname);
+    c->rate = c->rule == NULL ? -1 : c->rule->rate;
+    pace_client(c->settings, c->client.socketfd, c->rate, &c->paced);
+    if (c->rate > 0)
+        c->chunk_size = min(PEER_BUFFER_SIZE, KBYTES_TO_BYTES(c->rate));
+    else
+        c->chunk_size = PEER_BUFFER_SIZE;
+    timerclear(&c->resume);
+
+    c->state = CONN_RELAY;
+    c->content_flag = 0;
+    c->client_sent = 0;
+    deadline_in(c, RESPONSE_TIMEOUT);
+}
+
+/*
+ * Forwards the request header (and whatever follows it) to the server,
+ * reusing the server connection if the hostname has not changed.
+ */
+static void
+start_exchange(struct conn *c)
+{
+    c->client_sent = 0;
+
+    if (c->server.socketfd != -1
+        && strcasecmp(c->server.hostname, c->hostname) == 0
+        && strcmp(c->server_port, c->port) == 0) {
+        c->content_flag = 0;
+        c->replay = c->safe;
+        c->state = CONN_RELAY;
+        deadline_in(c, RESPONSE_TIMEOUT);
+        return;
+    }
+
+    /*
+     * content_flag still tells whether the server has responded to the
+     * previous request.
+     */
+    release_server(c);
+    c->content_flag = 0;
+    c->tried_cache = 0;
+    if (ask_pool(c) == 0)
+        return;
+    try_connect(c);
+}
+
+/*
+ * GET and HEAD can be sent ahead of the responses to the requests before
+ * them (RFC 7230 6.3.2), and sent again if the server closes first.
+ */
+static int
+is_safe(const char *request)
+{
+    return strncmp(request, "GET ", 4) == 0
+        || strncmp(request, "HEAD ", 5) == 0;
+}
+
+/*
+ * Looks the complete request at the start of client.buffer up in the cache,
+ * or joins the fetch of its response by another connection.
+ * Returns 0 if the response is sent from the cache, or will be once it has
+ * been fetched; or -1 if it has to be fetched, in which case it is collected
+ * for the cache if it may be kept.
+ */
+static int
+look_up(struct conn *c)
+{
+    struct fetch   *f = c->fetch;
+    long            max_age;
+    ssize_t         k;
+
+    if (f == NULL) {
+        if (c->unframed || c->request.state != FRAME_DONE
+            || (cache_max_object() == 0 && disk_max_object() == 0))
+            return -1;
+
+        f = calloc(1, sizeof(*f));
+        if (f == NULL)
+            return -1;
+        if (cache_key(f->key, c->client.buffer, c->request_end, c->hostname,
+                      c->port) == -1
+            || (f->head = malloc(c->request_end)) == NULL) {
+            free(f);
+            return -1;
+        }
+
+        /*
+         * client.buffer makes room for the next requests as the request is
+         * sent.
+         */
+        memcpy(f->head, c->client.buffer, c->request_end);
+        f->head_length = c->request_end;
+        f->flight = -1;
+        c->fetch = f;
+    }
+
+    f->hit = cache_get(f->key, f->head, f->head_length, &f->hit_length);
+    if (f->hit != NULL) {
+        log_info("Serving %s from the cache", f->key);
+        c->state = CONN_HIT;
+        deadline_in(c, SEND_TIMEOUT);
+        return 0;
+    }
+
+    /*
+     * The rest of a hit on disk is sent with sendfile(2).
+     */
+    if (disk_get(f->key, f->head, f->head_length, &f->disk) == 0
+        && (f->hit = malloc(DISK_HEAD_SIZE)) != NULL) {
+        k = disk_head(&f->disk, f->hit, DISK_HEAD_SIZE);
+        if (k != -1) {
+            log_info("Serving %s from the disk cache", f->key);
+            f->hit_length = k;
+            f->on_disk = 1;
+            f->disk_sent = f->disk.line_length;
+            f->disk_end = f->disk.length;
+            c->state = CONN_HIT;
+            deadline_in(c, SEND_TIMEOUT);
+            return 0;
+        }
+        FREEMEM(f->hit);
+    }
+
+    /*
+     * One connection fetches the response for all those that want it at
+     * the time, unless they will not take it from a cache.
+     */
+    if (!f->joined && cache_accepts(f->head, f->head_length, &max_age)) {
+        f->joined = 1;
+        f->flight = collapse_join(f->key, &f->leader);
+        if (f->flight != -1 && !f->leader) {
+            log_info("Waiting for %s", f->key);
+            c->state = CONN_FOLLOWING;
+            deadline_in(c, FOLLOW_TIMEOUT);
+            return 0;
+        }
+    }
+
+    f->collecting = 1;
+    return -1;
+}
+
+/*
+ * Sends the request at the start of client.buffer to the server.
+ */
+static void
+send_request(struct conn *c)
+{
+    c->outstanding = 1;
+    c->heads = strncmp(c->client.buffer, "HEAD ", 5) == 0;
+    c->safe = is_safe(c->client.buffer);
+    c->held = 0;
+    c->next_length = 0;
+    frame_init(&c->response, 1, c->heads & 1);
+    c->response_fed = 0;
+
+    start_exchange(c);
+}
+
+/*
+ * Sends the processed request at the start of client.buffer, unless its
+ * response is in the cache.
+ */
+static void
+start_request(struct conn *c)
+{
+    ssize_t         k;
+
+    end_fetch(c);
+
+    frame_init(&c->request, 0, 0);
+    k = frame_feed(&c->request, c->client.buffer, c->client.bytes_read);
+    c->unframed = k == -1;
+    c->request_end = k == -1 ? c->client.bytes_read : k;
+
+    if (look_up(c) == 0)
+        return;
+    send_request(c);
+}
+
+/*
+ * Starts the request at the start of client.buffer if its header is
+ * complete, looking for its end from `from`.
+ * Returns -1 if it is not complete.
+ */
+static int
+take_header(struct conn *c, const int from)
+{
+    char           *end;
+    int             code;
+
+    end = memmem(c->client.buffer + from, c->client.bytes_read - from,
+                 HEADER_END, HEADER_END_LENGTH);
+    if (end == NULL)
+        return -1;
+
+    c->header_length = end + HEADER_END_LENGTH - c->client.buffer;
+
+    code = process_header(c, 0, &c->header_length, c->hostname, c->port);
+    if (code != 0) {
+        conn_fail(c, code);
+        return 0;
+    }
+
+    start_request(c);
+    return 0;
+}
+
+/*
+ * The responses to the requests sent so far have been relayed: starts the
+ * next request, which the client has sent at least part of.
+ */
+static void
+next_request(struct conn *c)
+{
+    int             start = c->request_end;
+
+    memmove(c->client.buffer, c->client.buffer + start,
+            c->client.bytes_read - start);
+    c->client.bytes_read -= start;
+    c->client_sent = 0;
+    c->request_end = 0;
+    c->replay = 0;
+    c->held = 0;
+    c->state = CONN_HEADER;
+    deadline_in(c, HEADER_TIMEOUT);
+
+    if (c->next_length > 0) {
+        c->header_length = c->next_length;
+        c->next_length = 0;
+        if (c->next_code != 0) {
+            conn_fail(c, c->next_code);
+            return;
+        }
+        strcpy(c->hostname, c->next_hostname);
+        strcpy(c->port, c->next_port);
+        start_request(c);
+        return;
+    }
+
+    take_header(c, 0);
+}
+
+/*
+ * Sends the response from the cache, as far as it has been written there if
+ * it is being fetched, then goes on with the next request.
+ */
+static void
+send_hit(struct conn *c)
+{
+    struct fetch   *f;
+    ssize_t         n;
+
+    while (c->state == CONN_HIT) {
+        f = c->fetch;
+        if (f->hit_sent == f->hit_length
+            && (!f->on_disk || f->disk_sent == f->disk_end)) {
+            if (f->flight != -1) {
+                c->state = CONN_FOLLOWING;
+                deadline_in(c, FOLLOW_TIMEOUT);
+                return;
+            }
+            end_fetch(c);
+            if (c->request_end < c->client.bytes_read) {
+                next_request(c);
+            } else {
+                c->client.bytes_read = 0;
+                c->client_sent = 0;
+                c->request_end = 0;
+                c->state = CONN_IDLE;
+                deadline_in(c, IDLE_TIMEOUT);
+            }
+            continue;
+        }
+
+        if (!(c->cep.events & EPOLLOUT))
+            return;
+
+        if (f->hit_sent < f->hit_length)
+            n = send(c->client.socketfd, f->hit + f->hit_sent,
+                     f->hit_length - f->hit_sent, MSG_NOSIGNAL);
+        else
+            n = disk_send_some(&f->disk, c->client.socketfd, f->disk_sent,
+                               f->disk_end);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->cep.events &= ~EPOLLOUT;
+                return;
+            }
+            if (errno == EINTR)
+                continue;
+        }
+        if (n <= 0) {
+            log_err("Error when sending data to the client.");
+            conn_close(c);
+            return;
+        }
+        if (f->hit_sent < f->hit_length)
+            f->hit_sent += n;
+        else
+            f->disk_sent += n;
+        deadline_in(c, SEND_TIMEOUT);
+    }
+}
+
+/*
+ * Stops following the fetch of the response: it is looked up again, or
+ * fetched, unless a part of it has been sent.
+ */
+static void
+unfollow(struct conn *c)
+{
+    struct fetch   *f = c->fetch;
+
+    unthrottle(c);
+    collapse_leave(f->flight, 0);
+    f->flight = -1;
+
+    if (f->on_disk) {
+        log_err("Lost %s while it was being fetched.", f->key);
+        conn_close(c);
+        return;
+    }
+    if (look_up(c) == 0)
+        return;
+    send_request(c);
+}
+
+/*
+ * Looks at the fetch that `c` follows: sends what the leader has written to
+ * the disk cache so far, or looks the response up once the leader is done.
+ * Otherwise looks again in FOLLOW_INTERVAL.
+ */
+static void
+follow(struct conn *c)
+{
+    struct fetch   *f = c->fetch;
+    enum flight_state state;
+    struct disk_hit hit;
+    struct timeval  t,
+                    interval = { 0, FOLLOW_INTERVAL * 1000 };
+    size_t          written;
+    long            max_age;
+    ssize_t         k;
+
+    state = collapse_poll(f->flight, &hit, &written);
+    if (state == FLIGHT_FETCHING
+        || (state == FLIGHT_STREAMING && written <= f->disk_end)) {
+        timeradd(&now, &interval, &t);
+        wake_at(c, &t);
+        return;
+    }
+    if (state == FLIGHT_FAILED || (state == FLIGHT_DONE && !f->on_disk)) {
+        unfollow(c);
+        return;
+    }
+
+    if (!f->on_disk) {
+        cache_accepts(f->head, f->head_length, &max_age);
+        if ((max_age >= 0 && hit.age > max_age)
+            || !disk_matches(&hit, f->key, f->head, f->head_length)
+            || (f->hit = malloc(DISK_HEAD_SIZE)) == NULL
+            || (k = disk_head(&hit, f->hit, DISK_HEAD_SIZE)) == -1) {
+            FREEMEM(f->hit);
+            unfollow(c);
+            return;
+        }
+        log_info("Serving %s from the disk cache as it is fetched", f->key);
+        f->hit_length = k;
+        f->on_disk = 1;
+        f->disk = hit;
+        f->disk_sent = hit.line_length;
+    }
+    f->disk_end = written;
+
+    /*
+     * The rest of it is all there.
+     */
+    if (state == FLIGHT_DONE) {
+        collapse_leave(f->flight, 0);
+        f->flight = -1;
+    }
+    unthrottle(c);
+    c->state = CONN_HIT;
+    deadline_in(c, SEND_TIMEOUT);
+}
+
+/*
+ * Returns 1 if every response has been relayed to the client.
+ */
+static int
+exchange_done(const struct conn *c)
+{
+    return c->outstanding == 0 && c->response_fed == 0
+        && c->server_sent == c->server.bytes_read && c->pipe.pending == 0;
+}
+
+/*
+ * Sends the next request, at `request_end`, right behind the ones before it
+ * if it can go to the same server, or holds it until their responses have
+ * been relayed.
+ * Returns 0 if `request_end` has moved.
+ */
+static int
+pipeline(struct conn *c)
+{
+    struct frame    f;
+    char           *start = c->client.buffer + c->request_end;
+    char           *end;
+    int             length;
+    ssize_t         k;
+
+    if (exchange_done(c)) {
+        next_request(c);
+        return -1;
+    }
+    if (c->held || c->outstanding == 0 || c->outstanding >= MAX_PIPELINE)
+        return -1;
+
+    /*
+     * The response being collected for the cache would run into its own.
+     */
+    if (c->fetch != NULL && c->fetch->collecting) {
+        c->held = 1;
+        return -1;
+    }
+
+    /*
+     * Not before the server has shown that it keeps the connection open,
+     * or the requests sent ahead are lost when it closes.
+     */
+    if (!c->keeps_alive)
+        return -1;
+
+    end = memmem(start, c->client.bytes_read - c->request_end, HEADER_END,
+                 HEADER_END_LENGTH);
+    if (end == NULL)
+        return -1;
+
+    if (!c->safe || !is_safe(start)) {
+        c->held = 1;
+        return -1;
+    }
+
+    /*
+     * Its response would be mistaken for the rest of the previous one.
+     */
+    if (c->unframed) {
+        c->held = 1;
+        return -1;
+    }
+
+    length = end + HEADER_END_LENGTH - start;
+    c->next_code = process_header(c, c->request_end, &length,
+                                  c->next_hostname, c->next_port);
+    c->next_length = length;
+    if (c->next_code != 0 || strcasecmp(c->next_hostname, c->hostname) != 0
+        || strcmp(c->next_port, c->port) != 0) {
+        c->held = 1;
+        return -1;
+    }
+
+    frame_init(&f, 0, 0);
+    k = frame_feed(&f, start, c->client.bytes_read - c->request_end);
+    if (k == -1) {
+        c->held = 1;
+        return -1;
+    }
+
+    log_info("Pipelining a request to %s", c->hostname);
+    c->request = f;
+    c->request_end += k;
+    c->next_length = 0;
+    if (strncmp(start, "HEAD ", 5) == 0)
+        c->heads |= 1U << c->outstanding;
+    c->outstanding++;
+    return 0;
+}
+
+/*
+ * Frames the bytes the client has sent after `request_end`: the rest of the
+ * last request, or the next ones.
+ * Returns 0 if `request_end` has moved.
+ */
+static int
+frame_client(struct conn *c)
+{
+    ssize_t         k;
+
+    /*
+     * Without framing, the next request is told apart the old way, by the
+     * server having responded.
+     */
+    if (c->unframed && c->request.state != FRAME_DONE) {
+        if (c->content_flag == 1) {
+            next_request(c);
+            return -1;
+        }
+        c->request_end = c->client.bytes_read;
+        return 0;
+    }
+
+    if (c->request.state != FRAME_DONE) {
+        k = frame_feed(&c->request, c->client.buffer + c->request_end,
+                       c->client.bytes_read - c->request_end);
+        if (k == -1) {
+            c->unframed = 1;
+            k = c->client.bytes_read - c->request_end;
+        }
+        c->request_end += k;
+        return 0;
+    }
+
+    if (c->unframed && c->content_flag == 1) {
+        next_request(c);
+        return -1;
+    }
+    return pipeline(c);
+}
+
+/*
+ * Makes room in client.buffer for more of the client's data, dropping what
+ * has been sent. The requests are kept for as long as they fit, in case
+ * they have to be sent again.
+ * Returns -1 if there is no room.
+ */
+static int
+make_room(struct conn *c)
+{
+    int             sent = c->client_sent;
+
+    if (c->replay) {
+        if (c->client.bytes_read < PEER_BUFFER_SIZE)
+            return 0;
+        c->replay = 0;
+    }
+    if (sent == 0)
+        return c->client.bytes_read < PEER_BUFFER_SIZE ? 0 : -1;
+
+    memmove(c->client.buffer, c->client.buffer + sent,
+            c->client.bytes_read - sent);
+    c->client.bytes_read -= sent;
+    c->request_end -= sent;
+    c->client_sent = 0;
+    return 0;
+}
+
+static void
+read_header(struct conn *c)
+{
+    ssize_t         n;
+    int             from;
+
+    for (;;) {
+        if (!(c->cep.events & EPOLLIN))
+            return;
+
+        if (c->client.bytes_read >= PEER_BUFFER_SIZE / 2) {
+            conn_fail(c, 414);
+            return;
+        }
+
+        n = recv(c->client.socketfd,
+                 c->client.buffer + c->client.bytes_read,
+                 PEER_BUFFER_SIZE / 2 - c->client.bytes_read, 0);
+
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->cep.events &= ~EPOLLIN;
+                return;
+            }
+            if (errno == EINTR)
+                continue;
+            log_warn("Failed to read from the client.");
+            conn_fail(c, 503);
+            return;
+        }
+
+        /*
+         * Client closes the connection.
+         */
+        if (n == 0) {
+            conn_close(c);
+            return;
+        }
+
+        if (c->state == CONN_IDLE) {
+            c->state = CONN_HEADER;
+            deadline_in(c, HEADER_TIMEOUT);
+        }
+
+        from = max(0, c->client.bytes_read - (HEADER_END_LENGTH - 1));
+        c->client.bytes_read += n;
+
+        if (take_header(c, from) == 0)
+            return;
+    }
+}
+
+/*
+ * Client to server.
+ */
+static void
+relay_client(struct conn *c)
+{
+    ssize_t         n;
+
+    for (;;) {
+        while (c->client_sent < c->request_end) {
+            if (!(c->sep.events & EPOLLOUT))
+                return;
+
+            n = send(c->server.socketfd, c->client.buffer + c->client_sent,
+                     c->request_end - c->client_sent, MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    c->sep.events &= ~EPOLLOUT;
+                    return;
+                }
+                if (errno == EINTR)
+                    continue;
+                if (retry_request(c) == 0)
+                    return;
+                log_err("Error when sending data to the server.");
+                c->server_eof = 1;
+                conn_fail(c, 503);
+                return;
+            }
+            c->client_sent += n;
+        }
+
+        /*
+         * RFC 2616 Section 8.1.1
+         * HTTP implementations SHOULD implement persistent connections.
+         *
+         * The rest of the request, or the next one, may already be here.
+         */
+        if (c->request_end < c->client.bytes_read) {
+            if (frame_client(c) == 0)
+                continue;
+            if (c->state != CONN_RELAY)
+                return;
+            if (c->client_sent < c->request_end)
+                continue;
+        }
+
+        if (!(c->cep.events & EPOLLIN) || make_room(c) == -1)
+            return;
+
+        n = recv(c->client.socketfd, c->client.buffer + c->client.bytes_read,
+                 PEER_BUFFER_SIZE - c->client.bytes_read, 0);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->cep.events &= ~EPOLLIN;
+                return;
+            }
+            if (errno == EINTR)
+                continue;
+            log_err("Error when receiving data from the client.");
+            conn_fail(c, 503);
+            return;
+        }
+        if (n == 0) {
+            conn_close(c);
+            return;
+        }
+
+        c->client.bytes_read += n;
+        deadline_in(c, RESPONSE_TIMEOUT);
+    }
+}
+
+/*
+ * Delays the next read from the server until the bucket of `c` can afford
+ * the `n` bytes just read.
+ */
+static void
+throttle(struct conn *c, int n)
+{
+    long            usec;
+
+    usec = bucket_take(c->rule->bucket, n, c->rule->rate, c->rule->burst);
+    c->resume = now;
+    c->resume.tv_sec += usec / USECOND_PER_SECOND;
+    c->resume.tv_usec += usec % USECOND_PER_SECOND;
+    if (c->resume.tv_usec >= USECOND_PER_SECOND) {
+        c->resume.tv_sec++;
+        c->resume.tv_usec -= USECOND_PER_SECOND;
+    }
+}
+
+/*
+ * Takes note of what the response framed so far tells: whether the server
+ * keeps the connection open, and whether the response is complete.
+ */
+static void
+response_framed(struct conn *c)
+{
+    if (c->response.state != FRAME_HEAD)
+        c->keeps_alive = c->response.persistent;
+
+    if (c->response.state == FRAME_DONE) {
+        c->outstanding--;
+        c->heads >>= 1;
+        if (c->outstanding > 0)
+            frame_init(&c->response, 1, c->heads & 1);
+    }
+}
+
+/*
+ * Follows the responses over the `n` bytes just read from the server.
+ */
+static void
+frame_response(struct conn *c, const char *buf, size_t n)
+{
+    ssize_t         k;
+
+    while (n > 0 && c->outstanding > 0 && !c->unframed) {
+        k = frame_feed(&c->response, buf, n);
+        if (k == -1 || c->response.state == FRAME_UNTIL_CLOSE) {
+            c->unframed = 1;
+            return;
+        }
+        response_framed(c);
+        buf += k;
+        n -= k;
+    }
+}
+
+/*
+ * Adds the `n` bytes just read from the server to the response collected for
+ * the cache, and caches it once it is complete. Once its header is in, it
+ * goes to the disk cache instead if its length is known to be too large for
+ * memory. It is given up on if it is too large, or if its end cannot be
+ * told.
+ */
+static void
+collect(struct conn *c, const size_t n)
+{
+    struct fetch   *f = c->fetch;
+    size_t          limit = max(cache_max_object(), (size_t) PEER_BUFFER_SIZE),
+                    size;
+    char           *p;
+
+    if (!f->collecting)
+        return;
+    if (c->unframed)
+        goto done;
+
+    if (f->filling != NULL) {
+        if (disk_write(f->filling, c->server.buffer, n) == -1)
+            goto done;
+    } else {
+        if (f->collected_length + n > limit)
+            goto done;
+        if (f->collected_length + n > f->collected_size) {
+            size = min(max(f->collected_size * 2, f->collected_length + n),
+                       limit);
+            p = realloc(f->collected, size);
+            if (p == NULL)
+                goto done;
+            f->collected = p;
+            f->collected_size = size;
+        }
+        memcpy(f->collected + f->collected_length, c->server.buffer, n);
+        f->collected_length += n;
+
+        if (f->total == 0) {
+            f->total = cache_header_length(f->collected, f->collected_length);
+            if (f->total > 0)
+                f->total += c->response.length;
+        }
+        if (f->total > cache_max_object() && c->response.has_length
+            && !c->response.chunked) {
+            f->filling = disk_begin(f->key, f->head, f->head_length,
+                                    f->collected, f->collected_length,
+                                    f->total);
+            if (f->filling == NULL)
+                goto done;
+            FREEMEM(f->collected);
+        }
+    }
+
+    /*
+     * The followers are sent what has been written so far.
+     */
+    if (f->flight != -1 && f->filling != NULL)
+        collapse_stream(f->flight, f->filling);
+
+    if (c->outstanding > 0)
+        return;
+    if (f->filling != NULL) {
+        disk_commit(f->filling);
+        f->filling = NULL;
+    } else {
+        cache_put(f->key, f->head, f->head_length, f->collected,
+                  f->collected_length);
+    }
+    if (f->flight != -1) {
+        collapse_done(f->flight);
+        f->flight = -1;
+    }
+
+    /*
+     * The followers are let go as soon as the response is known not to be
+     * cached.
+     */
+  done:
+    if (f->filling != NULL)
+        disk_abort(f->filling);
+    f->filling = NULL;
+    if (f->flight != -1)
+        collapse_leave(f->flight, 1);
+    f->flight = -1;
+    f->collecting = 0;
+    FREEMEM(f->collected);
+}
+
+/*
+ * Returns how many bytes may be spliced from the server before the framing
+ * has to look at them, or what recv(2) returned if there is nothing to look
+ * at. The header of a response and the size of a chunk are peeked at; the
+ * bytes of a body are only counted.
+ */
+static ssize_t
+frame_splice(struct conn *c)
+{
+    char            peek[FRAME_PEEK_SIZE];
+    ssize_t         n,
+                    k;
+    size_t          bulk;
+
+    if (c->response_fed > 0)
+        return c->response_fed;
+    if (c->outstanding == 0 || c->unframed)
+        return c->chunk_size;
+
+    bulk = frame_bulk(&c->response);
+    if (bulk > 0) {
+        k = min(bulk, (size_t) c->chunk_size);
+        frame_skip(&c->response, k);
+    } else {
+        n = recv(c->server.socketfd, peek, sizeof(peek),
+                 MSG_PEEK | MSG_DONTWAIT);
+        if (n <= 0)
+            return n;
+        k = frame_feed(&c->response, peek, n);
+        if (k == -1 || c->response.state == FRAME_UNTIL_CLOSE) {
+            c->unframed = 1;
+            return c->chunk_size;
+        }
+    }
+    response_framed(c);
+
+    c->response_fed = k;
+    return k;
+}
+
+/*
+ * Server to client. The response is spliced through `c->pipe` if it is open
+ * and the response does not go to the cache, or copied through
+ * `c->server.buffer` otherwise.
+ */
+static void
+relay_server(struct conn *c)
+{
+    ssize_t         n;
+    int             splicing = c->pipe.fd[0] != -1 && c->fetch == NULL;
+
+    for (;;) {
+        if (c->fetch != NULL && c->fetch->orphaned)
+            c->server_sent = c->server.bytes_read;
+
+        while (c->server_sent < c->server.bytes_read || c->pipe.pending > 0) {
+            if (!(c->cep.events & EPOLLOUT)) {
+                deadline_in(c, SEND_TIMEOUT);
+                return;
+            }
+
+            if (splicing)
+                n = relay_out(&c->pipe, c->client.socketfd);
+            else
+                n = send(c->client.socketfd,
+                         c->server.buffer + c->server_sent,
+                         c->server.bytes_read - c->server_sent,
+                         MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    c->cep.events &= ~EPOLLOUT;
+                    continue;
+                }
+                if (errno == EINTR)
+                    continue;
+                log_err("Error when sending data to the client.");
+                conn_close(c);
+                return;
+            }
+            if (!splicing)
+                c->server_sent += n;
+            deadline_in(c, RELAY_TIMEOUT);
+        }
+        c->server.bytes_read = 0;
+        c->server_sent = 0;
+
+        /*
+         * The exchange is over and the client has not sent anything more:
+         * wait for the next request, with the server connection at hand.
+         */
+        if (c->state == CONN_RELAY && !c->unframed && !c->server_eof
+            && c->request.state == FRAME_DONE
+            && c->request_end == c->client.bytes_read && exchange_done(c)) {
+            c->client.bytes_read = 0;
+            c->client_sent = 0;
+            c->request_end = 0;
+            c->replay = 0;
+            c->state = CONN_IDLE;
+            deadline_in(c, IDLE_TIMEOUT);
+            end_fetch(c);
+        }
+
+        if (c->server_eof) {
+            /*
+             * After complete responses, only the server connection is over:
+             * the next request goes to a new one.
+             */
+            if (!c->unframed && exchange_done(c))
+                release_server(c);
+            else
+                conn_close(c);
+            return;
+        }
+
+        if (c->rule != NULL && timercmp(&now, &c->resume, <)) {
+            wake_at(c, &c->resume);
+            return;
+        }
+
+        if (!(c->sep.events & EPOLLIN))
+            return;
+
+        if (splicing) {
+            /*
+             * Only the start of a response can be "100 Continue".
+             */
+            if (c->content_flag == 0
+                && relay_peek_continue(c->server.socketfd) == 0)
+                c->content_flag = 1;
+            n = frame_splice(c);
+            if (n > 0)
+                n = relay_in(&c->pipe, c->server.socketfd,
+                             min(n, c->chunk_size));
+            if (n > 0)
+                c->response_fed -= min((size_t) n, c->response_fed);
+        } else {
+            n = recv(c->server.socketfd, c->server.buffer, c->chunk_size, 0);
+        }
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->sep.events &= ~EPOLLIN;
+                return;
+            }
+            if (errno == EINTR)
+                continue;
+            if (retry_request(c) == 0)
+                return;
+            log_err("Error when receiving data from the real server.");
+            c->server_eof = 1;
+            conn_fail(c, 503);
+            return;
+        }
+
+        if (n == 0) {
+            if (retry_request(c) == 0)
+                return;
+            c->server_eof = 1;
+            if (c->content_flag == 0) {
+                log_err("%s closed the connection without responding.",
+                        c->hostname);
+                conn_fail(c, 503);
+                return;
+            }
+            continue;
+        }
+        c->replay = 0;
+
+        /*
+         * If reads the "100 Continue" HTTP response message, allows the
+         * client to write.
+         */
+        if (!splicing) {
+            if (n == (ssize_t) HTTP_CONTINUE_MESSAGE_LENGTH &&
+                strncasecmp(c->server.buffer, HTTP_CONTINUE_MESSAGE,
+                            HTTP_CONTINUE_MESSAGE_LENGTH) == 0)
+                c->content_flag = 0;
+            else
+                c->content_flag = 1;
+
+            c->server.bytes_read = n;
+            frame_response(c, c->server.buffer, n);
+            if (c->fetch != NULL)
+                collect(c, n);
+
+            /*
+             * The others have what the orphan was fetching for them.
+             */
+            if (c->fetch != NULL && c->fetch->orphaned
+                && c->fetch->flight == -1) {
+                conn_close(c);
+                return;
+            }
+        }
+        deadline_in(c, RELAY_TIMEOUT);
+
+        if (c->rule != NULL)
+            throttle(c, n);
+    }
+}
+
+/*
+ * Makes as much progress on `c` as its latched readiness allows.
+ */
+static void
+conn_drive(struct conn *c)
+{
+    enum conn_state state;
+
+    do {
+        state = c->state;
+
+        switch (c->state) {
+        case CONN_IDLE:
+        case CONN_HEADER:
+            read_header(c);
+            break;
+        case CONN_HIT:
+            send_hit(c);
+            break;
+        case CONN_FOLLOWING:
+            follow(c);
+            break;
+        case CONN_POOLING:
+            finish_pool(c);
+            break;
+        case CONN_RESOLVING:
+            finish_resolve(c);
+            break;
+        case CONN_CONNECTING:
+            finish_connect(c);
+            break;
+        case CONN_RELAY:
+            relay_client(c);
+            break;
+        case CONN_CLOSED:
+            return;
+        }
+
+        /*
+         * The rest of the previous response is relayed even while the next
+         * request is being read.
+         */
+        if (c->state != CONN_CLOSED && c->state != CONN_CONNECTING
+            && c->state != CONN_HIT && c->state != CONN_FOLLOWING
+            && c->server.socketfd != -1)
+            relay_server(c);
+
+        /*
+         * The last response may have let the next request go.
+         */
+        if (c->state == CONN_RELAY && c->request_end < c->client.bytes_read)
+            relay_client(c);
+    } while (c->state != state);
+}
+
+static void
+accept_all(int listen_fd)
+{
+    int             sfd;
+
+    for (;;) {
+        /*
+         * The connections wait in the backlog while the buffers are spent.
+         */
+        if (!bufpool_can(2)) {
+            accept_paused = 1;
+            return;
+        }
+
+        sfd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS
+                || errno == ENOMEM) {
+                /*
+                 * The edge is lost, try again in sweep().
+                 */
+                log_warn("cannot accept");
+                accept_paused = 1;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_err("cannot accept");
+            }
+            return;
+        }
+
+        if (conn_new(sfd) == NULL)
+            close(sfd);
+    }
+}
+
+/*
+ * Resumes the rate-limited connections that have slept enough.
+ */
+static void
+resume_throttled(void)
+{
+    struct conn    *c,
+                   *list;
+
+    list = throttled;
+    throttled = NULL;
+
+    while (list != NULL) {
+        c = list;
+        list = c->throttle_next;
+        c->throttle_next = NULL;
+        c->throttled = 0;
+
+        if (timercmp(&c->resume, &now, >)) {
+            c->throttled = 1;
+            c->throttle_next = throttled;
+            throttled = c;
+            continue;
+        }
+
+        conn_drive(c);
+    }
+}
+
+/*
+ * Closes the connections that have timed out.
+ */
+static void
+sweep(int listen_fd)
+{
+    struct conn    *c,
+                   *next;
+
+    for (c = conns; c != NULL; c = next) {
+        next = c->next;
+        if (!timercmp(&c->deadline, &now, <))
+            continue;
+
+        /*
+         * A leader that makes no progress is not waited for any longer.
+         */
+        if (c->state == CONN_FOLLOWING) {
+            unfollow(c);
+            continue;
+        }
+
+        /*
+         * A busy pool is not waited for any longer: connect instead.
+         */
+        if (c->state == CONN_POOLING) {
+            CLOSEFD(c->pool_fd);
+            c->pool_fd = -1;
+            try_connect(c);
+            continue;
+        }
+
+        log_info("timeout");
+        if (c->state == CONN_RESOLVING || c->state == CONN_CONNECTING)
+            conn_fail(c, 503);
+        else
+            conn_close(c);
+    }
+
+    if (accept_paused) {
+        accept_paused = 0;
+        accept_all(listen_fd);
+    }
+}
+
+/*
+ * Returns the timeout of epoll_wait(2) in milliseconds.
+ */
+static int
+next_timeout(const struct timeval *next_sweep)
+{
+    struct timeval  t,
+                    diff;
+    struct conn    *c;
+
+    t = *next_sweep;
+    for (c = throttled; c != NULL; c = c->throttle_next) {
+        if (timercmp(&c->resume, &t, <))
+            t = c->resume;
+    }
+
+    gettimeofday(&now, NULL);
+    if (!timercmp(&t, &now, >))
+        return 0;
+
+    timersub(&t, &now, &diff);
+    return diff.tv_sec * 1000 + (diff.tv_usec + 999) / 1000;
+}
+
+int
+event_loop(int listen_fd)
+{
+    struct epoll_event ev,
+                    events[MAX_EVENTS];
+    struct endpoint *ep;
+    struct timeval  next_sweep;
+    int             n,
+                    i;
+
+    /*
+     * A client that goes away must not kill every other connection.
+     */
+    signal(SIGPIPE, SIG_IGN);
+
+    check(set_nonblocking(listen_fd) == 0,
+          "Cannot make the listening socket non-blocking");
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    check(epfd != -1, "Cannot create the epoll instance");
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    check(epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) == 0,
+          "Cannot watch the listening socket");
+
+    log_info("Process %ld is running the event engine", (long) getpid());
+
+    gettimeofday(&now, NULL);
+    next_sweep = now;
+    next_sweep.tv_sec += SWEEP_INTERVAL;
+
+    for (;;) {
+        reload_settings();
+
+        n = epoll_wait(epfd, events, MAX_EVENTS, next_timeout(&next_sweep));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            log_err("epoll_wait() fails");
+            goto error;
+        }
+
+        gettimeofday(&now, NULL);
+
+        for (i = 0; i < n; i++) {
+            ep = events[i].data.ptr;
+            if (ep == NULL) {
+                accept_all(listen_fd);
+                continue;
+            }
+
+            if (ep->conn->state == CONN_CLOSED)
+                continue;
+
+            ep->events |= events[i].events;
+            /*
+             * Let recv(2)/send(2) report the error or the end of file.
+             */
+            if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                ep->events |= EPOLLIN | EPOLLOUT;
+
+            conn_drive(ep->conn);
+        }
+
+        resume_throttled();
+
+        if (!timercmp(&now, &next_sweep, <)) {
+            sweep(listen_fd);
+            next_sweep = now;
+            next_sweep.tv_sec += SWEEP_INTERVAL;
+        }
+
+        reap();
+    }
+
+  error:
+    if (epfd != -1)
+        close(epfd);
+    epfd = -1;
+    return -1;
+}
@@ -0,0 +1,337 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Message framing, after RFC 7230 3.3.3.
+ *
+ * The header, the chunk-size lines and the trailer are read line by line
+ * into `line`, which only keeps what is needed to find the length of the
+ * body: the status code, Content-Length and Transfer-Encoding. The body
+ * itself, and every chunk, is skipped as a count of bytes.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "framing.h"
+#include "utils.h"
+
+#define CONTENT_LENGTH    "Content-Length:"
+#define TRANSFER_ENCODING "Transfer-Encoding:"
+#define CONNECTION        "Connection:"
+
+void
+frame_init(struct frame *f, const int response, const int head)
+{
+    memset(f, 0, sizeof(*f));
+    f->state = FRAME_HEAD;
+    f->response = response;
+    f->head = head;
+}
+
+/*
+ * Returns the value of the header field in `line` if its name is `name`,
+ * which includes the colon, or NULL.
+ */
+static const char *
+field_value(const char *line, const char *name)
+{
+    size_t          length = strlen(name);
+
+    if (strncasecmp(line, name, length) != 0)
+        return NULL;
+    for (line += length; *line == ' ' || *line == '\t'; line++);
+    return line;
+}
+
+/*
+ * "chunked" has to be the last coding, or the length of a request is not
+ * known and that of a response is the rest of the connection.
+ */
+static int
+is_chunked(const char *value)
+{
+    const char     *last = strrchr(value, ',');
+    size_t          length;
+
+    for (last = last == NULL ? value : last + 1; isspace((unsigned char) *last);
+         last++);
+    for (length = strlen(last);
+         length > 0 && isspace((unsigned char) last[length - 1]); length--);
+    return length == 7 && strncasecmp(last, "chunked", 7) == 0;
+}
+
+/*
+ * Returns 1 if the comma-separated list `value` has `token`.
+ */
+static int
+has_token(const char *value, const char *token)
+{
+    size_t          length = strlen(token),
+                    n;
+
+    for (;;) {
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+        if (*value == '\0')
+            return 0;
+        n = strcspn(value, ", \t");
+        if (n == length && strncasecmp(value, token, length) == 0)
+            return 1;
+        value += n;
+    }
+}
+
+static int
+header_field(struct frame *f, const char *line)
+{
+    const char     *value;
+    char           *end;
+    uint64_t        length;
+
+    if ((value = field_value(line, CONTENT_LENGTH)) != NULL) {
+        if (f->truncated || !isdigit((unsigned char) *value))
+            return -1;
+        length = strtoull(value, &end, 10);
+        while (*end == ' ' || *end == '\t')
+            end++;
+        if (*end != '\0' || (f->has_length && f->length != length))
+            return -1;
+        f->has_length = 1;
+        f->length = length;
+    } else if ((value = field_value(line, TRANSFER_ENCODING)) != NULL) {
+        if (f->truncated)
+            return -1;
+        f->encoded = 1;
+        f->chunked = is_chunked(value);
+    } else if ((value = field_value(line, CONNECTION)) != NULL) {
+        if (has_token(value, "close"))
+            f->persistent = 0;
+        else if (has_token(value, "keep-alive"))
+            f->persistent = 1;
+    }
+    return 0;
+}
+
+/*
+ * The header is complete: works out the length of the body.
+ */
+static int
+end_head(struct frame *f)
+{
+    if (f->response) {
+        if (f->status == 101) {
+            f->state = FRAME_UNTIL_CLOSE;
+            return 0;
+        }
+        if (f->status < 200) {
+            frame_init(f, 1, f->head);
+            return 0;
+        }
+        if (f->head || f->status == 204 || f->status == 304) {
+            f->state = FRAME_DONE;
+            return 0;
+        }
+    }
+
+    if (f->chunked) {
+        f->state = FRAME_CHUNK_SIZE;
+    } else if (f->encoded) {
+        if (!f->response)
+            return -1;
+        f->state = FRAME_UNTIL_CLOSE;
+    } else if (f->has_length) {
+        f->left = f->length;
+        f->state = f->left > 0 ? FRAME_BODY : FRAME_DONE;
+    } else {
+        f->state = f->response ? FRAME_UNTIL_CLOSE : FRAME_DONE;
+    }
+    return 0;
+}
+
+/*
+ * Takes the line just completed in `f->line`, without its CRLF.
+ */
+static int
+end_line(struct frame *f)
+{
+    char           *line = f->line;
+    char           *end;
+    uint64_t        size;
+
+    switch (f->state) {
+    case FRAME_HEAD:
+        if (f->lines == 0) {
+            /*
+             * RFC 7230 3.5: empty lines before the start line are ignored.
+             */
+            if (*line == '\0')
+                return 0;
+            f->lines++;
+
+            /*
+             * HTTP/1.0 closes the connection unless told otherwise.
+             */
+            if (!f->response) {
+                f->persistent = strstr(line, " HTTP/1.0") == NULL;
+                return 0;
+            }
+            if (strncmp(line, "HTTP/", 5) != 0 || strlen(line) < 12
+                || !isdigit((unsigned char) line[9]))
+                return -1;
+            f->persistent = strncmp(line, "HTTP/1.0", 8) != 0;
+            f->status = atoi(line + 9);
+            return 0;
+        }
+        f->lines++;
+        if (*line == '\0')
+            return end_head(f);
+        return header_field(f, line);
+
+    case FRAME_CHUNK_SIZE:
+        if (!isxdigit((unsigned char) *line))
+            return -1;
+        size = strtoull(line, &end, 16);
+        if (size == 0) {
+            f->state = FRAME_TRAILER;
+        } else {
+            f->left = size + 2;
+            f->state = FRAME_CHUNK_DATA;
+        }
+        return 0;
+
+    case FRAME_TRAILER:
+        if (*line == '\0')
+            f->state = FRAME_DONE;
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Adds the bytes of `buf` up to the end of the line to `f->line`.
+ * Returns how many bytes were taken.
+ */
+static size_t
+take_line(struct frame *f, const char *buf, const size_t n, int *complete)
+{
+    const char     *lf = memchr(buf, '\n', n);
+    size_t          length = lf == NULL ? n : (size_t) (lf - buf) + 1;
+    size_t          room = FRAME_LINE_SIZE - 1 - f->line_length;
+
+    if (length > room)
+        f->truncated = 1;
+    memcpy(f->line + f->line_length, buf, min(length, room));
+    f->line_length += min(length, room);
+
+    *complete = lf != NULL;
+    return length;
+}
+
+ssize_t
+frame_feed(struct frame *f, const char *buf, size_t n)
+{
+    size_t          used = 0,
+                    k;
+    int             complete;
+
+    while (used < n && f->state != FRAME_DONE) {
+        switch (f->state) {
+        case FRAME_BODY:
+        case FRAME_CHUNK_DATA:
+        case FRAME_UNTIL_CLOSE:
+            k = min(n - used, frame_bulk(f));
+            frame_skip(f, k);
+            used += k;
+            break;
+
+        case FRAME_ERROR:
+            return -1;
+
+        default:
+            used += take_line(f, buf + used, n - used, &complete);
+            if (!complete)
+                break;
+
+            /*
+             * Without the CRLF, or a bare LF.
+             */
+            while (f->line_length > 0
+                   && (f->line[f->line_length - 1] == '\n'
+                       || f->line[f->line_length - 1] == '\r'))
+                f->line_length--;
+            f->line[f->line_length] = '\0';
+
+            if (end_line(f) == -1) {
+                f->state = FRAME_ERROR;
+                return -1;
+            }
+            f->line_length = 0;
+            f->truncated = 0;
+            break;
+        }
+    }
+    return used;
+}
+
+size_t
+frame_bulk(const struct frame *f)
+{
+    switch (f->state) {
+    case FRAME_BODY:
+    case FRAME_CHUNK_DATA:
+        return f->left > SIZE_MAX ? SIZE_MAX : (size_t) f->left;
+    case FRAME_UNTIL_CLOSE:
+        return SIZE_MAX;
+    default:
+        return 0;
+    }
+}
+
+void
+frame_skip(struct frame *f, size_t n)
+{
+    switch (f->state) {
+    case FRAME_BODY:
+        f->left -= n;
+        if (f->left == 0)
+            f->state = FRAME_DONE;
+        break;
+    case FRAME_CHUNK_DATA:
+        f->left -= n;
+        if (f->left == 0)
+            f->state = FRAME_CHUNK_SIZE;
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,99 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FRAMING_H_
+#define FRAMING_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * The longest line of a header or chunk that is looked at. The rest of a
+ * longer line is skipped.
+ */
+#define FRAME_LINE_SIZE 128
+
+/*
+ * How much of a message is peeked at, at a time, to frame it.
+ */
+#define FRAME_PEEK_SIZE 4096
+
+enum frame_state {
+    FRAME_HEAD,                 /* The start line and the header fields */
+    FRAME_BODY,                 /* `left` bytes of Content-Length body */
+    FRAME_CHUNK_SIZE,           /* The chunk-size line */
+    FRAME_CHUNK_DATA,           /* `left` bytes of chunk data and CRLF */
+    FRAME_TRAILER,              /* The trailer fields */
+    FRAME_UNTIL_CLOSE,          /* The body ends with the connection */
+    FRAME_DONE,
+    FRAME_ERROR
+};
+
+/*
+ * Where an HTTP/1.1 message ends (RFC 7230 3.3.3), followed as its bytes go
+ * by. The body is never copied or looked at, only counted.
+ */
+struct frame {
+    enum frame_state state;
+    int             response;   /* A response rather than a request */
+    int             head;       /* The response is to a HEAD request */
+    int             status;     /* Of the response */
+    int             persistent; /* The connection stays open after it */
+    int             lines;      /* Of the header, so far */
+    int             chunked;
+    int             encoded;    /* Transfer-Encoding is present */
+    int             has_length;
+    uint64_t        length;     /* Content-Length */
+    uint64_t        left;
+    size_t          line_length;
+    int             truncated;  /* The line is longer than `line` */
+    char            line[FRAME_LINE_SIZE];
+};
+
+void            frame_init(struct frame *f, const int response,
+                           const int head);
+
+/*
+ * Follows the message over the next `n` bytes of the stream. An interim
+ * (1xx) response is part of the message, as the final one follows it.
+ * Returns how many of the bytes belong to the message, which may end before
+ * `n`, or -1 if it is malformed.
+ */
+ssize_t         frame_feed(struct frame *f, const char *buf, size_t n);
+
+/*
+ * Returns how many of the next bytes can be passed on without being looked
+ * at (the body of the message, or its current chunk), 0 if none.
+ */
+size_t          frame_bulk(const struct frame *f);
+
+/*
+ * Passes `n` of the frame_bulk() bytes.
+ */
+void            frame_skip(struct frame *f, size_t n);
+
+#endif                          /* FRAMING_H_ */
@@ -0,0 +1,382 @@
+/*
+ * Measures how smoothly a rate-limited response is delivered through the
+ * proxy, with the sleep-based limiter ("pacing = 0") and with the kernel
+ * pacing the client socket ("pacing = 1"): the bytes received in every
+ * window of WINDOW_MS milliseconds, and the longest gap between two
+ * arrivals.
+ *
+ * Usage: pacebench [proxy] [seconds] [rate]
+ * Starts an origin that sends as fast as it can, then runs the proxy
+ * ("./webproxy" by default) once in each mode, limiting the origin to `rate`
+ * kbytes/sec (100 by default), and downloads through it for `seconds` (5 by
+ * default). Fails if pacing is not smoother than sleeping.
+ */
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WINDOW_MS   100
+#define MAX_WINDOWS 6000
+#define BUFFER_SIZE 65536
+#define MSS         1448        /* Of a 1500-byte MTU, with timestamps */
+
+/*
+ * How long the proxy has to start listening, in milliseconds.
+ */
+#define START_TIMEOUT 5000
+
+struct result {
+    long            total;
+    double          mean;       /* Bytes per window */
+    double          stddev;
+    double          max_gap;    /* In milliseconds */
+};
+
+static long     windows[MAX_WINDOWS];
+
+static double
+elapsed_ms(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+/*
+ * Returns a socket listening on the loopback, and its port in `port`.
+ */
+static int
+listen_any(int *port)
+{
+    struct sockaddr_in addr;
+    socklen_t       len = sizeof(addr);
+    int             fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || listen(fd, 16) == -1
+        || getsockname(fd, (struct sockaddr *) &addr, &len) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/*
+ * Connects to `port` on the loopback. A `client` asks for the segments of an
+ * Ethernet link (MSS), rather than those of the loopback, which the kernel
+ * would pace 64 kbytes at a time.
+ */
+static int
+connect_to(const int port, const int client)
+{
+    int             mss = MSS;
+    struct sockaddr_in addr;
+    int             fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    if (client)
+        setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * The origin: answers every request with `length` bytes, sent as fast as
+ * the proxy takes them.
+ */
+static void
+run_origin(int lfd, const long length)
+{
+    char            buffer[BUFFER_SIZE];
+    ssize_t         n;
+    long            sent;
+    int             fd,
+                    got;
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(buffer, 'x', sizeof(buffer));
+
+    for (;;) {
+        fd = accept(lfd, NULL, NULL);
+        if (fd == -1)
+            continue;
+
+        /*
+         * The whole request, so that the proxy does not take the response
+         * for an early one.
+         */
+        got = 0;
+        while (got < (int) sizeof(buffer) - 1
+               && (n = recv(fd, buffer + got, sizeof(buffer) - 1 - got,
+                            0)) > 0) {
+            got += n;
+            buffer[got] = '\0';
+            if (strstr(buffer, "\r\n\r\n") != NULL)
+                break;
+        }
+
+        n = snprintf(buffer, sizeof(buffer), "HTTP/1.0 200 OK\r\n"
+                     "Content-Length: %ld\r\n\r\n", length);
+        send(fd, buffer, n, 0);
+        memset(buffer, 'x', sizeof(buffer));
+        for (sent = 0; sent < length; sent += n) {
+            n = send(fd, buffer, length - sent < (long) sizeof(buffer)
+                     ? length - sent : (long) sizeof(buffer), 0);
+            if (n <= 0)
+                break;
+        }
+        close(fd);
+    }
+}
+
+/*
+ * Starts the proxy at `port`, pacing or not, with the origin limited to
+ * `rate` kbytes/sec.
+ * Returns its pid, or -1 on failure.
+ */
+static pid_t
+start_proxy(const char *proxy, char *conf, const int port, const int pacing,
+            const int rate)
+{
+    struct timespec t = { 0, 10 * 1000000 };
+    FILE           *fp;
+    pid_t           pid;
+    int             fd,
+                    i;
+
+    fd = mkstemp(conf);
+    if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
+        perror("mkstemp");
+        return -1;
+    }
+    fprintf(fp, "proxy_port = %d\npacing = %d\n[rates]\n127.0.0.1 %d\n", port,
+            pacing, rate);
+    fclose(fp);
+
+    pid = fork();
+    if (pid == 0) {
+        execl(proxy, proxy, "-f", conf, (char *) NULL);
+        perror(proxy);
+        _exit(EXIT_FAILURE);
+    }
+    if (pid == -1)
+        return -1;
+
+    for (i = 0; i < START_TIMEOUT / 10; i++) {
+        fd = connect_to(port, 0);
+        if (fd != -1) {
+            close(fd);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        nanosleep(&t, NULL);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/*
+ * Downloads from the origin at `origin` through the proxy at `port` for
+ * `seconds`.
+ * Returns -1 on failure.
+ */
+static int
+measure(const int port, const int origin, const double seconds,
+        struct result *r)
+{
+    struct timespec start,
+                    last,
+                    t;
+    char            buffer[BUFFER_SIZE];
+    double          gap,
+                    ms,
+                    var;
+    ssize_t         n;
+    int             fd,
+                    w,
+                    count = 0,
+                    first,
+                    i;
+
+    memset(windows, 0, sizeof(windows));
+    memset(r, 0, sizeof(*r));
+
+    fd = connect_to(port, 1);
+    if (fd == -1) {
+        perror("connect");
+        return -1;
+    }
+
+    n = snprintf(buffer, sizeof(buffer), "GET http://127.0.0.1:%d/ HTTP/1.0"
+                 "\r\nHost: 127.0.0.1:%d\r\n\r\n", origin, origin);
+    if (send(fd, buffer, n, 0) != n) {
+        perror("send");
+        close(fd);
+        return -1;
+    }
+
+    /*
+     * The first window starts with the first byte, not with the request.
+     */
+    first = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last = start;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        if (first) {
+            start = last = t;
+            first = 0;
+        }
+
+        ms = elapsed_ms(&start, &t);
+        if (ms > seconds * 1e3)
+            break;
+        gap = elapsed_ms(&last, &t);
+        if (gap > r->max_gap)
+            r->max_gap = gap;
+        last = t;
+
+        w = (int) (ms / WINDOW_MS);
+        if (w >= MAX_WINDOWS)
+            break;
+        windows[w] += n;
+        if (w + 1 > count)
+            count = w + 1;
+        r->total += n;
+    }
+    close(fd);
+
+    /*
+     * The last window is partial.
+     */
+    if (count > 1)
+        count--;
+    if (count == 0)
+        return -1;
+
+    for (i = 0; i < count; i++)
+        r->mean += windows[i];
+    r->mean /= count;
+    for (i = 0, var = 0; i < count; i++)
+        var += (windows[i] - r->mean) * (windows[i] - r->mean);
+    r->stddev = sqrt(var / count);
+
+    return 0;
+}
+
+static void
+report(const char *mode, const struct result *r)
+{
+    printf("%-8s %8ld bytes, %6.1f kbytes/sec, per %d ms: mean %6.0f, "
+           "stddev %6.0f (%3.0f%%), longest gap %6.1f ms\n", mode, r->total,
+           r->mean * (1000 / WINDOW_MS) / 1024, WINDOW_MS, r->mean,
+           r->stddev, r->stddev * 100 / r->mean, r->max_gap);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const char *modes[] = { "sleeping", "pacing" };
+    struct result   results[2];
+    const char     *proxy = "./webproxy";
+    char            conf[32];
+    double          seconds = 5;
+    pid_t           origin_pid,
+                    pid;
+    int             rate = 100,
+                    lfd,
+                    origin,
+                    port,
+                    fd,
+                    ok = 1,
+                    i;
+
+    if (argc > 1)
+        proxy = argv[1];
+    if (argc > 2)
+        seconds = atof(argv[2]);
+    if (argc > 3)
+        rate = atoi(argv[3]);
+    if (seconds <= 0 || rate <= 0) {
+        fprintf(stderr, "Usage: %s [proxy] [seconds] [rate]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    lfd = listen_any(&origin);
+    if (lfd == -1) {
+        perror("origin");
+        return EXIT_FAILURE;
+    }
+    origin_pid = fork();
+    if (origin_pid == 0)
+        run_origin(lfd, (long) ((seconds + 3) * rate * 1024));
+    close(lfd);
+
+    for (i = 0; i < 2 && ok; i++) {
+        /*
+         * A port of its own, free of the last run's connections.
+         */
+        fd = listen_any(&port);
+        close(fd);
+
+        strcpy(conf, "/tmp/pacebench.XXXXXX");
+        pid = start_proxy(proxy, conf, port, i, rate);
+        if (pid == -1) {
+            fprintf(stderr, "Cannot start %s\n", proxy);
+            ok = 0;
+        } else {
+            ok = measure(port, origin, seconds, &results[i]) == 0;
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+        unlink(conf);
+    }
+
+    kill(origin_pid, SIGTERM);
+    waitpid(origin_pid, NULL, 0);
+
+    if (!ok)
+        return EXIT_FAILURE;
+
+    for (i = 0; i < 2; i++)
+        report(modes[i], &results[i]);
+
+    if (results[1].stddev * results[0].mean
+        >= results[0].stddev * results[1].mean) {
+        printf("FAIL pacing is not smoother than sleeping\n");
+        return EXIT_FAILURE;
+    }
+    printf("ok   pacing is smoother than sleeping\n");
+    return EXIT_SUCCESS;
+}
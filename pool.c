@@ -0,0 +1,617 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Pool of idle connections to the servers, shared by all the processes.
+ *
+ * A socket cannot be moved between processes through shared memory, so the
+ * idle connections are kept by a broker process. The others talk to it over a
+ * SOCK_SEQPACKET Unix socket and hand the connections back and forth with
+ * SCM_RIGHTS.
+ *
+ * Every process connects to the broker on first use to return connections,
+ * which it does without waiting. A connection is borrowed over a socket of
+ * its own, so that the event engine can wait for the answer in epoll(7). A
+ * connection is only handed out if the server has neither closed it nor sent
+ * anything since it was returned. The broker drops a connection as soon as the server closes
+ * it, and after `max_idle` seconds in any case.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "http.h"
+#include "pool.h"
+#include "utils.h"
+#include "webproxy.h"
+
+#define POOL_GET   'G'
+#define POOL_PUT   'P'
+#define POOL_FOUND 'F'
+#define POOL_MISS  'M'
+
+#define POOL_KEY_LENGTH (HOSTNAME_LENGTH + PORT_LENGTH + 1)
+
+/*
+ * How long a process waits for the broker, in milliseconds.
+ */
+#define POOL_TIMEOUT 100
+
+/*
+ * Tags of the epoll(7) events of the broker.
+ */
+#define TAG_LISTENER 0
+#define TAG_CLIENT   1
+#define TAG_IDLE     2
+
+#define MAKE_TAG(T, V) (((uint64_t) (T) << 32) | (uint32_t) (V))
+#define TAG_TYPE(D)    ((int) ((D) >> 32))
+#define TAG_VALUE(D)   ((int) ((D) & 0xffffffff))
+
+struct pool_msg {
+    char            op;
+    char            key[POOL_KEY_LENGTH];       /* "hostname:port" */
+};
+
+struct idle {
+    int             fd;         /* -1 if the slot is free */
+    time_t          since;
+    char            key[POOL_KEY_LENGTH];
+};
+
+/*
+ * Address of the broker; `pool_addr_len` is 0 if there is no broker.
+ */
+static struct sockaddr_un pool_addr;
+static socklen_t pool_addr_len = 0;
+
+/*
+ * Connection of this process to the broker.
+ */
+static int      pool_fd = -1;
+static pid_t    pool_owner = -1;
+
+static void
+make_key(char *key, const char *hostname, const char *port)
+{
+    char           *p;
+
+    snprintf(key, POOL_KEY_LENGTH, "%s:%s", hostname, port);
+    for (p = key; *p != '\0'; p++)
+        *p = tolower(*p);
+}
+
+/*
+ * Sends `msg`, and `fd` along with it unless it is -1, without waiting.
+ */
+static int
+send_msg(int sock, const struct pool_msg *msg, int fd)
+{
+    struct msghdr   mh;
+    struct iovec    iov;
+    struct cmsghdr *cm;
+    char            control[CMSG_SPACE(sizeof(int))];
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = (void *) msg;
+    iov.iov_len = sizeof(*msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (fd != -1) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+
+    return sendmsg(sock, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(*msg)
+        ? 0 : -1;
+}
+
+/*
+ * Receives a message, and the socket passed along with it into `fd` (-1 if
+ * there is none).
+ * Returns the result of recvmsg(2).
+ */
+static ssize_t
+recv_msg(int sock, struct pool_msg *msg, int *fd)
+{
+    struct msghdr   mh;
+    struct iovec    iov;
+    struct cmsghdr *cm;
+    char            control[CMSG_SPACE(sizeof(int))];
+    ssize_t         n;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = msg;
+    iov.iov_len = sizeof(*msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return n;
+
+    for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cm), sizeof(int));
+    }
+
+    if (n != sizeof(*msg)) {
+        CLOSEFD(*fd);
+        *fd = -1;
+        errno = EPROTO;
+        return -1;
+    }
+    msg->key[POOL_KEY_LENGTH - 1] = '\0';
+
+    return n;
+}
+
+/*
+ * A connection can be reused if the server has neither closed it nor sent
+ * anything that does not belong to a response we relayed.
+ */
+static int
+is_idle(int sfd)
+{
+    char            c;
+
+    return recv(sfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+        && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Returns the connection to the broker of this process, connecting to it if
+ * needed.
+ */
+static int
+broker(void)
+{
+    int             sfd;
+
+    if (pool_addr_len == 0)
+        return -1;
+
+    /*
+     * A child must not share the connection of its parent.
+     */
+    if (pool_fd != -1 && pool_owner == getpid())
+        return pool_fd;
+    if (pool_fd != -1)
+        close(pool_fd);
+    pool_fd = -1;
+
+    sfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sfd == -1)
+        return -1;
+
+    if (connect(sfd, (struct sockaddr *) &pool_addr, pool_addr_len) == -1) {
+        log_warn("Cannot connect to the connection pool");
+        close(sfd);
+        return -1;
+    }
+
+    pool_fd = sfd;
+    pool_owner = getpid();
+    return pool_fd;
+}
+
+/*
+ * Drops the connection to the broker after an error. The next use connects
+ * again.
+ */
+static void
+broker_reset(void)
+{
+    CLOSEFD(pool_fd);
+    pool_fd = -1;
+}
+
+int
+pool_ask(const char *hostname, const char *port)
+{
+    struct pool_msg msg;
+    int             fd;
+
+    if (pool_addr_len == 0)
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op = POOL_GET;
+    make_key(msg.key, hostname, port);
+
+    if (connect(fd, (struct sockaddr *) &pool_addr, pool_addr_len) == -1
+        || send_msg(fd, &msg, -1) == -1) {
+        log_warn("Cannot reach the connection pool");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int
+pool_answer(int fd, int *sfd)
+{
+    struct pool_msg msg;
+    ssize_t         n;
+
+    do {
+        n = recv_msg(fd, &msg, sfd);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return -1;
+
+    if (n <= 0 || msg.op != POOL_FOUND || *sfd == -1) {
+        CLOSEFD(*sfd);
+        *sfd = -1;
+        return 0;
+    }
+
+    /*
+     * The server may have closed it since the broker last looked.
+     */
+    if (!is_idle(*sfd)) {
+        close(*sfd);
+        *sfd = -1;
+        return 0;
+    }
+
+    log_info("Reusing a connection to %s", msg.key);
+    return 0;
+}
+
+int
+pool_get(const char *hostname, const char *port)
+{
+    struct pollfd   pfd;
+    int             sfd,
+                    flags;
+
+    pfd.fd = pool_ask(hostname, port);
+    if (pfd.fd == -1)
+        return -1;
+
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, POOL_TIMEOUT) == -1 && errno == EINTR);
+
+    if (pool_answer(pfd.fd, &sfd) == -1)
+        sfd = -1;
+    close(pfd.fd);
+
+    if (sfd == -1)
+        return -1;
+
+    flags = fcntl(sfd, F_GETFL);
+    if (flags != -1 && (flags & O_NONBLOCK))
+        fcntl(sfd, F_SETFL, flags & ~O_NONBLOCK);
+
+    return sfd;
+}
+
+void
+pool_put(const char *hostname, const char *port, int sfd)
+{
+    struct pool_msg msg;
+    int             sock;
+
+    if (sfd == -1)
+        return;
+
+    sock = broker();
+    if (sock == -1 || !is_idle(sfd)) {
+        close(sfd);
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op = POOL_PUT;
+    make_key(msg.key, hostname, port);
+
+    /*
+     * A broker too busy to take it is not waited for.
+     */
+    if (send_msg(sock, &msg, sfd) == -1 && errno != EAGAIN
+        && errno != EWOULDBLOCK)
+        broker_reset();
+    close(sfd);
+}
+
+/*
+ * The broker
+ */
+
+static struct idle *idles = NULL;
+static int      num_idles = 0;
+
+static void
+drop_idle(int epfd, struct idle *e)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, e->fd, NULL);
+    close(e->fd);
+    e->fd = -1;
+}
+
+static void
+handle_get(int epfd, int client, const struct pool_msg *req)
+{
+    struct pool_msg reply;
+    struct idle    *e = NULL;
+    int             i;
+
+    /*
+     * The most recently returned connection is the least likely to have been
+     * closed by the server.
+     */
+    for (i = 0; i < num_idles; i++) {
+        if (idles[i].fd != -1 && strcmp(idles[i].key, req->key) == 0
+            && (e == NULL || idles[i].since > e->since))
+            e = &idles[i];
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    strcpy(reply.key, req->key);
+    if (e == NULL) {
+        reply.op = POOL_MISS;
+        send_msg(client, &reply, -1);
+        return;
+    }
+
+    reply.op = POOL_FOUND;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, e->fd, NULL);
+    send_msg(client, &reply, e->fd);
+    close(e->fd);
+    e->fd = -1;
+}
+
+static void
+handle_put(int epfd, const struct pool_msg *req, int sfd)
+{
+    struct epoll_event ev;
+    struct idle    *e = NULL;
+    int             i;
+
+    /*
+     * Take a free slot, or evict the oldest connection.
+     */
+    for (i = 0; i < num_idles; i++) {
+        if (idles[i].fd == -1) {
+            e = &idles[i];
+            break;
+        }
+        if (e == NULL || idles[i].since < e->since)
+            e = &idles[i];
+    }
+    if (e->fd != -1)
+        drop_idle(epfd, e);
+
+    /*
+     * Anything from the server, including the end of file, makes the
+     * connection useless.
+     */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u64 = MAKE_TAG(TAG_IDLE, e - idles);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) == -1) {
+        close(sfd);
+        return;
+    }
+
+    e->fd = sfd;
+    e->since = time(NULL);
+    strcpy(e->key, req->key);
+}
+
+static void
+handle_client(int epfd, int client)
+{
+    struct pool_msg msg;
+    ssize_t         n;
+    int             sfd;
+
+    for (;;) {
+        n = recv_msg(client, &msg, &sfd);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, client, NULL);
+            close(client);
+            return;
+        }
+
+        if (msg.op == POOL_GET) {
+            CLOSEFD(sfd);
+            handle_get(epfd, client, &msg);
+        } else if (msg.op == POOL_PUT && sfd != -1) {
+            handle_put(epfd, &msg, sfd);
+        } else {
+            CLOSEFD(sfd);
+        }
+    }
+}
+
+static void
+accept_clients(int epfd, int lfd)
+{
+    struct epoll_event ev;
+    int             client;
+
+    for (;;) {
+        client = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client == -1)
+            return;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = MAKE_TAG(TAG_CLIENT, client);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) == -1)
+            close(client);
+    }
+}
+
+static void
+run_broker(int lfd, const int max_idle)
+{
+    struct epoll_event events[64];
+    struct epoll_event ev;
+    time_t          now;
+    int             epfd,
+                    n,
+                    i;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    check(epfd != -1, "Cannot create the epoll instance");
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = MAKE_TAG(TAG_LISTENER, lfd);
+    check(epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == 0,
+          "Cannot watch the pool socket");
+
+    for (;;) {
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]),
+                       1000);
+        if (n == -1 && errno != EINTR)
+            break;
+
+        for (i = 0; i < n; i++) {
+            switch (TAG_TYPE(events[i].data.u64)) {
+            case TAG_LISTENER:
+                accept_clients(epfd, lfd);
+                break;
+            case TAG_CLIENT:
+                handle_client(epfd, TAG_VALUE(events[i].data.u64));
+                break;
+            case TAG_IDLE:
+                if (idles[TAG_VALUE(events[i].data.u64)].fd != -1)
+                    drop_idle(epfd, &idles[TAG_VALUE(events[i].data.u64)]);
+                break;
+            }
+        }
+
+        now = time(NULL);
+        for (i = 0; i < num_idles; i++) {
+            if (idles[i].fd != -1 && now - idles[i].since >= max_idle)
+                drop_idle(epfd, &idles[i]);
+        }
+    }
+
+  error:
+    return;
+}
+
+pid_t
+pool_start(const int size, const int max_idle)
+{
+    int             lfd;
+    int             i;
+    pid_t           pid = -1;
+
+    if (size <= 0)
+        return 0;
+
+    /*
+     * An abstract address, which goes away with the broker.
+     */
+    memset(&pool_addr, 0, sizeof(pool_addr));
+    pool_addr.sun_family = AF_UNIX;
+    snprintf(pool_addr.sun_path + 1, sizeof(pool_addr.sun_path) - 1,
+             "webproxy-pool.%ld", (long) getpid());
+    pool_addr_len = offsetof(struct sockaddr_un, sun_path) + 1
+        + strlen(pool_addr.sun_path + 1);
+
+    lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    check(lfd != -1, "Cannot create the pool socket");
+    check(bind(lfd, (struct sockaddr *) &pool_addr, pool_addr_len) == 0,
+          "Cannot bind the pool socket");
+    check(listen(lfd, SOMAXCONN) == 0, "Cannot listen on the pool socket");
+
+    pid = fork();
+    switch (pid) {
+    case 0:
+        signal(SIGINT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_IGN);
+
+        idles = calloc(size, sizeof(*idles));
+        check_mem(idles);
+        num_idles = size;
+        for (i = 0; i < num_idles; i++)
+            idles[i].fd = -1;
+
+        run_broker(lfd, max_idle);
+        _exit(EXIT_FAILURE);
+    case -1:
+        log_err("Cannot fork()");
+        goto error;
+    default:
+        break;
+    }
+
+    close(lfd);
+    return pid;
+
+  error:
+    if (pid == 0)
+        _exit(EXIT_FAILURE);
+    CLOSEFD(lfd);
+    pool_addr_len = 0;
+    return -1;
+}
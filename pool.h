@@ -0,0 +1,76 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <sys/types.h>
+
+/*
+ * Default bounds of the pool of idle server connections.
+ */
+#define POOL_DEFAULT_SIZE 64    /* Idle connections kept */
+#define POOL_DEFAULT_IDLE 30    /* Seconds an idle connection is kept */
+
+/*
+ * Forks the broker that keeps the idle server connections. It must be called
+ * before the processes that use the pool are forked.
+ * Returns the pid of the broker, 0 if `size` is 0 (no pool), or -1 on
+ * failure.
+ */
+pid_t           pool_start(const int size, const int max_idle);
+
+/*
+ * Asks the broker for an idle connection to `hostname`:`port`, without
+ * waiting.
+ * Returns a non-blocking socket that becomes readable once the answer is
+ * ready, or -1 if there is no broker.
+ */
+int             pool_ask(const char *hostname, const char *port);
+
+/*
+ * Reads the answer from `fd`, as returned by pool_ask(), into `sfd`: the
+ * connection, in the mode it was returned in, or -1 if there is none. The
+ * caller closes `fd`.
+ * Returns -1 if the answer has not arrived yet, 0 otherwise.
+ */
+int             pool_answer(int fd, int *sfd);
+
+/*
+ * Borrows an idle connection to `hostname`:`port`, waiting for the broker.
+ * The socket is in blocking mode.
+ * Returns the socket, or -1 if there is none.
+ */
+int             pool_get(const char *hostname, const char *port);
+
+/*
+ * Returns the connection `sfd` to `hostname`:`port` to the pool, without
+ * waiting. The caller no longer owns `sfd`; it is closed if it cannot be
+ * reused.
+ */
+void            pool_put(const char *hostname, const char *port, int sfd);
+
+#endif                          /* POOL_H_ */
@@ -0,0 +1,242 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Connection racing ("Happy Eyeballs", RFC 8305).
+ *
+ * Trying the addresses of a server one after another means that a single
+ * black-holed address costs a whole connect timeout before the next one is
+ * tried. Instead, an attempt is started every RACE_ATTEMPT_DELAY
+ * milliseconds, or as soon as the previous one fails, and the first one to
+ * connect wins.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "race.h"
+
+void
+race_init(struct race *r, const struct resolver_answer *answer)
+{
+    int             taken[RESOLVER_MAX_ADDRS];
+    int             family;
+    int             i,
+                    n;
+
+    memset(r, 0, sizeof(*r));
+    r->answer = answer;
+    memset(taken, 0, sizeof(taken));
+
+    /*
+     * Alternate the families, keeping the order within each.
+     */
+    family = answer->count > 0 ? answer->addr[0].family : 0;
+    for (n = 0; n < answer->count; n++) {
+        for (i = 0; i < answer->count; i++) {
+            if (!taken[i] && answer->addr[i].family == family)
+                break;
+        }
+        if (i == answer->count)
+            for (i = 0; taken[i]; i++);
+        taken[i] = 1;
+        r->order[n] = i;
+        family = answer->addr[i].family == AF_INET6 ? AF_INET : AF_INET6;
+    }
+
+    for (i = 0; i < RESOLVER_MAX_ADDRS; i++)
+        r->fd[i] = -1;
+}
+
+int
+race_start(struct race *r, const struct timeval *now)
+{
+    const struct resolver_addr *p;
+    int             i,
+                    sfd;
+
+    while (r->started < r->answer->count) {
+        i = r->order[r->started++];
+        p = &r->answer->addr[i];
+
+        sfd = socket(p->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0);
+        if (sfd == -1)
+            continue;
+        if (connect(sfd, (const struct sockaddr *) &p->addr, p->len) == -1
+            && errno != EINPROGRESS) {
+            close(sfd);
+            continue;
+        }
+
+        r->fd[i] = sfd;
+        r->pending++;
+        r->next = *now;
+        r->next.tv_usec += RACE_ATTEMPT_DELAY * 1000;
+        if (r->next.tv_usec >= 1000000) {
+            r->next.tv_sec++;
+            r->next.tv_usec -= 1000000;
+        }
+        return sfd;
+    }
+    return -1;
+}
+
+int
+race_check(struct race *r, int *fd)
+{
+    struct pollfd   pfd[RESOLVER_MAX_ADDRS];
+    int             index[RESOLVER_MAX_ADDRS];
+    int             error;
+    socklen_t       len;
+    int             i,
+                    n = 0;
+
+    for (i = 0; i < RESOLVER_MAX_ADDRS; i++) {
+        if (r->fd[i] == -1)
+            continue;
+        pfd[n].fd = r->fd[i];
+        pfd[n].events = POLLOUT;
+        index[n++] = i;
+    }
+    if (n == 0 || poll(pfd, n, 0) <= 0)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        if (pfd[i].revents == 0)
+            continue;
+
+        len = sizeof(error);
+        if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+            error = errno;
+
+        if (error == 0) {
+            *fd = pfd[i].fd;
+            r->fd[index[i]] = -1;
+            r->pending--;
+            race_cancel(r);
+            return index[i];
+        }
+
+        close(pfd[i].fd);
+        r->fd[index[i]] = -1;
+        r->pending--;
+    }
+    return -1;
+}
+
+int
+race_lost(const struct race *r)
+{
+    return r->pending == 0 && r->started == r->answer->count;
+}
+
+void
+race_cancel(struct race *r)
+{
+    int             i;
+
+    for (i = 0; i < RESOLVER_MAX_ADDRS; i++) {
+        if (r->fd[i] != -1) {
+            close(r->fd[i]);
+            r->fd[i] = -1;
+        }
+    }
+    r->pending = 0;
+}
+
+int
+race_connect(const struct resolver_answer *answer, const int timeout,
+             int *index)
+{
+    struct race     r;
+    struct pollfd   pfd[RESOLVER_MAX_ADDRS];
+    struct timeval  now,
+                    deadline,
+                    due,
+                    diff;
+    int             sfd = -1;
+    int             flags;
+    int             ms,
+                    i,
+                    n;
+
+    race_init(&r, answer);
+
+    gettimeofday(&now, NULL);
+    deadline = now;
+    deadline.tv_sec += timeout;
+
+    while (!race_lost(&r) && timercmp(&now, &deadline, <)) {
+        if (r.pending == 0 || !timercmp(&now, &r.next, <))
+            race_start(&r, &now);
+
+        /*
+         * Wait until an attempt finishes or the next one is due.
+         */
+        due = deadline;
+        if (r.started < answer->count && timercmp(&r.next, &due, <))
+            due = r.next;
+        ms = 0;
+        if (timercmp(&due, &now, >)) {
+            timersub(&due, &now, &diff);
+            ms = diff.tv_sec * 1000 + (diff.tv_usec + 999) / 1000;
+        }
+
+        for (i = 0, n = 0; i < RESOLVER_MAX_ADDRS; i++) {
+            if (r.fd[i] == -1)
+                continue;
+            pfd[n].fd = r.fd[i];
+            pfd[n++].events = POLLOUT;
+        }
+        if (n > 0 && poll(pfd, n, ms) == -1 && errno != EINTR)
+            break;
+
+        *index = race_check(&r, &sfd);
+        if (*index != -1)
+            break;
+
+        gettimeofday(&now, NULL);
+    }
+
+    race_cancel(&r);
+
+    if (sfd == -1)
+        return -1;
+
+    flags = fcntl(sfd, F_GETFL);
+    if (flags != -1)
+        fcntl(sfd, F_SETFL, flags & ~O_NONBLOCK);
+    return sfd;
+}
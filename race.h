@@ -0,0 +1,97 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RACE_H_
+#define RACE_H_
+
+#include <sys/time.h>
+
+#include "resolver.h"
+
+/*
+ * Delay between the starts of two connection attempts, in milliseconds
+ * (RFC 8305 Section 5).
+ */
+#define RACE_ATTEMPT_DELAY 250
+
+/*
+ * Default bound of a whole race, in seconds.
+ */
+#define RACE_DEFAULT_TIMEOUT 5
+
+/*
+ * Non-blocking connection attempts to the addresses of one server.
+ */
+struct race {
+    const struct resolver_answer *answer;
+    int             order[RESOLVER_MAX_ADDRS];  /* Families interleaved */
+    int             fd[RESOLVER_MAX_ADDRS];     /* By address, -1 if idle */
+    int             started;    /* Attempts started, in `order` */
+    int             pending;    /* Attempts in progress */
+    struct timeval  next;       /* When the next attempt is due */
+};
+
+/*
+ * Prepares a race between the addresses of `answer`. IPv6 and IPv4
+ * addresses are tried in turn, starting with the family of the first one.
+ */
+void            race_init(struct race *r,
+                          const struct resolver_answer *answer);
+
+/*
+ * Starts the next attempt, skipping the addresses that fail at once, and
+ * makes the one after it due RACE_ATTEMPT_DELAY after `now`.
+ * Returns the socket of the attempt, or -1 if no address is left.
+ */
+int             race_start(struct race *r, const struct timeval *now);
+
+/*
+ * Collects the attempts that have finished, without waiting. The attempts
+ * that failed are closed; once one succeeds, the others are cancelled.
+ * Returns the index in the answer of the address connected to, with its
+ * socket in `fd`, or -1 if there is none yet.
+ */
+int             race_check(struct race *r, int *fd);
+
+/*
+ * Returns 1 once every address has been tried and failed.
+ */
+int             race_lost(const struct race *r);
+
+/*
+ * Cancels the attempts in progress.
+ */
+void            race_cancel(struct race *r);
+
+/*
+ * Runs a race to completion, for at most `timeout` seconds.
+ * Returns the socket, in blocking mode, with the index of its address in
+ * `index`, or -1 if every address failed.
+ */
+int             race_connect(const struct resolver_answer *answer,
+                             const int timeout, int *index);
+
+#endif                          /* RACE_H_ */
@@ -0,0 +1,153 @@
+/*
+ * Compares the lookup of the rate of a host in the compiled [rates] with the
+ * walk over the configuration that get_rate() used to do.
+ *
+ * Usage: ratebench [rules]
+ * Generates that many rules (100000 by default), and looks up a mix of
+ * hosts that match a rule, a parent domain of a rule, or nothing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "config.h"
+#include "rates.h"
+#include "utils.h"
+
+#define LOOKUPS      1000000
+#define LINEAR_LOOKUPS 200
+#define NUM_HOSTS    1024
+
+int             debug_level = 0;
+
+static const char *tlds[] = { "com", "net", "org", "edu.au", "co.uk" };
+
+#define NUM_TLDS (sizeof(tlds) / sizeof(tlds[0]))
+
+/*
+ * The old get_rate().
+ */
+static int
+linear_rate(struct config_sect *conf, const char *hostname)
+{
+    struct config_sect *p;
+    struct config_token *token;
+    size_t          best_match = 0;
+    int             rate = -1;
+
+    for (p = conf; p != NULL; p = p->next) {
+        if (strcasecmp(p->name, "rates") != 0)
+            continue;
+        for (token = p->tokens; token != NULL; token = token->next) {
+            if (endswith(hostname, token->token, 1) == TRUE
+                && strlen(token->token) > best_match) {
+                best_match = strlen(token->token);
+                rate = atoi(token->value);
+            }
+        }
+    }
+    return rate;
+}
+
+static double
+elapsed_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct config_sect sect;
+    struct config_token *tokens;
+    struct rate_table *t;
+    struct rate_rule *r;
+    struct timespec start,
+                    stop;
+    char            name[64],
+                    value[16];
+    char           *hosts[NUM_HOSTS];
+    long            sum = 0;
+    int             num_rules = 100000,
+                    i;
+
+    if (argc > 1)
+        num_rules = atoi(argv[1]);
+    if (num_rules <= 0) {
+        fprintf(stderr, "Usage: %s [rules]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    tokens = calloc(num_rules, sizeof(*tokens));
+    if (tokens == NULL)
+        return EXIT_FAILURE;
+    for (i = 0; i < num_rules; i++) {
+        snprintf(name, sizeof(name), "site%d.%s", i, tlds[i % NUM_TLDS]);
+        snprintf(value, sizeof(value), "%d", i % 1000 + 1);
+        tokens[i].token = strdup(name);
+        tokens[i].value = strdup(value);
+        tokens[i].next = i + 1 < num_rules ? &tokens[i + 1] : NULL;
+    }
+    sect.name = "rates";
+    sect.tokens = tokens;
+    sect.next = NULL;
+
+    /*
+     * A third match a rule, a third are under one, a third match nothing.
+     */
+    srand(1);
+    for (i = 0; i < NUM_HOSTS; i++) {
+        int             k = rand() % num_rules;
+
+        switch (i % 3) {
+        case 0:
+            snprintf(name, sizeof(name), "site%d.%s", k, tlds[k % NUM_TLDS]);
+            break;
+        case 1:
+            snprintf(name, sizeof(name), "www.cdn.site%d.%s", k,
+                     tlds[k % NUM_TLDS]);
+            break;
+        default:
+            snprintf(name, sizeof(name), "www.example%d.test", k);
+            break;
+        }
+        hosts[i] = strdup(name);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    t = rate_table_build(&sect);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (t == NULL)
+        return EXIT_FAILURE;
+    printf("%d rules compiled in %.1f ms\n", t->num_rules,
+           elapsed_ns(&start, &stop) / 1e6);
+
+    for (i = 0; i < NUM_HOSTS; i++) {
+        r = rate_table_match(t, hosts[i]);
+        if ((r == NULL ? -1 : r->rate) != linear_rate(&sect, hosts[i])) {
+            fprintf(stderr, "%s: the lookups disagree\n", hosts[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < LOOKUPS; i++) {
+        r = rate_table_match(t, hosts[i % NUM_HOSTS]);
+        sum += r == NULL ? -1 : r->rate;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    printf("%-10s %10.1f ns/lookup\n", "compiled",
+           elapsed_ns(&start, &stop) / LOOKUPS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < LINEAR_LOOKUPS; i++)
+        sum += linear_rate(&sect, hosts[i % NUM_HOSTS]);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    printf("%-10s %10.1f ns/lookup\n", "linear",
+           elapsed_ns(&start, &stop) / LINEAR_LOOKUPS);
+
+    rate_table_free(t);
+    return sum == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,208 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Lookup of the rate-limiting policy of a host.
+ *
+ * The rules of [rates] are kept in an open-addressing hash table keyed by
+ * domain. The hash is FNV-1a over the characters of a name taken from right
+ * to left, so walking a hostname backwards yields the hash of every suffix
+ * in turn. A lookup probes the table at each label boundary only, and the
+ * last hit is the longest matching domain.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dbg.h"
+#include "rates.h"
+#include "webproxy.h"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+static uint32_t
+hash_step(const uint32_t h, const char c)
+{
+    return (h ^ (unsigned char) tolower((unsigned char) c)) * FNV_PRIME;
+}
+
+/*
+ * Returns the rule of exactly `name`, which is `length` bytes long and
+ * hashes to `h`, or NULL.
+ */
+static struct rate_rule *
+lookup(const struct rate_table *t, const char *name, const size_t length,
+       const uint32_t h)
+{
+    struct rate_rule *r;
+    uint32_t        i;
+
+    for (i = h & t->mask; t->slots[i] != -1; i = (i + 1) & t->mask) {
+        r = &t->rules[t->slots[i]];
+        if (r->hash == h && r->length == length
+            && strncasecmp(r->domain, name, length) == 0)
+            return r;
+    }
+    return NULL;
+}
+
+static uint32_t
+hash_name(const char *name, const size_t length)
+{
+    uint32_t        h = FNV_OFFSET;
+    size_t          i;
+
+    for (i = length; i > 0; i--)
+        h = hash_step(h, name[i - 1]);
+    return h;
+}
+
+struct rate_table *
+rate_table_build(struct config_sect *conf)
+{
+    struct rate_table *t;
+    struct rate_rule *r;
+    struct config_sect *p;
+    struct config_token *token;
+    const char     *name;
+    uint32_t        size,
+                    i;
+    int             count = 0;
+
+    t = calloc(1, sizeof(*t));
+    check_mem(t);
+
+    for (p = conf; p != NULL; p = p->next) {
+        if (strcasecmp(p->name, "rates") != 0)
+            continue;
+        for (token = p->tokens; token != NULL; token = token->next)
+            count++;
+    }
+
+    /*
+     * At most half full.
+     */
+    for (size = 16; size < (uint32_t) count * 2; size <<= 1);
+    t->mask = size - 1;
+    t->slots = malloc(size * sizeof(*t->slots));
+    check_mem(t->slots);
+    memset(t->slots, -1, size * sizeof(*t->slots));
+    if (count > 0) {
+        t->rules = calloc(count, sizeof(*t->rules));
+        check_mem(t->rules);
+    }
+
+    for (p = conf; p != NULL; p = p->next) {
+        if (strcasecmp(p->name, "rates") != 0)
+            continue;
+        for (token = p->tokens; token != NULL; token = token->next) {
+            /*
+             * ".edu.au" is taken as "edu.au".
+             */
+            for (name = token->token; *name == '.'; name++);
+            r = &t->rules[t->num_rules];
+            r->length = strlen(name);
+            if (r->length == 0 || token->value == NULL)
+                continue;
+            r->hash = hash_name(name, r->length);
+            if (lookup(t, name, r->length, r->hash) != NULL)
+                continue;
+
+            r->domain = strdup(name);
+            check_mem(r->domain);
+            for (i = 0; i < r->length; i++)
+                r->domain[i] = tolower((unsigned char) r->domain[i]);
+            r->rate = atoi(token->value);
+
+            for (i = r->hash & t->mask; t->slots[i] != -1;
+                 i = (i + 1) & t->mask);
+            t->slots[i] = t->num_rules++;
+        }
+    }
+
+    for (p = conf; p != NULL; p = p->next) {
+        if (strcasecmp(p->name, "bursts") != 0)
+            continue;
+        for (token = p->tokens; token != NULL; token = token->next) {
+            for (name = token->token; *name == '.'; name++);
+            r = lookup(t, name, strlen(name),
+                       hash_name(name, strlen(name)));
+            if (r != NULL && token->value != NULL)
+                r->burst = atoi(token->value);
+        }
+    }
+
+    return t;
+
+  error:
+    rate_table_free(t);
+    return NULL;
+}
+
+void
+rate_table_free(struct rate_table *t)
+{
+    int             i;
+
+    if (t == NULL)
+        return;
+    for (i = 0; i < t->num_rules; i++)
+        free(t->rules[i].domain);
+    free(t->rules);
+    free(t->slots);
+    free(t);
+}
+
+struct rate_rule *
+rate_table_match(const struct rate_table *t, const char *hostname)
+{
+    struct rate_rule *r,
+                   *best = NULL;
+    const char     *end,
+                   *p;
+    uint32_t        h = FNV_OFFSET;
+
+    if (t == NULL || t->num_rules == 0)
+        return NULL;
+
+    end = hostname + strlen(hostname);
+    for (p = end; p > hostname;) {
+        h = hash_step(h, *--p);
+        if (p != hostname && p[-1] != '.')
+            continue;
+
+        r = lookup(t, p, end - p, h);
+        if (r != NULL)
+            best = r;
+    }
+    return best;
+}
@@ -0,0 +1,76 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RATES_H_
+#define RATES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+struct bucket;
+
+/*
+ * An entry of [rates].
+ */
+struct rate_rule {
+    char           *domain;     /* Lower case */
+    size_t          length;
+    uint32_t        hash;
+    int             rate;       /* In kbytes/sec */
+    int             burst;      /* In kbytes, from [bursts], 0 if unset */
+    struct bucket  *bucket;     /* Set by the user of the table */
+};
+
+/*
+ * The [rates] of a configuration, compiled for lookups.
+ */
+struct rate_table {
+    struct rate_rule *rules;
+    int             num_rules;
+    int            *slots;      /* Indexes in `rules`, -1 if empty */
+    uint32_t        mask;
+};
+
+/*
+ * Compiles the [rates] and [bursts] sections of `conf`. A domain that is
+ * listed twice keeps its first rate.
+ * Returns the table, or NULL on failure.
+ */
+struct rate_table *rate_table_build(struct config_sect *conf);
+
+void            rate_table_free(struct rate_table *t);
+
+/*
+ * Finds the rule of the longest domain that `hostname` is, or is a
+ * subdomain of, in O(labels).
+ * Returns NULL if there is none.
+ */
+struct rate_rule *rate_table_match(const struct rate_table *t,
+                                   const char *hostname);
+
+#endif                          /* RATES_H_ */
@@ -0,0 +1,119 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * splice(2) based relay of the response.
+ *
+ * Apart from the "100 Continue" check, the proxy never looks at the response.
+ * Instead of recv(2)ing it into a buffer and send(2)ing it back out, the data
+ * is moved socket -> pipe -> socket inside the kernel.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "relay.h"
+#include "utils.h"
+
+void
+relay_pipe_init(struct relay_pipe *rp)
+{
+    rp->fd[0] = -1;
+    rp->fd[1] = -1;
+    rp->pending = 0;
+}
+
+/*
+ * The pipe never blocks; whether the sockets do is up to their owner.
+ * Returns 0 on success, -1 if the pipe cannot be created, in which case the
+ * caller falls back to copying through its buffer.
+ */
+int
+relay_pipe_open(struct relay_pipe *rp)
+{
+    if (pipe2(rp->fd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        relay_pipe_init(rp);
+        return -1;
+    }
+    rp->pending = 0;
+    return 0;
+}
+
+void
+relay_pipe_close(struct relay_pipe *rp)
+{
+    CLOSEFD(rp->fd[0]);
+    CLOSEFD(rp->fd[1]);
+    relay_pipe_init(rp);
+}
+
+ssize_t
+relay_in(struct relay_pipe *rp, int from, size_t len)
+{
+    ssize_t         n;
+
+    n = splice(from, NULL, rp->fd[1], NULL, len,
+               SPLICE_F_MOVE);
+    if (n > 0)
+        rp->pending += n;
+    return n;
+}
+
+ssize_t
+relay_out(struct relay_pipe *rp, int to)
+{
+    ssize_t         n;
+
+    n = splice(rp->fd[0], NULL, to, NULL, rp->pending,
+               SPLICE_F_MOVE);
+    if (n > 0)
+        rp->pending -= n;
+    return n;
+}
+
+int
+relay_peek_continue(int sfd)
+{
+    char            buffer[sizeof(HTTP_CONTINUE_MESSAGE)];
+    ssize_t         n;
+
+    n = recv(sfd, buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT);
+    if (n <= 0)
+        return -1;
+
+    return n == (ssize_t) HTTP_CONTINUE_MESSAGE_LENGTH &&
+        strncasecmp(buffer, HTTP_CONTINUE_MESSAGE,
+                    HTTP_CONTINUE_MESSAGE_LENGTH) == 0;
+}
@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RELAY_H_
+#define RELAY_H_
+
+#include <sys/types.h>
+
+/*
+ * A pipe that response data is spliced through on its way from the server
+ * to the client, so that it is never copied to user space.
+ */
+struct relay_pipe {
+    int             fd[2];      /* -1 if not open */
+    size_t          pending;    /* Bytes in the pipe */
+};
+
+void            relay_pipe_init(struct relay_pipe *rp);
+int             relay_pipe_open(struct relay_pipe *rp);
+void            relay_pipe_close(struct relay_pipe *rp);
+
+/*
+ * Moves up to `len` bytes from the socket `from` into the pipe, or from the
+ * pipe to the socket `to`. Both follow the conventions of splice(2).
+ */
+ssize_t         relay_in(struct relay_pipe *rp, int from, size_t len);
+ssize_t         relay_out(struct relay_pipe *rp, int to);
+
+/*
+ * Returns 1 if the data waiting on `sfd` is exactly the "100 Continue"
+ * response, 0 if it is anything else, or -1 if there is none. The data is
+ * not consumed.
+ */
+int             relay_peek_continue(int sfd);
+
+#endif                          /* RELAY_H_ */
@@ -0,0 +1,578 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Resolver of hostnames, shared by all the processes.
+ *
+ * getaddrinfo(3) blocks, which stalls a whole event loop, and processes that
+ * miss the DNS cache on the same name would each send the same query. Names
+ * are thus resolved by a resolver process: a few threads call getaddrinfo(3)
+ * while the main thread talks to the other processes over a SOCK_SEQPACKET
+ * Unix socket, like the connection pool broker.
+ *
+ * Every query is a connection of its own, which the asking process can watch
+ * with epoll(7). A name that is already being resolved is not queried again:
+ * the new connection waits for the query in flight (single-flight). Failures
+ * are remembered for `negative_ttl` seconds.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "http.h"
+#include "resolver.h"
+#include "utils.h"
+#include "webproxy.h"
+
+/*
+ * How long a process waits for an answer in resolve(), in milliseconds.
+ */
+#define RESOLVER_TIMEOUT 10000
+
+/*
+ * Distinct names being resolved at once, and failures remembered.
+ */
+#define MAX_FLIGHTS   256
+#define MAX_NEGATIVES 256
+
+#define TAG_LISTENER -1
+#define TAG_DONE     -2
+
+struct resolver_query {
+    char            name[HOSTNAME_LENGTH];
+};
+
+/*
+ * A name being resolved, and the connections waiting for it.
+ */
+struct flight {
+    int             used;
+    char            name[HOSTNAME_LENGTH];
+    struct resolver_answer answer;
+    int            *waiters;
+    int             num_waiters;
+    int             max_waiters;
+    struct flight  *next;       /* On the queue or the done list */
+};
+
+struct negative {
+    char            name[HOSTNAME_LENGTH];
+    int             error;
+    time_t          until;
+};
+
+/*
+ * Address of the resolver; `resolver_addr_len` is 0 if there is none.
+ */
+static struct sockaddr_un resolver_addr;
+static socklen_t resolver_addr_len = 0;
+
+static void
+set_port(struct resolver_answer *answer, const char *port)
+{
+    in_port_t       p;
+    int             i;
+
+    p = htons((in_port_t) strtol(port, (char **) NULL, 10));
+    for (i = 0; i < answer->count; i++) {
+        if (answer->addr[i].family == AF_INET)
+            ((struct sockaddr_in *) &answer->addr[i].addr)->sin_port = p;
+        else if (answer->addr[i].family == AF_INET6)
+            ((struct sockaddr_in6 *) &answer->addr[i].addr)->sin6_port = p;
+    }
+}
+
+static void
+lookup(const char *name, struct resolver_answer *answer)
+{
+    struct addrinfo hints,
+                   *ai = NULL,
+                   *p;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    answer->count = 0;
+    answer->error = getaddrinfo(name, NULL, &hints, &ai);
+    if (answer->error != 0)
+        return;
+
+    for (p = ai; p != NULL && answer->count < RESOLVER_MAX_ADDRS;
+         p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(answer->addr[0].addr))
+            continue;
+        answer->addr[answer->count].family = p->ai_family;
+        answer->addr[answer->count].len = p->ai_addrlen;
+        memcpy(&answer->addr[answer->count].addr, p->ai_addr, p->ai_addrlen);
+        answer->count++;
+    }
+    freeaddrinfo(ai);
+
+    if (answer->count == 0)
+        answer->error = EAI_NONAME;
+}
+
+int
+resolver_enabled(void)
+{
+    return resolver_addr_len != 0;
+}
+
+int
+resolver_submit(const char *name)
+{
+    struct resolver_query query;
+    int             fd;
+
+    if (resolver_addr_len == 0 || strlen(name) >= sizeof(query.name))
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    memset(&query, 0, sizeof(query));
+    strcpy(query.name, name);
+
+    if (connect(fd, (struct sockaddr *) &resolver_addr, resolver_addr_len)
+        == -1
+        || send(fd, &query, sizeof(query), MSG_NOSIGNAL) != sizeof(query)) {
+        log_warn("Cannot reach the resolver");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int
+resolver_read(int fd, const char *port, struct resolver_answer *answer)
+{
+    ssize_t         n;
+
+    do {
+        n = recv(fd, answer, sizeof(*answer), 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return -1;
+
+    if (n != sizeof(*answer) || answer->count < 0
+        || answer->count > RESOLVER_MAX_ADDRS) {
+        answer->error = EAI_SYSTEM;
+        answer->count = 0;
+        return 0;
+    }
+
+    set_port(answer, port);
+    return 0;
+}
+
+int
+resolve(const char *name, const char *port, struct resolver_answer *answer)
+{
+    struct pollfd   pfd;
+    int             fd;
+
+    fd = resolver_submit(name);
+    if (fd == -1) {
+        lookup(name, answer);
+        set_port(answer, port);
+        return answer->error == 0 ? 0 : -1;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, RESOLVER_TIMEOUT) == -1 && errno == EINTR);
+
+    if (resolver_read(fd, port, answer) == -1) {
+        answer->error = EAI_AGAIN;
+        answer->count = 0;
+    }
+    close(fd);
+
+    return answer->error == 0 ? 0 : -1;
+}
+
+/*
+ * The resolver
+ */
+
+static struct flight flights[MAX_FLIGHTS];
+static struct negative negatives[MAX_NEGATIVES];
+
+/*
+ * Shared with the threads.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static struct flight *queue_head = NULL;
+static struct flight *queue_tail = NULL;
+static struct flight *done = NULL;
+static int      done_fd = -1;   /* eventfd(2) signalled with `done` */
+
+static void    *
+resolve_thread(void *arg)
+{
+    struct flight  *f;
+    uint64_t        one = 1;
+
+    (void) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (queue_head == NULL)
+            pthread_cond_wait(&queued, &lock);
+        f = queue_head;
+        queue_head = f->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        lookup(f->name, &f->answer);
+
+        pthread_mutex_lock(&lock);
+        f->next = done;
+        done = f;
+        pthread_mutex_unlock(&lock);
+
+        if (write(done_fd, &one, sizeof(one)) == -1)
+            log_warn("Cannot wake up the resolver");
+    }
+
+    return NULL;
+}
+
+static void
+reply(int client, const struct resolver_answer *answer)
+{
+    send(client, answer, sizeof(*answer), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(client);
+}
+
+static struct negative *
+find_negative(const char *name)
+{
+    time_t          now = time(NULL);
+    int             i;
+
+    for (i = 0; i < MAX_NEGATIVES; i++) {
+        if (negatives[i].until > now
+            && strcasecmp(negatives[i].name, name) == 0)
+            return &negatives[i];
+    }
+    return NULL;
+}
+
+static void
+add_negative(const char *name, const int error, const int ttl)
+{
+    struct negative *e = &negatives[0];
+    int             i;
+
+    /*
+     * Local failures say nothing about the name.
+     */
+    if (ttl <= 0 || error == EAI_SYSTEM || error == EAI_MEMORY)
+        return;
+
+    for (i = 0; i < MAX_NEGATIVES; i++) {
+        if (negatives[i].until < e->until)
+            e = &negatives[i];
+    }
+
+    strcpy(e->name, name);
+    e->error = error;
+    e->until = time(NULL) + ttl;
+}
+
+static int
+add_waiter(struct flight *f, int client)
+{
+    int            *w;
+
+    if (f->num_waiters == f->max_waiters) {
+        w = realloc(f->waiters, (f->max_waiters * 2 + 4) * sizeof(*w));
+        if (w == NULL)
+            return -1;
+        f->waiters = w;
+        f->max_waiters = f->max_waiters * 2 + 4;
+    }
+    f->waiters[f->num_waiters++] = client;
+    return 0;
+}
+
+static void
+handle_query(int epfd, int client)
+{
+    struct resolver_query query;
+    struct resolver_answer answer;
+    struct negative *neg;
+    struct flight  *f = NULL;
+    ssize_t         n;
+    int             i;
+
+    n = recv(client, &query, sizeof(query), 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    /*
+     * A connection carries one query, and is only written to from now on.
+     */
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client, NULL);
+
+    memset(&answer, 0, sizeof(answer));
+    if (n != sizeof(query) || memchr(query.name, '\0', sizeof(query.name))
+        == NULL) {
+        close(client);
+        return;
+    }
+
+    neg = find_negative(query.name);
+    if (neg != NULL) {
+        answer.error = neg->error;
+        reply(client, &answer);
+        return;
+    }
+
+    for (i = 0; i < MAX_FLIGHTS; i++) {
+        if (flights[i].used && strcasecmp(flights[i].name, query.name) == 0) {
+            if (add_waiter(&flights[i], client) == -1)
+                break;
+            return;
+        }
+        if (!flights[i].used && f == NULL)
+            f = &flights[i];
+    }
+
+    if (i < MAX_FLIGHTS || f == NULL) {
+        answer.error = EAI_AGAIN;
+        reply(client, &answer);
+        return;
+    }
+
+    f->num_waiters = 0;
+    if (add_waiter(f, client) == -1) {
+        answer.error = EAI_MEMORY;
+        reply(client, &answer);
+        return;
+    }
+    f->used = 1;
+    strcpy(f->name, query.name);
+
+    pthread_mutex_lock(&lock);
+    f->next = NULL;
+    if (queue_tail != NULL)
+        queue_tail->next = f;
+    else
+        queue_head = f;
+    queue_tail = f;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+}
+
+static void
+handle_done(const int negative_ttl)
+{
+    struct flight  *f,
+                   *next;
+    uint64_t        count;
+    int             i;
+
+    if (read(done_fd, &count, sizeof(count)) == -1)
+        return;
+
+    pthread_mutex_lock(&lock);
+    f = done;
+    done = NULL;
+    pthread_mutex_unlock(&lock);
+
+    for (; f != NULL; f = next) {
+        next = f->next;
+
+        if (f->answer.error != 0) {
+            log_info("Cannot resolve %s: %s", f->name,
+                     gai_strerror(f->answer.error));
+            add_negative(f->name, f->answer.error, negative_ttl);
+        }
+
+        for (i = 0; i < f->num_waiters; i++)
+            reply(f->waiters[i], &f->answer);
+        f->num_waiters = 0;
+        f->used = 0;
+    }
+}
+
+static void
+accept_queries(int epfd, int lfd)
+{
+    struct epoll_event ev;
+    int             client;
+
+    for (;;) {
+        client = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client == -1)
+            return;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = client;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) == -1)
+            close(client);
+    }
+}
+
+static void
+run_resolver(int lfd, const int threads, const int negative_ttl)
+{
+    struct epoll_event events[64];
+    struct epoll_event ev;
+    pthread_t       tid;
+    int             epfd,
+                    n,
+                    i;
+
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    check(done_fd != -1, "Cannot create the eventfd of the resolver");
+
+    for (i = 0; i < threads; i++)
+        check(pthread_create(&tid, NULL, resolve_thread, NULL) == 0,
+              "Cannot create a resolver thread");
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    check(epfd != -1, "Cannot create the epoll instance");
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = TAG_LISTENER;
+    check(epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == 0,
+          "Cannot watch the resolver socket");
+    ev.data.fd = TAG_DONE;
+    check(epoll_ctl(epfd, EPOLL_CTL_ADD, done_fd, &ev) == 0,
+          "Cannot watch the eventfd of the resolver");
+
+    for (;;) {
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]),
+                       -1);
+        if (n == -1 && errno != EINTR)
+            break;
+
+        for (i = 0; i < n; i++) {
+            switch (events[i].data.fd) {
+            case TAG_LISTENER:
+                accept_queries(epfd, lfd);
+                break;
+            case TAG_DONE:
+                handle_done(negative_ttl);
+                break;
+            default:
+                handle_query(epfd, events[i].data.fd);
+                break;
+            }
+        }
+    }
+
+  error:
+    return;
+}
+
+pid_t
+resolver_start(const int threads, const int negative_ttl)
+{
+    int             lfd;
+    pid_t           pid = -1;
+
+    if (threads <= 0)
+        return 0;
+
+    /*
+     * An abstract address, which goes away with the resolver.
+     */
+    memset(&resolver_addr, 0, sizeof(resolver_addr));
+    resolver_addr.sun_family = AF_UNIX;
+    snprintf(resolver_addr.sun_path + 1, sizeof(resolver_addr.sun_path) - 1,
+             "webproxy-resolver.%ld", (long) getpid());
+    resolver_addr_len = offsetof(struct sockaddr_un, sun_path) + 1
+        + strlen(resolver_addr.sun_path + 1);
+
+    lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    check(lfd != -1, "Cannot create the resolver socket");
+    check(bind(lfd, (struct sockaddr *) &resolver_addr, resolver_addr_len)
+          == 0, "Cannot bind the resolver socket");
+    check(listen(lfd, SOMAXCONN) == 0,
+          "Cannot listen on the resolver socket");
+
+    pid = fork();
+    switch (pid) {
+    case 0:
+        signal(SIGINT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_IGN);
+
+        run_resolver(lfd, threads, negative_ttl);
+        _exit(EXIT_FAILURE);
+    case -1:
+        log_err("Cannot fork()");
+        goto error;
+    default:
+        break;
+    }
+
+    close(lfd);
+    return pid;
+
+  error:
+    if (pid == 0)
+        _exit(EXIT_FAILURE);
+    CLOSEFD(lfd);
+    resolver_addr_len = 0;
+    return -1;
+}
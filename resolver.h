@@ -0,0 +1,93 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Default settings of the resolver process.
+ */
+#define RESOLVER_DEFAULT_THREADS      4       /* Concurrent queries */
+#define RESOLVER_DEFAULT_NEGATIVE_TTL 10      /* Seconds a failure is kept */
+
+/*
+ * At most that many addresses of a name are returned.
+ */
+#define RESOLVER_MAX_ADDRS 8
+
+struct resolver_addr {
+    int             family;
+    socklen_t       len;
+    struct sockaddr_storage addr;
+};
+
+struct resolver_answer {
+    int             error;      /* 0, or the EAI_* code of getaddrinfo(3) */
+    int             count;
+    struct resolver_addr addr[RESOLVER_MAX_ADDRS];
+};
+
+/*
+ * Forks the resolver process with `threads` threads. It must be called before
+ * the processes that use it are forked.
+ * Returns the pid of the resolver, 0 if `threads` is 0 (names are then
+ * resolved inline), or -1 on failure.
+ */
+pid_t           resolver_start(const int threads, const int negative_ttl);
+
+/*
+ * Returns 1 if names go to the resolver process, 0 if they are resolved
+ * inline.
+ */
+int             resolver_enabled(void);
+
+/*
+ * Asks the resolver for the addresses of `name`.
+ * Returns a non-blocking socket that becomes readable once the answer is
+ * ready, or -1 if there is no resolver.
+ */
+int             resolver_submit(const char *name);
+
+/*
+ * Reads the answer from `fd`, as returned by resolver_submit(), and sets
+ * `port` as the port of the addresses. The caller closes `fd`.
+ * Returns -1 if the answer has not arrived yet, 0 otherwise.
+ */
+int             resolver_read(int fd, const char *port,
+                              struct resolver_answer *answer);
+
+/*
+ * Resolves `name` and waits for the answer, through the resolver if there is
+ * one.
+ * Returns 0 on success, -1 on failure (see answer->error).
+ */
+int             resolve(const char *name, const char *port,
+                        struct resolver_answer *answer);
+
+#endif                          /* RESOLVER_H_ */
@@ -0,0 +1,220 @@
+/*
+ * Tests the resolver process: concurrent lookups of a name share one query,
+ * failures are remembered for negative_ttl seconds, and the names of
+ * /etc/hosts resolve to their addresses.
+ *
+ * Usage: resolvertest
+ * getaddrinfo(3) is wrapped to count the queries the resolver makes, and
+ * fails the names under ".invalid" itself, so that nothing goes to the
+ * network.
+ */
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <dlfcn.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "resolver.h"
+#include "utils.h"
+
+#define THREADS      4
+#define NEGATIVE_TTL 2          /* Seconds */
+#define CONCURRENT   8          /* Lookups of the same name at once */
+#define QUERY_DELAY  200000     /* Microseconds a query takes */
+
+int             debug_level = 0;
+
+/*
+ * Queries made by the resolver, which is a child of this process.
+ */
+static int     *queries;
+
+static int      failures = 0;
+
+int
+getaddrinfo(const char *node, const char *service,
+            const struct addrinfo *hints, struct addrinfo **res)
+{
+    int             (*real) (const char *, const char *,
+                             const struct addrinfo *, struct addrinfo **);
+
+    __sync_fetch_and_add(queries, 1);
+
+    /*
+     * Long enough for the other lookups to arrive meanwhile.
+     */
+    usleep(QUERY_DELAY);
+
+    if (endswith(node, ".invalid", 1) == TRUE)
+        return EAI_NONAME;
+
+    real = dlsym(RTLD_NEXT, "getaddrinfo");
+    if (real == NULL)
+        return EAI_SYSTEM;
+    return real(node, service, hints, res);
+}
+
+static void
+expect(const int ok, const char *what)
+{
+    printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+/*
+ * Looks up `name` CONCURRENT times at once.
+ * Returns how many of the lookups succeeded.
+ */
+static int
+resolve_concurrently(const char *name)
+{
+    struct resolver_answer answer;
+    struct pollfd   pfd[CONCURRENT];
+    int             ok = 0,
+                    i;
+
+    for (i = 0; i < CONCURRENT; i++) {
+        pfd[i].fd = resolver_submit(name);
+        pfd[i].events = POLLIN;
+        if (pfd[i].fd == -1)
+            return 0;
+    }
+
+    for (i = 0; i < CONCURRENT; i++) {
+        poll(&pfd[i], 1, 5000);
+        if (resolver_read(pfd[i].fd, "80", &answer) == 0
+            && answer.error == 0 && answer.count > 0)
+            ok++;
+        close(pfd[i].fd);
+    }
+
+    return ok;
+}
+
+/*
+ * Reads the first name of /etc/hosts with an IPv4 address into `name`, and
+ * the address into `addr`.
+ * Returns -1 if there is none.
+ */
+static int
+hosts_entry(char *name, const size_t size, struct in_addr *addr)
+{
+    FILE           *fp;
+    char            line[512],
+                    ip[64],
+                    host[256];
+    int             found = -1;
+
+    fp = fopen("/etc/hosts", "r");
+    if (fp == NULL)
+        return -1;
+
+    while (found == -1 && fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%63s %255s", ip, host) != 2 || ip[0] == '#'
+            || host[0] == '#' || strlen(host) >= size)
+            continue;
+        if (inet_pton(AF_INET, ip, addr) == 1) {
+            strcpy(name, host);
+            found = 0;
+        }
+    }
+    fclose(fp);
+
+    return found;
+}
+
+/*
+ * Returns 1 if `answer` has `addr`, with port `port`.
+ */
+static int
+has_address(const struct resolver_answer *answer, const struct in_addr *addr,
+            const int port)
+{
+    const struct sockaddr_in *sin;
+    int             i;
+
+    for (i = 0; i < answer->count; i++) {
+        if (answer->addr[i].family != AF_INET)
+            continue;
+        sin = (const struct sockaddr_in *) &answer->addr[i].addr;
+        if (sin->sin_addr.s_addr == addr->s_addr
+            && ntohs(sin->sin_port) == port)
+            return 1;
+    }
+    return 0;
+}
+
+int
+main(void)
+{
+    struct resolver_answer answer;
+    struct in_addr  addr;
+    char            name[HOSTNAME_LENGTH];
+    pid_t           pid;
+    int             before;
+
+    queries = mmap(NULL, sizeof(*queries), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (queries == MAP_FAILED)
+        return EXIT_FAILURE;
+
+    pid = resolver_start(THREADS, NEGATIVE_TTL);
+    if (pid <= 0) {
+        fprintf(stderr, "Cannot start the resolver\n");
+        return EXIT_FAILURE;
+    }
+
+    if (hosts_entry(name, sizeof(name), &addr) == -1) {
+        fprintf(stderr, "No IPv4 entry in /etc/hosts\n");
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * Single flight.
+     */
+    before = *queries;
+    expect(resolve_concurrently(name) == CONCURRENT,
+           "concurrent lookups are all answered");
+    expect(*queries - before == 1, "concurrent lookups make one query");
+
+    /*
+     * /etc/hosts.
+     */
+    expect(resolve(name, "8080", &answer) == 0
+           && has_address(&answer, &addr, 8080),
+           "a name of /etc/hosts resolves to its address");
+
+    /*
+     * Negative caching.
+     */
+    before = *queries;
+    expect(resolve("nothing.invalid", "80", &answer) == -1
+           && answer.error == EAI_NONAME, "a failed lookup fails");
+    expect(resolve("nothing.invalid", "80", &answer) == -1
+           && *queries - before == 1, "the failure is remembered");
+    sleep(NEGATIVE_TTL + 1);
+    expect(resolve("nothing.invalid", "80", &answer) == -1
+           && *queries - before == 2,
+           "the failure is forgotten after negative_ttl");
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,302 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Vectorised scanning of HTTP headers.
+ *
+ * Parsing a header is mostly looking for a few delimiters: SP between the
+ * parts of the Request-Line, ':' after a field name and CR/LF at the end of a
+ * line. scan_find3() compares 16 (SSE2) or 32 (AVX2) bytes against up to three
+ * delimiters at once, and falls back to a plain loop for the tail and for
+ * other CPUs. The implementation is picked at run time, so the binary does
+ * not need to be built with -mavx2.
+ */
+
+#include <sys/types.h>
+
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef size_t  (*find3_fn) (const char *s, size_t n, char a, char b,
+                             char c);
+
+static size_t
+find3_scalar(const char *s, size_t n, char a, char b, char c)
+{
+    size_t          i;
+
+    for (i = 0; i < n; i++) {
+        if (s[i] == a || s[i] == b || s[i] == c)
+            return i;
+    }
+    return n;
+}
+
+#ifdef SCAN_X86
+__attribute__ ((target("sse2")))
+static size_t
+find3_sse2(const char *s, size_t n, char a, char b, char c)
+{
+    __m128i         va = _mm_set1_epi8(a);
+    __m128i         vb = _mm_set1_epi8(b);
+    __m128i         vc = _mm_set1_epi8(c);
+    __m128i         v,
+                    m;
+    int             mask;
+    size_t          i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (s + i));
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                      _mm_cmpeq_epi8(v, vb)),
+                         _mm_cmpeq_epi8(v, vc));
+        mask = _mm_movemask_epi8(m);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + find3_scalar(s + i, n - i, a, b, c);
+}
+
+__attribute__ ((target("avx2")))
+static size_t
+find3_avx2(const char *s, size_t n, char a, char b, char c)
+{
+    __m256i         va = _mm256_set1_epi8(a);
+    __m256i         vb = _mm256_set1_epi8(b);
+    __m256i         vc = _mm256_set1_epi8(c);
+    __m256i         v,
+                    m;
+    unsigned int    mask;
+    size_t          i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (s + i));
+        m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                            _mm256_cmpeq_epi8(v, vb)),
+                            _mm256_cmpeq_epi8(v, vc));
+        mask = (unsigned int) _mm256_movemask_epi8(m);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + find3_sse2(s + i, n - i, a, b, c);
+}
+#endif
+
+static const struct {
+    const char     *name;
+    find3_fn        fn;
+} impls[] = {
+#ifdef SCAN_X86
+    {"avx2", find3_avx2},
+    {"sse2", find3_sse2},
+#endif
+    {"scalar", find3_scalar},
+};
+
+#define NUM_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static find3_fn find3 = NULL;
+static const char *find3_name = NULL;
+
+static int
+supported(const char *name)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+int
+scan_use(const char *name)
+{
+    size_t          i;
+
+    for (i = 0; i < NUM_IMPLS; i++) {
+        if (strcmp(impls[i].name, name) == 0 && supported(name)) {
+            find3 = impls[i].fn;
+            find3_name = impls[i].name;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Picks the first (best) implementation the CPU supports.
+ */
+static void
+scan_init(void)
+{
+    size_t          i;
+
+    for (i = 0; i < NUM_IMPLS; i++) {
+        if (scan_use(impls[i].name) == 0)
+            return;
+    }
+}
+
+const char     *
+scan_name(void)
+{
+    if (find3 == NULL)
+        scan_init();
+    return find3_name;
+}
+
+size_t
+scan_find3(const char *s, size_t n, char a, char b, char c)
+{
+    if (find3 == NULL)
+        scan_init();
+    return find3(s, n, a, b, c);
+}
+
+/*
+ * Returns the length of the line ending at `eol` (CRLF or a bare LF), 0 if
+ * the end of the buffer is reached first.
+ */
+static size_t
+eol_length(const char *eol, const char *end)
+{
+    if (*eol == '\n')
+        return 1;
+    if (eol + 1 == end)
+        return 0;
+    return eol[1] == '\n' ? 2 : 1;
+}
+
+static void
+set_span(struct scan_span *span, const char *buffer, const char *start,
+         const char *end)
+{
+    span->offset = start - buffer;
+    span->length = end - start;
+}
+
+ssize_t
+http_tokenize(const char *buffer, size_t n, struct http_tokens *tokens)
+{
+    const char     *p = buffer;
+    const char     *end = buffer + n;
+    const char     *q,
+                   *v,
+                   *ve;
+    size_t          eol;
+
+    if (find3 == NULL)
+        scan_init();
+
+    tokens->num_headers = 0;
+
+    /*
+     * Request-Line = Method SP Request-URI SP HTTP-Version CRLF
+     */
+    q = p + find3(p, end - p, ' ', '\r', '\n');
+    if (q == end)
+        return 0;
+    if (*q != ' ' || q == p)
+        return -1;
+    set_span(&tokens->method, buffer, p, q);
+
+    p = q + 1;
+    q = p + find3(p, end - p, ' ', '\r', '\n');
+    if (q == end)
+        return 0;
+    if (*q != ' ' || q == p)
+        return -1;
+    set_span(&tokens->uri, buffer, p, q);
+
+    p = q + 1;
+    q = p + find3(p, end - p, '\r', '\n', '\n');
+    if (q == end || (eol = eol_length(q, end)) == 0)
+        return 0;
+    set_span(&tokens->version, buffer, p, q);
+    p = q + eol;
+
+    for (;;) {
+        if (p == end)
+            return 0;
+
+        /*
+         * The empty line
+         */
+        if (*p == '\r' || *p == '\n') {
+            if ((eol = eol_length(p, end)) == 0)
+                return 0;
+            return p + eol - buffer;
+        }
+
+        q = p + find3(p, end - p, ':', '\r', '\n');
+        if (q == end)
+            return 0;
+
+        /*
+         * A continuation line (obs-fold) or a line without a colon.
+         */
+        if (*q != ':' || *p == ' ' || *p == '\t') {
+            q += find3(q, end - q, '\r', '\n', '\n');
+            if (q == end || (eol = eol_length(q, end)) == 0)
+                return 0;
+            if (*p != ' ' && *p != '\t')
+                return -1;
+            p = q + eol;
+            continue;
+        }
+
+        /*
+         * field-value may be preceded and followed by LWS.
+         */
+        for (v = q + 1; v < end && (*v == ' ' || *v == '\t'); v++);
+        ve = v + find3(v, end - v, '\r', '\n', '\n');
+        if (ve == end || (eol = eol_length(ve, end)) == 0)
+            return 0;
+
+        if (tokens->num_headers < SCAN_MAX_HEADERS) {
+            struct scan_field *f = &tokens->headers[tokens->num_headers];
+            const char     *vt = ve;
+
+            while (vt > v && (vt[-1] == ' ' || vt[-1] == '\t'))
+                vt--;
+            set_span(&f->name, buffer, p, q);
+            set_span(&f->value, buffer, v, vt);
+        }
+        tokens->num_headers++;
+
+        p = ve + eol;
+    }
+}
@@ -0,0 +1,84 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <sys/types.h>
+
+/*
+ * The most header fields http_tokenize() records. The rest are still
+ * scanned, and counted in `num_headers`.
+ */
+#define SCAN_MAX_HEADERS 100
+
+/*
+ * A part of the header, as an offset from the start of the buffer.
+ */
+struct scan_span {
+    unsigned int    offset;
+    unsigned int    length;
+};
+
+struct scan_field {
+    struct scan_span name;
+    struct scan_span value;     /* Without the surrounding LWS */
+};
+
+struct http_tokens {
+    struct scan_span method;
+    struct scan_span uri;
+    struct scan_span version;
+    int             num_headers;
+    struct scan_field headers[SCAN_MAX_HEADERS];
+};
+
+/*
+ * Selects an implementation, "avx2", "sse2" or "scalar". By default, the best
+ * one the CPU supports is selected on first use.
+ * Returns 0 on success, -1 if the CPU does not support it.
+ */
+int             scan_use(const char *name);
+const char     *scan_name(void);
+
+/*
+ * Returns the offset of the first byte in `s` that is `a`, `b` or `c`, or
+ * `n` if there is none.
+ */
+size_t          scan_find3(const char *s, size_t n, char a, char b, char c);
+
+#define scan_find(S, N, C) scan_find3((S), (N), (C), (C), (C))
+
+/*
+ * Splits the request header in `buffer` into the Request-Line and the header
+ * fields.
+ * Returns the length of the header (including the empty line), 0 if it is
+ * incomplete, or -1 if it is malformed.
+ */
+ssize_t         http_tokenize(const char *buffer, size_t n,
+                              struct http_tokens *tokens);
+
+#endif                          /* SCAN_H_ */
@@ -0,0 +1,418 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The TLS sessions of the fork engine. Every connection is accepted by a
+ * child of its own, so a session OpenSSL caches in the child dies with it.
+ * The sessions are kept in shared memory instead, through the external
+ * session cache callbacks, and the keys of the session tickets are shared
+ * too, so that a client resumes its session whichever child takes it.
+ *
+ * A session is found in a few slots picked by a hash of its id; a new one
+ * takes the slot that expires first. A ticket is encrypted with the current
+ * key and still accepted, and renewed, under the one before, so that it
+ * lives its whole lifetime across a rotation.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>           /* Defines mode constants */
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>              /* Defines O_* constants */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include "dbg.h"
+#include "session.h"
+#include "utils.h"
+#include "webproxy.h"
+
+#define SHM_NAME "websession_shm"
+
+#define SESSION_MAX_LENGTH      2048    /* Of an encoded session */
+#define SESSION_WAYS            4       /* Slots a session may take */
+
+/*
+ * OpenSSL 1.1.0 made the id given to the lookup callback const.
+ */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define SESSION_ID_CONST
+#else
+#define SESSION_ID_CONST const
+#endif
+
+struct entry {
+    time_t          expires;    /* 0 if free */
+    unsigned int    id_length;
+    unsigned char   id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    int             length;
+    unsigned char   data[SESSION_MAX_LENGTH];
+};
+
+struct ticket_key {
+    unsigned char   name[16];
+    unsigned char   aes[32];
+    unsigned char   hmac[32];
+    time_t          created;    /* 0 if there is none */
+};
+
+struct store {
+    pthread_mutex_t lock;
+    int             lifetime;
+    int             num_entries;
+    struct ticket_key keys[2];  /* The current one and the one before */
+    struct entry    entries[];
+};
+
+static struct store *store = NULL;
+static size_t   store_size;
+
+static void
+session_lock(void)
+{
+    if (pthread_mutex_lock(&store->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&store->lock);
+}
+
+static void
+session_unlock(void)
+{
+    pthread_mutex_unlock(&store->lock);
+}
+
+/*
+ * FNV-1a of the session id.
+ */
+static uint32_t
+hash(const unsigned char *id, const unsigned int length)
+{
+    uint32_t        h = 2166136261u;
+    unsigned int    i;
+
+    for (i = 0; i < length; i++)
+        h = (h ^ id[i]) * 16777619u;
+
+    return h;
+}
+
+/*
+ * Returns the slot that holds the session `id`, or NULL. The lock must be
+ * held.
+ */
+static struct entry *
+find(const unsigned char *id, const unsigned int length, const time_t now)
+{
+    struct entry   *e;
+    uint32_t        first;
+    int             i;
+
+    first = hash(id, length);
+    for (i = 0; i < SESSION_WAYS; i++) {
+        e = &store->entries[(first + i) % store->num_entries];
+        if (e->expires > now && e->id_length == length
+            && memcmp(e->id, id, length) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static int
+new_session(SSL *ssl, SSL_SESSION *sess)
+{
+    unsigned char   buf[SESSION_MAX_LENGTH],
+                   *p = buf;
+    const unsigned char *id;
+    unsigned int    id_length;
+    struct entry   *e,
+                   *victim;
+    uint32_t        first;
+    time_t          now;
+    int             length,
+                    i;
+
+    (void) ssl;
+    length = i2d_SSL_SESSION(sess, NULL);
+    if (length <= 0 || length > SESSION_MAX_LENGTH)
+        return 0;
+    i2d_SSL_SESSION(sess, &p);
+    id = SSL_SESSION_get_id(sess, &id_length);
+    now = time(NULL);
+
+    session_lock();
+    victim = find(id, id_length, now);
+    if (victim == NULL) {
+        first = hash(id, id_length);
+        for (i = 0; i < SESSION_WAYS; i++) {
+            e = &store->entries[(first + i) % store->num_entries];
+            if (victim == NULL || e->expires < victim->expires)
+                victim = e;
+        }
+    }
+    victim->expires = SSL_SESSION_get_time(sess)
+        + SSL_SESSION_get_timeout(sess);
+    victim->id_length = id_length;
+    memcpy(victim->id, id, id_length);
+    victim->length = length;
+    memcpy(victim->data, buf, length);
+    session_unlock();
+
+    /*
+     * The session is not held on to.
+     */
+    return 0;
+}
+
+static SSL_SESSION *
+get_session(SSL *ssl, SESSION_ID_CONST unsigned char *id, int id_length,
+            int *copy)
+{
+    unsigned char   buf[SESSION_MAX_LENGTH];
+    const unsigned char *p = buf;
+    struct entry   *e;
+    int             length = 0;
+
+    (void) ssl;
+    *copy = 0;
+    if (id_length <= 0 || id_length > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+
+    session_lock();
+    e = find(id, id_length, time(NULL));
+    if (e != NULL) {
+        length = e->length;
+        memcpy(buf, e->data, length);
+    }
+    session_unlock();
+
+    if (length == 0)
+        return NULL;
+    return d2i_SSL_SESSION(NULL, &p, length);
+}
+
+static void
+remove_session(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    const unsigned char *id;
+    unsigned int    id_length;
+    struct entry   *e;
+
+    (void) ctx;
+    id = SSL_SESSION_get_id(sess, &id_length);
+
+    session_lock();
+    e = find(id, id_length, time(NULL));
+    if (e != NULL)
+        e->expires = 0;
+    session_unlock();
+}
+
+static int
+new_key(struct ticket_key *key)
+{
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1
+        || RAND_bytes(key->aes, sizeof(key->aes)) != 1
+        || RAND_bytes(key->hmac, sizeof(key->hmac)) != 1)
+        return -1;
+    key->created = time(NULL);
+    return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_hmac_ctx;
+
+static int
+ticket_hmac(EVP_MAC_CTX *hctx, unsigned char *key)
+{
+    OSSL_PARAM      params[3];
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key,
+                                                  32);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 "sha256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+typedef HMAC_CTX ticket_hmac_ctx;
+
+static int
+ticket_hmac(HMAC_CTX *hctx, unsigned char *key)
+{
+    return HMAC_Init_ex(hctx, key, 32, EVP_sha256(), NULL);
+}
+#endif
+
+/*
+ * Returns 1 if the ticket is to be encrypted, or has been decrypted, with
+ * the current key, 2 if it has been with the one before and is to be
+ * renewed, 0 if its key is gone, -1 on failure.
+ */
+static int
+ticket_key(SSL *ssl, unsigned char *name, unsigned char *iv,
+           EVP_CIPHER_CTX *cctx, ticket_hmac_ctx *hctx, int enc)
+{
+    struct ticket_key key;
+    int             k = 1;
+
+    (void) ssl;
+    session_lock();
+    if (enc || memcmp(name, store->keys[0].name, sizeof(key.name)) == 0) {
+        key = store->keys[0];
+    } else if (store->keys[1].created != 0
+               && memcmp(name, store->keys[1].name, sizeof(key.name)) == 0) {
+        key = store->keys[1];
+        k = 2;
+    } else {
+        k = 0;
+    }
+    session_unlock();
+
+    if (k == 0)
+        return 0;
+
+    if (enc) {
+        memcpy(name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1
+            || EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes,
+                                  iv) != 1)
+            k = -1;
+    } else if (EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes,
+                                  iv) != 1) {
+        k = -1;
+    }
+    if (k != -1 && ticket_hmac(hctx, key.hmac) != 1)
+        k = -1;
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    return k;
+}
+
+int
+session_init(SSL_CTX *ctx, const int size, const int lifetime)
+{
+    struct ticket_key key;
+    pthread_mutexattr_t mattr;
+    int             fd = -1;
+
+    check(new_key(&key) == 0, "Cannot make a session ticket key.");
+
+    store_size = sizeof(struct store) + size * sizeof(struct entry);
+
+    fd = shm_open(SHM_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    check(fd != -1, "Cannot create shared memory.");
+
+    check(ftruncate(fd, store_size) != -1, "Cannot resize the object");
+
+    store = mmap(NULL, store_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 0);
+    check(store != MAP_FAILED, "Cannot map?!");
+    close(fd);
+
+    store->lifetime = lifetime;
+    store->num_entries = size;
+    store->keys[0] = key;
+    OPENSSL_cleanse(&key, sizeof(key));
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&store->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    SSL_CTX_set_timeout(ctx, lifetime);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "webproxy",
+                                   8);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key);
+#endif
+
+    /*
+     * Without a cache, the sessions are only resumed from tickets.
+     */
+    if (size > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER
+                                       | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, new_session);
+        SSL_CTX_sess_set_get_cb(ctx, get_session);
+        SSL_CTX_sess_set_remove_cb(ctx, remove_session);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    return 0;
+
+  error:
+    store = NULL;
+    OPENSSL_cleanse(&key, sizeof(key));
+    CLOSEFD(fd);
+    shm_unlink(SHM_NAME);
+    return -1;
+}
+
+void
+session_destroy(void)
+{
+    if (store == NULL)
+        return;
+    shm_unlink(SHM_NAME);
+}
+
+void
+session_rotate(void)
+{
+    struct ticket_key key;
+
+    if (store == NULL
+        || time(NULL) - store->keys[0].created < store->lifetime)
+        return;
+
+    if (new_key(&key) == -1) {
+        log_warn("Cannot make a session ticket key, keeping the old one");
+        return;
+    }
+
+    session_lock();
+    store->keys[1] = store->keys[0];
+    store->keys[0] = key;
+    session_unlock();
+    OPENSSL_cleanse(&key, sizeof(key));
+}
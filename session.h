@@ -0,0 +1,55 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <openssl/ssl.h>
+
+/*
+ * Default bounds of the TLS session cache.
+ */
+#define SESSION_DEFAULT_SIZE    4096    /* Sessions, 0 for no cache */
+#define SESSION_DEFAULT_LIFETIME 3600   /* Seconds, also of a ticket key */
+
+/*
+ * Keeps the sessions of `ctx` in shared memory, up to `size` of them, and
+ * encrypts its session tickets with keys shared by every process, replaced
+ * every `lifetime` seconds. It must be called before the processes that
+ * accept the connections are forked.
+ * Returns 0 on success, -1 on failure.
+ */
+int             session_init(SSL_CTX *ctx, const int size,
+                             const int lifetime);
+void            session_destroy(void);
+
+/*
+ * Housekeeping, to be called every second by one process: replaces the
+ * ticket key once it is `lifetime` seconds old.
+ */
+void            session_rotate(void);
+
+#endif                          /* SESSION_H_ */
@@ -0,0 +1,140 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Versions of the settings that can be reloaded (SIGHUP).
+ *
+ * The configuration is a list of strings that every lookup walks. The
+ * settings read on every connection are thus compiled once per version into
+ * a struct of typed fields, described by the table below, with [rates]
+ * compiled into a hash table.
+ *
+ * A process is single-threaded, so the versions are plain reference counts:
+ * a connection takes the current version when it starts, and the version is
+ * freed once it is neither current nor used.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "bucket.h"
+#include "dbg.h"
+#include "race.h"
+#include "settings.h"
+#include "webproxy.h"
+
+/*
+ * An integer setting, and where it goes in struct settings.
+ */
+struct setting {
+    const char     *section;
+    const char     *name;
+    size_t          offset;
+    int             value;      /* Default */
+};
+
+static const struct setting table[] = {
+    {"default", "debug", offsetof(struct settings, debug_level), 0},
+    {"default", "splice", offsetof(struct settings, use_splice), 1},
+    {"default", "pacing", offsetof(struct settings, use_pacing), 0},
+    {"default", "connect_timeout", offsetof(struct settings, connect_timeout),
+     RACE_DEFAULT_TIMEOUT},
+};
+
+#define NUM_SETTINGS (sizeof(table) / sizeof(table[0]))
+
+struct settings *settings = NULL;
+
+static void
+settings_free(struct settings *s)
+{
+    rate_table_free(s->rates);
+    free(s);
+}
+
+struct settings *
+settings_build(struct config_sect *conf)
+{
+    struct settings *s;
+    char           *p;
+    size_t          i;
+    int             k;
+
+    s = calloc(1, sizeof(*s));
+    check_mem(s);
+
+    for (i = 0; i < NUM_SETTINGS; i++) {
+        p = config_get_value(conf, (char *) table[i].section,
+                             (char *) table[i].name, 1);
+        *(int *) ((char *) s + table[i].offset) =
+            p == NULL ? table[i].value : (int) strtol(p, NULL, 10);
+    }
+
+    /*
+     * Only its presence matters, and its name is case-sensitive.
+     */
+    s->use_abs_url = config_get_value(conf, "default", "no_abs", 0) == NULL;
+
+    s->rates = rate_table_build(conf);
+    check(s->rates != NULL, "Cannot compile [rates]");
+    for (k = 0; k < s->rates->num_rules; k++)
+        s->rates->rules[k].bucket = bucket_get(s->rates->rules[k].domain);
+
+    return s;
+
+  error:
+    if (s != NULL)
+        settings_free(s);
+    return NULL;
+}
+
+void
+settings_install(struct settings *s)
+{
+    struct settings *old = settings;
+
+    s->refs = 1;
+    settings = s;
+    debug_level = s->debug_level;
+    if (old != NULL)
+        settings_put(old);
+}
+
+struct settings *
+settings_get(void)
+{
+    settings->refs++;
+    return settings;
+}
+
+void
+settings_put(struct settings *s)
+{
+    if (s != NULL && --s->refs == 0)
+        settings_free(s);
+}
@@ -0,0 +1,73 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SETTINGS_H_
+#define SETTINGS_H_
+
+#include "config.h"
+#include "rates.h"
+
+/*
+ * The settings that can change while the proxy runs, compiled from a
+ * configuration. A version is never modified once built: a reload builds a
+ * new one, and every connection keeps the version it started with.
+ */
+struct settings {
+    int             refs;       /* Users, the current version being one */
+    int             debug_level;
+    int             use_abs_url;
+    int             use_splice;
+    int             use_pacing;
+    int             connect_timeout;
+    struct rate_table *rates;   /* Bound to the shared buckets */
+};
+
+/*
+ * The current version.
+ */
+extern struct settings *settings;
+
+/*
+ * Compiles the settings of `conf`, which can be freed afterwards. The rate
+ * buckets must have been created.
+ * Returns the settings, or NULL on failure.
+ */
+struct settings *settings_build(struct config_sect *conf);
+
+/*
+ * Makes `s` the current version, in place of the previous one.
+ */
+void            settings_install(struct settings *s);
+
+/*
+ * Returns the current version, which the caller must release with
+ * settings_put().
+ */
+struct settings *settings_get(void);
+
+void            settings_put(struct settings *s);
+
+#endif                          /* SETTINGS_H_ */
@@ -36,6 +36,7 @@
 #include <unistd.h>
 
 #include "http.h"
+#include "scan.h"
 #include "utils.h"
 
 #ifdef __OPENSSL_SUPPORT__
@@ -43,17 +44,117 @@
 #include "server.h"
 #endif
 
+void
+#ifdef __OPENSSL_SUPPORT__
+rbuf_init(struct rbuf *rb, BIO * io, char *data, size_t size)
+#else
+rbuf_init(struct rbuf *rb, int sfd, char *data, size_t size)
+#endif
+{
+#ifdef __OPENSSL_SUPPORT__
+    rb->io = io;
+#else
+    rb->sfd = sfd;
+#endif
+    rb->data = data;
+    rb->size = size;
+    rb->start = 0;
+    rb->end = 0;
+}
+
+/*
+ * Reads as much as the buffer can hold with one call.
+ * Returns the number of bytes read, 0 on end of file, or -1 on error.
+ */
 ssize_t
+rbuf_fill(struct rbuf *rb)
+{
+    ssize_t         numRead;
+
+    if (rb->start == rb->end) {
+        rb->start = 0;
+        rb->end = 0;
+    } else if (rb->start > 0) {
+        memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+        rb->end -= rb->start;
+        rb->start = 0;
+    }
+
+    if (rb->end == rb->size) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for (;;) {
 #ifdef __OPENSSL_SUPPORT__
-readLine(BIO * io, void *buffer, size_t n)
+        numRead = BIO_read(rb->io, rb->data + rb->end, rb->size - rb->end);
 #else
-readLine(int sfd, void *buffer, size_t n)
+        numRead = recv(rb->sfd, rb->data + rb->end, rb->size - rb->end, 0);
 #endif
+        if (numRead == -1 && errno == EINTR)
+            continue;
+        break;
+    }
+
+    if (numRead > 0)
+        rb->end += numRead;
+
+    return numRead;
+}
+
+/*
+ * Returns the number of bytes that have been read but not consumed.
+ */
+size_t
+rbuf_pending(const struct rbuf *rb)
+{
+    return rb->end - rb->start;
+}
+
+/*
+ * Reads at most `n` bytes, consuming the buffered bytes first. Only reads
+ * from the connection if nothing is buffered, and then without copying.
+ */
+ssize_t
+rbuf_read(struct rbuf *rb, void *buffer, size_t n)
+{
+    ssize_t         numRead;
+
+    if (rb->start < rb->end) {
+        numRead = min(n, rb->end - rb->start);
+        memcpy(buffer, rb->data + rb->start, numRead);
+        rb->start += numRead;
+        return numRead;
+    }
+
+    for (;;) {
+#ifdef __OPENSSL_SUPPORT__
+        numRead = BIO_read(rb->io, buffer, n);
+#else
+        numRead = recv(rb->sfd, buffer, n, 0);
+#endif
+        if (numRead == -1 && errno == EINTR)
+            continue;
+        return numRead;
+    }
+}
+
+/*
+ * Reads a line into `buffer`, including the trailing '\n'. Like the old
+ * byte-at-a-time version, at most `n` bytes are stored and the rest of a
+ * longer line is discarded. The connection is read in large chunks, and the
+ * bytes after the line stay in `rb` for the body or the next request.
+ * Returns the number of bytes stored, 0 on end of file, or -1 on error.
+ */
+ssize_t
+readLine(struct rbuf *rb, void *buffer, size_t n)
 {
     ssize_t         numRead;
     size_t          totRead;
+    size_t          length;
+    size_t          copy;
     char           *buf;
-    char            ch;
+    char           *nl;
 
     if (n <= 0 || buffer == NULL) {
         errno = EINVAL;
@@ -65,33 +166,28 @@ readLine(int sfd, void *buffer, size_t n)
     totRead = 0;
 
     for (;;) {
-
-#ifdef __OPENSSL_SUPPORT__
-        numRead = BIO_read(io, &ch, 1);
-#else
-        numRead = recv(sfd, &ch, 1, 0);
-#endif
-
-        if (numRead == -1) {
-            if (errno == EINTR)
-                continue;
-            else
+        if (rb->start == rb->end) {
+            numRead = rbuf_fill(rb);
+            if (numRead == -1)
                 return -1;
-        } else if (numRead == 0) {
-            if (totRead == 0)
-                return 0;
-            else
-                break;
-        } else {
-            if (totRead < n) {
-                totRead++;
-                *buf++ = ch;
-            }
-            if (ch == '\n')
-                break;
+            else if (numRead == 0)
+                return totRead;
         }
+
+        nl = memchr(rb->data + rb->start, '\n', rb->end - rb->start);
+        if (nl != NULL)
+            length = nl + 1 - (rb->data + rb->start);
+        else
+            length = rb->end - rb->start;
+
+        copy = min(length, n - totRead);
+        memcpy(buf + totRead, rb->data + rb->start, copy);
+        totRead += copy;
+        rb->start += length;
+
+        if (nl != NULL)
+            return totRead;
     }
-    return totRead;
 }
 
 int
@@ -100,15 +196,13 @@ process_request_line(char *hostname, char *port, char *buffer,
 {
     char           *p,
                    *b,
-                   *hn,
-                   *pp;
-    p = buffer;
-    hn = hostname;
-    pp = port;
+                   *end;
+    size_t          n;
 
-    while (*p++ != ' ');
+    end = buffer + count;
+    p = buffer + scan_find(buffer, count, ' ') + 1;
 
-    if (!isalnum(*p) && *p != '*')
+    if (p >= end || (!isalnum(*p) && *p != '*'))
         return -1;
 
     b = p;
@@ -117,35 +211,34 @@ process_request_line(char *hostname, char *port, char *buffer,
      * RFC 2616 Section 3.2.2
      * Comparisons of scheme names MUST be case-insensitive;
      */
-    if (strncasecmp(p, HTTP_SCHEME_PREFIX, strlen(HTTP_SCHEME_PREFIX))
+    if (end - p < (int) strlen(HTTP_SCHEME_PREFIX)
+        || strncasecmp(p, HTTP_SCHEME_PREFIX, strlen(HTTP_SCHEME_PREFIX))
         != 0) {
         return count;
     }
 
     p += strlen(HTTP_SCHEME_PREFIX);
 
-    while (*p != '/' && *p != ' ') {
-        if (*p == ':') {
-            p++;
-            while (*p != '/' && *p != ' ') {
-                *pp++ = *p++;
-            }
-            break;
-        }
-        *hn++ = *p++;
-    }
-
-    if (hn == hostname) {
+    n = scan_find3(p, end - p, '/', ' ', ':');
+    if (n == 0 || n >= HOSTNAME_LENGTH || p + n == end)
         return -1;
-    } else {
-        *hn = '\0';
+    memcpy(hostname, p, n);
+    hostname[n] = '\0';
+    p += n;
+
+    n = 0;
+    if (*p == ':') {
+        p++;
+        n = scan_find3(p, end - p, '/', ' ', ' ');
+        if (n >= PORT_LENGTH || p + n == end)
+            return -1;
+        memcpy(port, p, n);
+        p += n;
     }
+    port[n] = '\0';
 
-    if (pp == port) {
-        strcpy(pp, "80");
-    } else {
-        *pp = '\0';
-    }
+    if (n == 0)
+        strcpy(port, DEFAULT_PORT);
 
     if (use_abs == 1)
         return count;
@@ -155,11 +248,9 @@ process_request_line(char *hostname, char *port, char *buffer,
         b++;
     }
 
-    do {
-        *b++ = *p++;
-    } while (*(b - 1) != '\n' && *(b - 2) != '\r');
+    memmove(b, p, end - p);
 
-    return b - buffer;
+    return b + (end - p) - buffer;
 }
 
 /*
@@ -194,20 +285,18 @@ endswith(const char *s1, const char *s2, const int caseinsensitive)
 
 
 /*
- * Extracts the value of HTTP header.
+ * Extracts the hostname and port from the value of the header field in
+ * `line`, which is `length` bytes long.
+ * Returns -1 if the value is malformed or too long.
  */
 int
-extract(char *hostname, char *port, const char *line)
+extract(char *hostname, char *port, const char *line, const int length)
 {
+    const char     *ch,
+                   *end;
+    size_t          n;
 
-    char           *h,
-                   *p;
-
-    const char     *ch;
-
-    h = hostname;
-    p = port;
-    ch = line;
+    end = line + length;
 
     /*
      * RFC 2616 Section 4.2
@@ -216,25 +305,65 @@ extract(char *hostname, char *port, const char *line)
      * field value. Field names are case-insensitive. The field value MAY be
      * preceded by any amount of LWS, though a single SP is preferred.
      */
+    ch = line + scan_find(line, length, ':');
+    if (ch == end)
+        return -1;
 
-    while (*ch != ' ' && *ch != '\t')
-        ch++;
+    for (ch++; ch < end && (*ch == ' ' || *ch == '\t'); ch++);
 
-    while (*ch == ' ' || *ch == '\t')
-        ch++;
+    n = scan_find3(ch, end - ch, ':', '\r', '\n');
+    while (n > 0 && (ch[n - 1] == ' ' || ch[n - 1] == '\t'))
+        n--;
+    if (n == 0 || n >= HOSTNAME_LENGTH)
+        return -1;
+    memcpy(hostname, ch, n);
+    hostname[n] = '\0';
+    ch += n;
 
-    while (*ch != ':' && *ch != '\r')
-        *h++ = *ch++;
-    *h = '\0';
+    for (; ch < end && (*ch == ' ' || *ch == '\t'); ch++);
 
-    if (*ch == ':') {
-        ch++;
-        while (isdigit(*ch))
-            *p++ = *ch++;
-        *p = '\0';
-    } else {
-        strcpy(p, DEFAULT_PORT);
+    n = 0;
+    if (ch < end && *ch == ':') {
+        for (ch++; ch < end && isdigit(*ch); ch++) {
+            if (n == PORT_LENGTH - 1)
+                return -1;
+            port[n++] = *ch;
+        }
     }
+    port[n] = '\0';
+
+    if (n == 0)
+        strcpy(port, DEFAULT_PORT);
 
     return 0;
 }
+
+int
+arena_init(struct arena *a, const size_t size)
+{
+    a->base = malloc(size);
+    a->size = size;
+    a->used = 0;
+    return a->base != NULL ? 0 : -1;
+}
+
+void           *
+arena_alloc(struct arena *a, const size_t n)
+{
+    const size_t    align = sizeof(long double);
+    size_t          start;
+
+    start = (a->used + align - 1) / align * align;
+    if (a->base == NULL || start + n > a->size)
+        return NULL;
+    a->used = start + n;
+    return memset(a->base + start, 0, n);
+}
+
+void
+arena_destroy(struct arena *a)
+{
+    FREEMEM(a->base);
+    a->size = 0;
+    a->used = 0;
+}
@@ -27,6 +27,10 @@
 #ifndef STRUTILS_H_
 #define STRUTILS_H_
 
+#ifdef __OPENSSL_SUPPORT__
+#include <openssl/bio.h>
+#endif
+
 #define CLOSEFD(A)                \
         do {                      \
                 if (A != -1)      \
@@ -52,17 +56,63 @@ int             process_request_line(char *hostname, char *port,
 BOOLEAN         endswith(const char *s1, const char *s2,
                          const int caseinsensitive);
 
-int
-                extract(char *hostname, char *port, const char *line);
+int             extract(char *hostname, char *port, const char *line,
+                        const int length);
+
 
+/*
+ * Buffered reader of a connection, see readLine().
+ */
+struct rbuf {
+#ifdef __OPENSSL_SUPPORT__
+    BIO            *io;
+#else
+    int             sfd;
+#endif
+    char           *data;
+    size_t          size;       /* Capacity of `data` */
+    size_t          start;      /* First byte not consumed */
+    size_t          end;        /* One past the last byte read */
+};
 
-ssize_t
+void
 #ifdef __OPENSSL_SUPPORT__
-                readLine(BIO * io, void *buffer, size_t n);
+                rbuf_init(struct rbuf *rb, BIO * io, char *data,
+                          size_t size);
 #else
-                readLine(int sfd, void *buffer, size_t n);
+                rbuf_init(struct rbuf *rb, int sfd, char *data,
+                          size_t size);
 #endif
 
+ssize_t         rbuf_fill(struct rbuf *rb);
+size_t          rbuf_pending(const struct rbuf *rb);
+ssize_t         rbuf_read(struct rbuf *rb, void *buffer, size_t n);
+ssize_t         readLine(struct rbuf *rb, void *buffer, size_t n);
+
+/*
+ * An arena: the small things a connection needs, taken from one block and
+ * freed together with it.
+ */
+struct arena {
+    char           *base;
+    size_t          size;
+    size_t          used;
+};
+
+/*
+ * Allocates the block of `size` bytes.
+ * Returns 0 on success, -1 on failure.
+ */
+int             arena_init(struct arena *a, const size_t size);
+
+/*
+ * Returns `n` zeroed bytes of the arena, aligned for any type, or NULL if
+ * it is full.
+ */
+void           *arena_alloc(struct arena *a, const size_t n);
+
+void            arena_destroy(struct arena *a);
+
 
 
 #endif                          /* STRUTILS_H_ */
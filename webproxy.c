@@ -25,32 +25,48 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>           /* Defines mode constants */
+#include <sys/wait.h>
 #include <arpa/inet.h>
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>              /* Defines O_* constants */
 #include <netdb.h>
-#include <semaphore.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "bucket.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "collapse.h"
 #include "config.h"
 #include "dbg.h"
+#include "disk.h"
+#include "dnscache.h"
+#include "event.h"
+#include "framing.h"
 #include "http.h"
+#include "pool.h"
+#include "race.h"
+#include "rates.h"
+#include "relay.h"
+#include "resolver.h"
 #include "utils.h"
+#include "webproxy.h"
 
 #ifdef __OPENSSL_SUPPORT__
 #include "common.h"
 #include "server.h"
+#include "session.h"
 #endif
 
 /*
@@ -65,66 +81,88 @@
 /*
  * Default parameters
  */
-#define RECORD_HOSTNAME_LENGTH  50
+#define DEFAULT_BACKLOG         511
+#define READ_BUFFER_SIZE        KBYTES_TO_BYTES(16)
 
 /*
- * Please do NOT change PEER_BUFFER_SIZE to a small value. If the
- * PEER_BUFFER_SIZE is too small, CPU will be interrupted too frequently and it
- * will do too many context switches, which can be expensive and lead to higher
- * CPU usage.
+ * The arena of a connection of the fork engine: its two peers, and the
+ * names and ports it is asked for and connected to, with room to align
+ * them.
  */
-#define PEER_BUFFER_SIZE INT16_MAX
+#define PROXY_ARENA_SIZE        (2 * sizeof(struct peer)              \
+                                 + 3 * HOSTNAME_LENGTH + 2 * PORT_LENGTH \
+                                 + 7 * sizeof(long double))
+#define PROXY_BUFFERS           3       /* Pool buffers of a connection */
+#define DNS_REFRESH_BATCH       64      /* Names refreshed per second */
+#define DNS_REFRESH_TIMEOUT     5000    /* In milliseconds */
+#define DNS_SNAPSHOT_INTERVAL   60      /* In seconds */
 
-#define SHM_NAME "dnscache_shm"
-#define SEM_NAME "dnscache_sem"
+/*
+ * Connection engines. See event.c for ENGINE_EPOLL.
+ */
+#define ENGINE_FORK  0
+#define ENGINE_EPOLL 1
+
+struct config_sect *conf = NULL;
+
+int             debug_level = 0;
 
 /*
- * Units and units conversion.
+ * The configuration file, read again on SIGHUP.
  */
-#define USECOND_PER_SECOND 1000000
-#define BYTES_TO_KBYTES(A) (A / 1024)
-#define KBYTES_TO_BYTES(A) (A * 1024)
-
-struct peer {
-    int             socketfd;   /* Socket file descriptor */
-    char           *hostname;   /* Hostname of the peer, only set for
-                                 * "server" */
-    char           *buffer;     /* Buffer area for the incoming data */
-    int             bytes_read; /* Number of bytes read or the amount of
-                                 * data in buffer */
-};
+static char    *conf_path = NULL;
+static volatile sig_atomic_t reload_pending = 0;
 
 /*
- * DNS record
+ * Pre-forked workers, if any.
  */
-struct record {
-    char            valid;      /* 1 if valid, 0 if invalid */
-    char            hostname[RECORD_HOSTNAME_LENGTH + 1];
-    struct addrinfo addr;       /* Result of addrinfo. WARNING: certain
-                                 * fields are invalid. Don't rely on this
-                                 * too much. */
-    struct sockaddr_storage sock;       /* Use sockaddr_storage to support
-                                         * both IPv4 and IPv6 */
-    struct timeval  tv;         /* When this record was used last time */
-};
+pid_t          *worker_pids = NULL;
+int             num_workers = 0;
 
-struct config_sect *conf = NULL;
+/*
+ * The broker of idle server connections, if any.
+ */
+pid_t           pool_pid = 0;
 
-int             debug_level = 0;
-int             use_abs_url = 1;
+/*
+ * The resolver process, if any.
+ */
+pid_t           resolver_pid = 0;
+
+/*
+ * The process that sweeps the caches.
+ */
+pid_t           cleaner_pid = 0;
+
+/*
+ * The buffers of the next child of the fork engine, taken before it is
+ * forked.
+ */
+static char    *next_buffers[PROXY_BUFFERS];
 
 /*
- * Posix Shared Memory
+ * How long DNS records are kept, in seconds.
  */
-char           *addr = NULL;
+static int      dns_ttl = DEFAULT_TTL;
+
 /*
- * Size of shared memory
+ * Where the DNS cache is saved across restarts, if anywhere.
  */
-int             cache_size;
+static char    *dns_snapshot = NULL;
+
 /*
- * POSIX Semaphores
+ * Terminates the pre-forked workers.
  */
-sem_t          *sem;
+void
+kill_workers(void)
+{
+    int             i;
+
+    for (i = 0; i < num_workers; i++) {
+        if (worker_pids[i] > 0)
+            kill(worker_pids[i], SIGTERM);
+    }
+}
 
 /*
  * Signal handler of the parent process.
@@ -140,14 +178,46 @@ sigHandler(int sig)
         kill(0, SIGTERM);
     } else if (sig == SIGTERM) {
         log_info("Catch SIGTERM");
+        kill_workers();
+        if (pool_pid > 0)
+            kill(pool_pid, SIGTERM);
+        if (resolver_pid > 0)
+            kill(resolver_pid, SIGTERM);
+        if (cleaner_pid > 0)
+            kill(cleaner_pid, SIGTERM);
         sleep(2);
-        shm_unlink(SHM_NAME);
-        sem_unlink(SEM_NAME);
+        if (dns_snapshot != NULL && dns_cache_save(dns_snapshot) != -1)
+            log_info("Saved the DNS cache to %s", dns_snapshot);
+        dns_cache_destroy();
+        cache_destroy();
+        disk_close();
+        collapse_destroy();
+        bufpool_destroy();
+#ifdef __OPENSSL_SUPPORT__
+        session_destroy();
+#endif
         config_destroy(conf);
         exit(EXIT_SUCCESS);
     }
 }
 
+/*
+ * SIGHUP: the configuration is reloaded here, at the next chance, and in
+ * the workers.
+ */
+void
+hupHandler(int sig)
+{
+    int             i;
+
+    (void) sig;
+    reload_pending = 1;
+    for (i = 0; i < num_workers; i++) {
+        if (worker_pids[i] > 0)
+            kill(worker_pids[i], SIGHUP);
+    }
+}
+
 /*
  * Signal handler of the child process.
  */
@@ -169,6 +239,23 @@ childSigHandler(int sig)
     }
 }
 
+/*
+ * Returns the status line of the error response for `code`.
+ */
+const char     *
+error_head(const int code)
+{
+    switch (code) {
+    case 503:
+        return RESPONSE_503_HEAD;
+    case 414:
+        return RESPONSE_414_HEAD;
+    case 400:
+    default:
+        return RESPONSE_400_HEAD;
+    }
+}
+
 void
 #ifdef __OPENSSL_SUPPORT__
 send_error(BIO * io, const int code)
@@ -176,20 +263,10 @@ send_error(BIO * io, const int code)
 send_error(int sfd, const int code)
 #endif
 {
-    char           *head;
-    char           *tail = RESPONSE_HEADER_TAIL;
+    const char     *head;
+    const char     *tail = RESPONSE_HEADER_TAIL;
 
-    switch (code) {
-    case 503:
-        head = RESPONSE_503_HEAD;
-        break;
-    case 414:
-        head = RESPONSE_414_HEAD;
-    case 400:
-    default:
-        head = RESPONSE_400_HEAD;
-        break;
-    }
+    head = error_head(code);
 
 #ifdef __OPENSSL_SUPPORT__
     BIO_puts(io, head);
@@ -200,23 +277,6 @@ send_error(int sfd, const int code)
 #endif
 }
 
-/*
- * REF: http://www.cse.yorku.ca/~oz/hash.html
- */
-unsigned long
-hash(const unsigned char *str)
-{
-    const unsigned char *p;
-    unsigned long   hash = 5381;
-    int             c;
-    p = str;
-
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
-
-    return hash % (cache_size / sizeof(struct record));
-}
-
 /*
  * Establishes a connection with the real server.
  * Returns the socket file descriptor with the server.
@@ -225,173 +285,446 @@ hash(const unsigned char *str)
 int
 make_socket(const char *name, const char *port)
 {
-    struct addrinfo hints,
-                   *ai,
-                   *p;
-    int             sfd = -1;
-    struct record  *ptr;
-    pid_t           pid;
+    struct resolver_answer answer;
+    struct resolver_addr *p;
+    int             sfd;
+    int             i;
 
     log_info("Child process %ld is attempting to connect to "
              "host:%s, port: %s", (long) getpid(), name, port);
 
-    ptr = (struct record *) addr + hash((unsigned char *) name);
+    /*
+     * The cache is not locked while connecting.
+     */
+    p = &answer.addr[0];
+    if (dns_cache_get(name, port, &p->addr, &p->len, &p->family) == 0) {
+        answer.error = 0;
+        answer.count = 1;
+        sfd = race_connect(&answer, settings->connect_timeout, &i);
+        if (sfd != -1) {
+            log_info("Reusing DNS record of host:%s", name);
+            return sfd;
+        }
+        dns_cache_drop(name);
+    } else {
+        log_info("Did not find the cached record for %s", name);
+    }
+
+    if (resolve(name, port, &answer) == -1) {
+        log_err("Cannot resolve %s: %s", name, gai_strerror(answer.error));
+        return -1;
+    }
+
+    /*
+     * The addresses are raced rather than tried in turn, so that one that
+     * does not answer does not hold up the others.
+     */
+    sfd = race_connect(&answer, settings->connect_timeout, &i);
+    if (sfd == -1)
+        return -1;
 
-    sem_wait(sem);
-    if (ptr->valid != 0 && strcasecmp(ptr->hostname, name) == 0) {
-        sfd =
-            socket(ptr->addr.ai_family, ptr->addr.ai_socktype,
-                   ptr->addr.ai_protocol);
+    log_info("Connected to %s", name);
+
+    p = &answer.addr[i];
+    dns_cache_put(name, p->family, (struct sockaddr *) &p->addr, p->len);
+    return sfd;
+}
 
-        if (sfd == -1) {
-            memset(ptr, 0, sizeof(*ptr));
-            goto new_record;
+/*
+ * Resolves again the names in `names`, all at once, and refreshes their
+ * records. The old addresses are served meanwhile.
+ */
+static void
+refresh_names(char (*names)[HOSTNAME_LENGTH], const int count)
+{
+    struct resolver_answer answer;
+    struct pollfd   pfd[DNS_REFRESH_BATCH];
+    int             i,
+                    n,
+                    left;
+
+    for (i = 0; i < count; i++) {
+        pfd[i].fd = resolver_submit(names[i]);
+        pfd[i].events = POLLIN;
+        if (pfd[i].fd == -1) {
+            /*
+             * No resolver: this process can afford to block.
+             */
+            if (resolve(names[i], "0", &answer) == 0)
+                dns_cache_refresh(names[i], &answer);
         }
+    }
+
+    for (left = count; left > 0;) {
+        n = poll(pfd, count, DNS_REFRESH_TIMEOUT);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
 
-        if (connect(sfd, ptr->addr.ai_addr, ptr->addr.ai_addrlen) != 0) {
-            memset(ptr, 0, sizeof(*ptr));
-            goto new_record;
+        for (i = 0; i < count; i++) {
+            if (pfd[i].fd == -1 || pfd[i].revents == 0)
+                continue;
+            if (resolver_read(pfd[i].fd, "0", &answer) == -1)
+                continue;
+            if (answer.error == 0) {
+                log_info("Refreshed the DNS record of %s", names[i]);
+                dns_cache_refresh(names[i], &answer);
+            }
+            close(pfd[i].fd);
+            pfd[i].fd = -1;
         }
 
-        log_info("Reusing DNS record of host:%s", name);
-        sem_post(sem);
-        return sfd;
+        for (i = 0, left = 0; i < count; i++)
+            left += pfd[i].fd != -1;
     }
-    sem_post(sem);
-    log_info("Did not find the cached record for %s", name);
 
-  new_record:
+    for (i = 0; i < count; i++)
+        CLOSEFD(pfd[i].fd);
+}
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags |= AI_CANONNAME;
+void
+dnscleaner(void)
+{
+    char            names[DNS_REFRESH_BATCH][HOSTNAME_LENGTH];
+    int             ttl;
+    int             ahead;
+    int             slices;
+    int             n;
+    time_t          saved;
+    char           *p;
+
+    signal(SIGTERM, childSigHandler);
+    signal(SIGHUP, SIG_IGN);
 
-    check(getaddrinfo(name, port, &hints, &ai) == 0, "Cannot getaddrinfo");
+    ttl = dns_ttl;
 
-    for (p = ai; p != NULL; p = p->ai_next) {
-        sfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sfd == -1)
-            continue;
-        if (connect(sfd, p->ai_addr, p->ai_addrlen) != 0)
-            continue;
+    /*
+     * "refresh = 0" lets the records expire even if they are in use.
+     * Otherwise, a record used in the last quarter of its life is resolved
+     * again before it expires.
+     */
+    p = config_get_value(conf, "dns", "refresh", 1);
+    if (p != NULL && strtol(p, (char **) NULL, 10) == 0)
+        ahead = 0;
+    else
+        ahead = ttl / 4;
 
-        log_info("Connected to %s", p->ai_canonname);
+    /*
+     * The cache is swept a slice per second, so that every record is seen
+     * at least once while it can be refreshed.
+     */
+    slices = ahead > 0 ? ahead : ttl / 2;
 
-        pid = fork();
-        check(pid != -1, "Cannot fork");
+    saved = time(NULL);
+    for (;;) {
+        sleep(1);
+        n = dns_cache_sweep(ttl, ahead, slices, names, DNS_REFRESH_BATCH);
+        if (n > 0)
+            refresh_names(names, n);
+        disk_sweep();
+#ifdef __OPENSSL_SUPPORT__
+        session_rotate();
+#endif
 
         /*
-         * Use fork(2) to speed up. The parent will return the socket file
-         * descriptor to the caller. The child will add the record in the
-         * shared memory and exit.
+         * Also saved on a timer, in case the proxy does not get to exit
+         * cleanly.
          */
-        switch (pid) {
+        if (dns_snapshot != NULL
+            && time(NULL) - saved >= DNS_SNAPSHOT_INTERVAL) {
+            dns_cache_save(dns_snapshot);
+            saved = time(NULL);
+        }
+    }
+}
 
-        case 0:
-            sem_wait(sem);
+void
+pace_client(const struct settings *s, int fd, const int rate, int *paced)
+{
+    static int      warned = 0;
+    unsigned int    bytes;
+
+    if (!s->use_pacing || (rate <= 0 && !*paced))
+        return;
+
+#ifdef SO_MAX_PACING_RATE
+    bytes = rate > 0 ? (unsigned int) KBYTES_TO_BYTES(rate) : ~0U;
+    if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &bytes,
+                   sizeof(bytes)) == 0) {
+        *paced = rate > 0;
+        return;
+    }
+#else
+    (void) bytes;
+#endif
 
-            ptr = (struct record *) addr + hash((unsigned char *) name);
+    if (!warned) {
+        log_warn("The kernel cannot pace, falling back to sleeping.");
+        warned = 1;
+    }
+}
 
-            memset(ptr, 0, sizeof(*ptr));
-            ptr->valid = 1;
-            strcpy(ptr->hostname, p->ai_canonname);
-            memcpy(&(ptr->sock), p->ai_addr, sizeof(*(p->ai_addr)));
-            memcpy(&(ptr->addr), p, sizeof(*p));
-            ptr->addr.ai_addr = (struct sockaddr *) &(ptr->sock);
-            ptr->addr.ai_canonname = ptr->hostname;
+void
+reload_settings(void)
+{
+    struct config_sect *sects;
+    struct settings *s;
 
-            gettimeofday(&(ptr->tv), NULL);
+    if (!reload_pending)
+        return;
+    reload_pending = 0;
 
-            sem_post(sem);
-            _exit(EXIT_SUCCESS);
+    if (conf_path == NULL) {
+        log_warn("No configuration file to reload");
+        return;
+    }
 
-        default:
-            freeaddrinfo(ai);
-            return sfd;
-        }
+    sects = config_load(conf_path);
+    if (sects == NULL) {
+        log_warn("Cannot reload %s, keeping the current settings", conf_path);
+        return;
+    }
+    s = settings_build(sects);
+    config_destroy(sects);
+    if (s == NULL) {
+        log_warn("Cannot reload %s, keeping the current settings", conf_path);
+        return;
     }
 
-  error:
-    freeaddrinfo(ai);
-    sem_post(sem);
-    return -1;
+    settings_install(s);
+    log_info("Process %ld reloaded %s", (long) getpid(), conf_path);
 }
 
-void
-dnscleaner(void)
+/*
+ * Returns how many of the next bytes from the server `sfd` belong to the
+ * response `f`, which are framed on the way: the header and the chunk sizes
+ * are peeked at, the body is only counted. Once the framing is lost, or the
+ * body ends with the connection, that is up to `chunk_size` bytes.
+ * Returns what recv(2) returned if there is nothing to look at.
+ */
+static ssize_t
+frame_ahead(struct frame *f, int sfd, const size_t chunk_size)
 {
-    int             ttl;
-    char           *p;
-    struct record  *r;
-    struct timeval  tv;
-    p = config_get_value(conf, "dns", "ttl", 1);
-
-    signal(SIGTERM, childSigHandler);
+    char            peek[FRAME_PEEK_SIZE];
+    ssize_t         n,
+                    k;
+    size_t          bulk;
+
+    if (f->state == FRAME_ERROR)
+        return chunk_size;
+
+    bulk = frame_bulk(f);
+    if (bulk > 0) {
+        k = min(bulk, chunk_size);
+        frame_skip(f, k);
+        return k;
+    }
 
-    if (p == NULL)
-        ttl = DEFAULT_TTL;
-    else
-        ttl = (int) strtol(p, (char **) NULL, 10);
+    n = recv(sfd, peek, sizeof(peek), MSG_PEEK);
+    if (n <= 0)
+        return n;
+    k = frame_feed(f, peek, n);
+    return k == -1 ? (ssize_t) chunk_size : k;
+}
 
-    if (ttl < 60) {
-        log_warn("TTL is too small. I will now set it to 60s.");
-        ttl = 60;
+/*
+ * Sends the `n` bytes of `buf` to `sfd`.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+send_all(int sfd, const char *buf, size_t n)
+{
+    ssize_t         k;
+
+    while (n > 0) {
+        k = send(sfd, buf, n, MSG_NOSIGNAL);
+        if (k == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += k;
+        n -= k;
     }
+    return 0;
+}
 
-    for (;;) {
-        sleep(ttl / 2);
-        r = (struct record *) addr;
-        gettimeofday(&tv, NULL);
-        sem_wait(sem);
-        while ((char *) r - addr < cache_size) {
-            if (tv.tv_sec - r->tv.tv_sec > ttl) {
-                memset(r, 0, sizeof(*r));
-            }
-            r++;
+#ifdef __OPENSSL_SUPPORT__
+/*
+ * Dynamic record sizing. What is sent after the connection has been idle
+ * goes in records that fit a TCP segment, so that the client can decrypt
+ * the first bytes of a response as soon as they arrive; once TLS_RAMP_BYTES
+ * have been sent, in the largest records, for the least overhead. A child
+ * serves one connection, so the state is its own.
+ */
+#define TLS_SMALL_RECORD        1369
+#define TLS_LARGE_RECORD        16384
+#define TLS_RAMP_BYTES          KBYTES_TO_BYTES(64)
+#define TLS_IDLE_MSECONDS       1000
+
+static size_t   tls_sent;
+static struct timespec tls_last;
+static int      tls_record;     /* The largest record set, 0 if none yet */
+
+/*
+ * Writes the `n` bytes of `buf` to `io`, the ones before TLS_RAMP_BYTES to
+ * be sent in small records and the others in large ones.
+ * Returns the number of bytes written, or -1.
+ */
+static int
+tls_write(BIO * io, const char *buf, const size_t n)
+{
+    struct timespec now;
+    SSL            *ssl;
+    long            idle;
+    size_t          done,
+                    k;
+    int             record;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    idle = (now.tv_sec - tls_last.tv_sec) * 1000
+        + (now.tv_nsec - tls_last.tv_nsec) / 1000000;
+    if (idle >= TLS_IDLE_MSECONDS)
+        tls_sent = 0;
+    tls_last = now;
+
+    BIO_get_ssl(BIO_next(io), &ssl);
+    for (done = 0; done < n; done += k) {
+        record = tls_sent < TLS_RAMP_BYTES ? TLS_SMALL_RECORD
+            : TLS_LARGE_RECORD;
+        if (record != tls_record) {
+            /*
+             * The records are cut when `io` is flushed, so what it holds
+             * goes out first, in the records it was written for.
+             */
+            if (BIO_flush(io) <= 0)
+                return -1;
+            SSL_set_max_send_fragment(ssl, record);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+            /*
+             * Lowering the largest record lowered this too.
+             */
+            SSL_set_split_send_fragment(ssl, record);
+#endif
+            tls_record = record;
         }
-        sem_post(sem);
+
+        k = n - done;
+        if (tls_sent < TLS_RAMP_BYTES)
+            k = min(k, TLS_RAMP_BYTES - tls_sent);
+        if (BIO_write(io, buf + done, k) != (int) k)
+            return -1;
+        tls_sent += k;
     }
+
+    return n;
 }
 
 /*
- * Gets the rate specified in the configuration file.
- * Returns -1 if not found.
- * Returns the best (longest) matches if there are multiple matches.
+ * Returns 1 if `fd` can be read from without waiting, 0 otherwise.
  */
-int
-get_rate(const char *hostname)
+static int
+readable(int fd)
 {
-    struct config_sect *p;
-    struct config_token *token;
-    size_t          best_match;
-    int             rate;
+    struct pollfd   pfd;
 
-    p = conf;
-    best_match = 0;
-    rate = -1;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 1;
+}
 
-    /*
-     * The idea is, if the "hostname" matches "edu.au" and "anu.edu.au", the
-     * later one will be used regardless of their order in the configuration
-     * file.
-     */
-    while (p != NULL) {
-        if (strcasecmp(p->name, "rates") == 0) {
-            token = p->tokens;
-            while (token != NULL) {
-                if (endswith(hostname, token->token, 1) == TRUE
-                    && strlen(token->token) > best_match) {
-                    best_match = strlen(token->token);
-                    rate = atoi(token->value);
-                }
-                token = token->next;
+/*
+ * Sends the response of `hit` from the disk cache through `io`, by way of
+ * `buf`, of PEER_BUFFER_SIZE bytes.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+send_disk_hit(BIO * io, const struct disk_hit *hit, char *buf)
+{
+    size_t          from = 0;
+    ssize_t         k;
+
+    k = disk_head(hit, buf, PEER_BUFFER_SIZE);
+    if (k == -1 || tls_write(io, buf, k) != (int) k)
+        return -1;
+    while ((k = disk_read(hit, from, buf, PEER_BUFFER_SIZE)) > 0) {
+        if (tls_write(io, buf, k) != (int) k)
+            return -1;
+        from += k;
+    }
+    return k == 0 && BIO_flush(io) > 0 ? 0 : -1;
+}
+#endif
+
+/*
+ * Waits for the child fetching the response to the request `head`, whose
+ * key is `key`, and sends it to the client from the disk cache as it is
+ * written there, by way of `buf`, of PEER_BUFFER_SIZE bytes. With OpenSSL,
+ * it goes through `io`, or straight to `sfd` if `io` is NULL: the kernel
+ * encrypts it.
+ * Returns 1 if it was sent, 0 if it is to be looked up in the cache again
+ * or fetched, or -1 on failure, which may be after a part of it.
+ */
+static int
+#ifdef __OPENSSL_SUPPORT__
+follow(BIO * io, int sfd, const int flight, const char *key,
+       const char *head, const size_t length, char *buf)
+#else
+follow(int sfd, const int flight, const char *key, const char *head,
+       const size_t length, char *buf)
+#endif
+{
+    enum flight_state state;
+    struct disk_hit hit;
+    size_t          sent = 0,
+                    written;
+    long            max_age;
+    ssize_t         k;
+
+    for (;;) {
+        state = collapse_wait(flight, sent, &hit, &written);
+        if (state == FLIGHT_FAILED || (state == FLIGHT_DONE && sent == 0))
+            return sent == 0 ? 0 : -1;
+
+        if (sent == 0) {
+            cache_accepts(head, length, &max_age);
+            if ((max_age >= 0 && hit.age > max_age)
+                || !disk_matches(&hit, key, head, length))
+                return 0;
+            k = disk_head(&hit, buf, PEER_BUFFER_SIZE);
+            if (k == -1)
+                return -1;
+#ifdef __OPENSSL_SUPPORT__
+            if (io != NULL ? tls_write(io, buf, k) != (int) k
+                : send_all(sfd, buf, k) == -1)
+#else
+            if (send_all(sfd, buf, k) == -1)
+#endif
+                return -1;
+            sent = hit.line_length;
+        }
+
+#ifdef __OPENSSL_SUPPORT__
+        if (io != NULL) {
+            for (; sent < written; sent += k) {
+                k = disk_read(&hit, sent - hit.line_length, buf,
+                              min(written - sent,
+                                  (size_t) PEER_BUFFER_SIZE));
+                if (k <= 0 || tls_write(io, buf, k) != (int) k)
+                    return -1;
             }
+            if (BIO_flush(io) <= 0)
+                return -1;
         }
-        p = p->next;
+#endif
+        if (written > sent
+            && disk_send_part(&hit, sfd, sent, written) == -1)
+            return -1;
+        sent = max(sent, written);
+        if (state == FLIGHT_DONE)
+            return 1;
     }
-
-    return rate;
 }
 
 void
@@ -407,6 +740,13 @@ proxy(int sfd)
     struct peer    *client = NULL;
     struct peer    *server = NULL;
 
+    /*
+     * Where the peers and the names come from. The buffers come from the
+     * pool.
+     */
+    struct arena    arena;
+    int             status = EXIT_FAILURE;
+
     /*
      * Hostname and port from Host filed
      */
@@ -422,7 +762,8 @@ proxy(int sfd)
     /*
      * Variables for select()
      */
-    struct timeval  tv;
+    struct timeval  tv,
+                    poll_tv;
     fd_set          master,
                     read_fds;
     int             fdmax;
@@ -430,25 +771,97 @@ proxy(int sfd)
     int             byte_count,
                     line_count;
 
+    /*
+     * Buffered reader of the client. It may hold the body or the next
+     * request after the header.
+     */
+    struct rbuf     rb;
+    char           *read_buffer = NULL;
+
     /*
      * Rate-limiting related variables
      */
     int             rate;
-    int             factor;
-
-    struct timeval  current_time;
+    struct rate_rule *rule = NULL;
+    int             paced = 0;
     struct timespec ts;
-    time_t          prev_second;
-    suseconds_t     prev_usecond;
-    int             sleep_time;
+    long            sleep_time;
+
+    /*
+     * Where the request and its response end. `fed` bytes of the response
+     * have been framed but not read yet.
+     */
+    struct frame    request,
+                    response;
+    size_t          fed;
+
+    /*
+     * The response cache. If the response to the request may be cached, it
+     * is collected into `collected` as it is relayed.
+     */
+    char            key[CACHE_KEY_LENGTH];
+    int             head_length;
+    int             collecting;
+    char           *collected = NULL;
+    size_t          collected_length;
+    size_t          collect_size;
+    char           *hit;
+    size_t          hit_length;
+
+    /*
+     * A response too large for memory is written to the disk cache as it
+     * is relayed, once its header is in (`sized`).
+     */
+    struct disk_write *filling = NULL;
+    struct disk_hit disk_hit;
+    int             sized;
+    size_t          total;
+
+    /*
+     * Collapsed forwarding. The ticket of the fetch this child leads, or
+     * -1; a child only joins one fetch per request (`joined`).
+     */
+    int             flight = -1;
+    int             leader,
+                    joined;
+    long            max_age;
 
     /*
-     * If the server sends actual response
+     * The client of the leader has gone away, and the response is only
+     * written to the disk cache, for the followers.
      */
-    int             content_flag;
+    int             orphaned;
 
     int             chunk_size;
 
+    /*
+     * The response is spliced through `rp` unless it is not open, or the
+     * response has to be collected.
+     */
+    struct relay_pipe rp;
+    int             splicing;
+
+    /*
+     * The port the server connection is connected to.
+     */
+    char            server_port[PORT_LENGTH];
+
+    /*
+     * The server connection is kept for the next request to the same
+     * server. It is `idle` once its response has been relayed, and goes
+     * back to the pool when a request goes elsewhere or the client leaves.
+     */
+    int             idle = 0;
+
+    /*
+     * The server connection had been idle before the request (`reused`), so
+     * the server may have closed it meanwhile. Until the server responds, a
+     * GET or HEAD can be sent again on a new connection (`replay`), once.
+     */
+    int             reused,
+                    replay,
+                    retried;
+
 #ifdef __OUT_OF_MIND__
     send_error(sfd, 400);
 #endif
@@ -457,50 +870,83 @@ proxy(int sfd)
     BIO            *io,
                    *ssl_bio;
 
+    /*
+     * The kernel encrypts what is sent to the client (kTLS): the responses
+     * go straight to the socket, as they would without OpenSSL.
+     */
+    int             ktls;
+
     io = BIO_new(BIO_f_buffer());
     ssl_bio = BIO_new(BIO_f_ssl());
     BIO_set_ssl(ssl_bio, ssl, BIO_CLOSE);
     BIO_push(io, ssl_bio);
+    BIO_set_write_buffer_size(io, TLS_LARGE_RECORD);
+#ifdef SSL_OP_ENABLE_KTLS
+    ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    ktls = 0;
+#endif
 #endif
 
     signal(SIGTERM, childSigHandler);
+    signal(SIGHUP, SIG_IGN);
+
+    /*
+     * A child that leads or follows a fetch must get to leave it when its
+     * client goes away.
+     */
+    signal(SIGPIPE, SIG_IGN);
 
     /*
      * Initialise variables
      */
+    relay_pipe_init(&rp);
+    server_port[0] = '\0';
 
-    client = malloc(sizeof(*client));
-    check_mem(client);
-    memset(client, 0, sizeof(*client));
+    check_mem(arena_init(&arena, PROXY_ARENA_SIZE) == 0);
+    client = arena_alloc(&arena, sizeof(*client));
+    server = arena_alloc(&arena, sizeof(*server));
+    check_mem(client != NULL && server != NULL);
 
     client->socketfd = sfd;
-    client->buffer = malloc(PEER_BUFFER_SIZE);
+    client->buffer = next_buffers[0];
     check_mem(client->buffer);
     client->bytes_read = 0;
 
-    server = malloc(sizeof(*server));
-    check_mem(server);
-    memset(server, 0, sizeof(*server));
-
     server->socketfd = -1;
-    server->buffer = malloc(PEER_BUFFER_SIZE);
+    server->buffer = next_buffers[1];
     check_mem(server->buffer);
     server->bytes_read = 0;
 
-    server->hostname = malloc(HOSTNAME_LENGTH);
-    check_mem(server->hostname);
-
-    hostname = malloc(HOSTNAME_LENGTH);
-    check_mem(hostname);
+    server->hostname = arena_alloc(&arena, HOSTNAME_LENGTH);
+    hostname = arena_alloc(&arena, HOSTNAME_LENGTH);
+    port = arena_alloc(&arena, PORT_LENGTH);
+    request_hostname = arena_alloc(&arena, HOSTNAME_LENGTH);
+    request_port = arena_alloc(&arena, PORT_LENGTH);
+    check_mem(server->hostname != NULL && hostname != NULL && port != NULL
+              && request_hostname != NULL && request_port != NULL);
 
-    port = malloc(PORT_LENGTH);
-    check_mem(port);
+    /*
+     * A pool buffer holds more than READ_BUFFER_SIZE.
+     */
+    read_buffer = next_buffers[2];
+    check_mem(read_buffer);
 
-    request_hostname = malloc(HOSTNAME_LENGTH);
-    check_mem(request_hostname);
+#ifdef __OPENSSL_SUPPORT__
+    /*
+     * Not through the buffer BIO, whose reads wait for as much as they ask.
+     */
+    rbuf_init(&rb, ssl_bio, read_buffer, READ_BUFFER_SIZE);
+#else
+    rbuf_init(&rb, client->socketfd, read_buffer, READ_BUFFER_SIZE);
+#endif
 
-    request_port = malloc(PORT_LENGTH);
-    check_mem(request_port);
+#ifdef __OPENSSL_SUPPORT__
+    if (ktls && settings->use_splice == 1 && relay_pipe_open(&rp) == -1)
+#else
+    if (settings->use_splice == 1 && relay_pipe_open(&rp) == -1)
+#endif
+        log_warn("Cannot create a pipe, the response will be copied.");
 
   start:
     memset(hostname, 0, sizeof(*hostname));
@@ -510,7 +956,6 @@ proxy(int sfd)
 
     byte_count = 0;
     line_count = 0;
-    content_flag = 0;
 
     FD_ZERO(&master);
     FD_SET(client->socketfd, &master);
@@ -520,39 +965,39 @@ proxy(int sfd)
     tv.tv_usec = 0;
 
     for (;;) {
-        read_fds = master;
+        /*
+         * Only wait for the client if nothing is buffered.
+         */
+        if (rbuf_pending(&rb) == 0) {
+            read_fds = master;
 
-        if (select(fdmax + 1, &read_fds, NULL, NULL, &tv) == -1) {
-            log_err("select() fails");
+            if (select(fdmax + 1, &read_fds, NULL, NULL, &tv) == -1) {
+                log_err("select() fails");
 #ifdef __OPENSSL_SUPPORT__
-            send_error(io, 503);
+                send_error(io, 503);
 #else
-            send_error(client->socketfd, 503);
+                send_error(client->socketfd, 503);
 #endif
-            goto error;
-        }
+                goto error;
+            }
 
-        /*
-         * Timeout
-         */
-        if (!FD_ISSET(client->socketfd, &read_fds)) {
+            /*
+             * Timeout
+             */
+            if (!FD_ISSET(client->socketfd, &read_fds)) {
 #ifdef __OPENSSL_SUPPORT__
-            if (!SSL_pending(ssl)) {
+                if (!SSL_pending(ssl)) {
 #endif
-                log_info("timeout");
-                goto error;
+                    log_info("timeout");
+                    goto error;
 #ifdef __OPENSSL_SUPPORT__
-            }
+                }
 #endif
+            }
         }
-#ifndef __OPENSSL_SUPPORT__
-        byte_count = readLine(client->socketfd,
-                              client->buffer + client->bytes_read,
-                              KBYTES_TO_BYTES(5));
-#else
-        byte_count = readLine(io, client->buffer + client->bytes_read,
+
+        byte_count = readLine(&rb, client->buffer + client->bytes_read,
                               KBYTES_TO_BYTES(5));
-#endif
 
         if (byte_count == -1) {
             log_warn("Failed to read from the client.");
@@ -578,7 +1023,7 @@ proxy(int sfd)
             byte_count =
                 process_request_line(request_hostname, request_port,
                                      client->buffer, byte_count,
-                                     use_abs_url);
+                                     settings->use_abs_url);
             log_info("host: %s, port: %s", request_hostname, request_port);
 
             if (byte_count == -1) {
@@ -605,15 +1050,16 @@ proxy(int sfd)
          * them in requests to proxies.
          *
          */
-        if (strncasecmp
-            (client->buffer + client->bytes_read, HOST_PREFIX,
-             HOST_PREFIX_LENGTH) == 0) {
-            extract(hostname, port, client->buffer + client->bytes_read);
+        if (byte_count > (int) HOST_PREFIX_LENGTH
+            && strncasecmp(client->buffer + client->bytes_read, HOST_PREFIX,
+                           HOST_PREFIX_LENGTH) == 0) {
             /*
              * Check if the request line is seen
              */
             if (strlen(request_hostname) == 0
-                || strlen(request_hostname) == 0) {
+                || extract(hostname, port,
+                           client->buffer + client->bytes_read,
+                           byte_count) == -1) {
 #ifdef __OPENSSL_SUPPORT__
                 send_error(io, 400);
 #else
@@ -643,34 +1089,6 @@ proxy(int sfd)
 #endif
                 goto error;
             }
-
-            /*
-             * Do we need a new socket?
-             * We should, if:
-             * a) We have not established a connection to any server, or
-             * b) We have established a connection to a server whose hostname
-             *    is different from this request.
-             */
-            if (server->socketfd == -1
-                || strcasecmp(server->hostname, hostname) != 0) {
-                /*
-                 * Safely close existing socket file descriptor.
-                 */
-                CLOSEFD(server->socketfd);
-                server->socketfd = make_socket(hostname, port);
-                if (server->socketfd == -1) {
-                    log_err("Cannot connect to %s", hostname);
-#ifdef __OPENSSL_SUPPORT__
-                    send_error(io, 503);
-#else
-                    send_error(client->socketfd, 503);
-#endif
-                    goto error;
-                }
-                rate = get_rate(hostname);
-                memset(server->hostname, 0, sizeof(*(server->hostname)));
-                strcpy(server->hostname, hostname);
-            }
         }
 
         client->bytes_read += byte_count;
@@ -695,7 +1113,7 @@ proxy(int sfd)
     /*
      * Check for error.
      */
-    if (server->socketfd == -1) {
+    if (hostname[0] == '\0') {
         log_err("Cannot connect to the real server.");
 #ifdef __OPENSSL_SUPPORT__
         send_error(io, 503);
@@ -705,11 +1123,156 @@ proxy(int sfd)
         goto error;
     }
 
+    frame_init(&request, 0, 0);
+    if (frame_feed(&request, client->buffer, client->bytes_read) == -1) {
+        log_warn("The length of the request is unknown");
+#ifdef __OPENSSL_SUPPORT__
+        send_error(io, 400);
+#else
+        send_error(client->socketfd, 400);
+#endif
+        goto error;
+    }
+    frame_init(&response, 1, strncmp(client->buffer, "HEAD ", 5) == 0);
+    fed = 0;
+
+    /*
+     * A hit is served without connecting to the server. The header stays at
+     * the start of client->buffer until the response is cached: the client
+     * is not read from while the request is complete.
+     */
+    head_length = client->bytes_read;
+    collecting = request.state == FRAME_DONE
+        && (cache_max_object() > 0 || disk_max_object() > 0)
+        && cache_key(key, client->buffer, head_length, hostname, port) == 0;
+    joined = 0;
+    retried = 0;
+  lookup:
+    if (collecting) {
+        hit = cache_get(key, client->buffer, head_length, &hit_length);
+        if (hit != NULL) {
+            log_info("Serving %s from the cache", key);
+#ifdef __OPENSSL_SUPPORT__
+            if (!ktls)
+                byte_count = tls_write(io, hit, hit_length)
+                    == (int) hit_length && BIO_flush(io) > 0 ? 0 : -1;
+            else
+#endif
+                byte_count = send_all(client->socketfd, hit, hit_length);
+            FREEMEM(hit);
+            if (byte_count == -1) {
+                log_err("Error when sending data to the client.");
+                goto error;
+            }
+            client->bytes_read = 0;
+            goto start;
+        }
+        if (disk_get(key, client->buffer, head_length, &disk_hit) == 0) {
+            log_info("Serving %s from the disk cache", key);
+#ifdef __OPENSSL_SUPPORT__
+            if (!ktls)
+                byte_count = send_disk_hit(io, &disk_hit, server->buffer);
+            else
+#endif
+                byte_count = disk_send(&disk_hit, client->socketfd);
+            if (byte_count == -1) {
+                log_err("Error when sending data to the client.");
+                goto error;
+            }
+            client->bytes_read = 0;
+            goto start;
+        }
+
+        /*
+         * One child fetches the response for all the clients that want it
+         * at the time, unless they will not take it from a cache.
+         */
+        if (!joined && cache_accepts(client->buffer, head_length, &max_age)) {
+            joined = 1;
+            flight = collapse_join(key, &leader);
+            if (flight != -1 && !leader) {
+                log_info("Waiting for %s", key);
+#ifdef __OPENSSL_SUPPORT__
+                byte_count = follow(ktls ? NULL : io, client->socketfd,
+                                    flight, key, client->buffer,
+                                    head_length, server->buffer);
+#else
+                byte_count = follow(client->socketfd, flight, key,
+                                    client->buffer, head_length,
+                                    server->buffer);
+#endif
+                collapse_leave(flight, 0);
+                flight = -1;
+                if (byte_count == -1) {
+                    log_err("Error when sending data to the client.");
+                    goto error;
+                }
+                if (byte_count == 1) {
+                    client->bytes_read = 0;
+                    goto start;
+                }
+                goto lookup;
+            }
+        }
+    }
+
+  connect:
+    /*
+     * Do we need a new socket?
+     * We should, if:
+     * a) We have not established a connection to any server, or
+     * b) We have established a connection to a server whose hostname
+     *    is different from this request.
+     */
+    reused = 1;
+    if (server->socketfd == -1
+        || strcasecmp(server->hostname, hostname) != 0
+        || strcmp(server_port, port) != 0) {
+        /*
+         * Safely close existing socket file descriptor, or return it to the
+         * pool if it is between responses.
+         */
+        if (idle)
+            pool_put(server->hostname, server_port, server->socketfd);
+        else
+            CLOSEFD(server->socketfd);
+        server->socketfd = retried ? -1 : pool_get(hostname, port);
+        reused = server->socketfd != -1;
+        if (server->socketfd == -1)
+            server->socketfd = make_socket(hostname, port);
+        if (server->socketfd == -1) {
+            log_err("Cannot connect to %s", hostname);
+#ifdef __OPENSSL_SUPPORT__
+            send_error(io, 503);
+#else
+            send_error(client->socketfd, 503);
+#endif
+            goto error;
+        }
+        rule = rate_table_match(settings->rates, hostname);
+        rate = rule == NULL ? -1 : rule->rate;
+        pace_client(settings, client->socketfd, rate, &paced);
+        memset(server->hostname, 0, sizeof(*(server->hostname)));
+        strcpy(server->hostname, hostname);
+        strcpy(server_port, port);
+    }
+    idle = 0;
+
+    /*
+     * Only a request without a body is still whole in the buffer to be sent
+     * again, and only GET and HEAD may be (RFC 7230 6.3.1).
+     */
+    replay = reused && request.state == FRAME_DONE
+        && (strncmp(client->buffer, "GET ", 4) == 0
+            || strncmp(client->buffer, "HEAD ", 5) == 0);
+
     /*
      * Send the content in the buffer to the server.
      */
     if (send(server->socketfd, client->buffer, client->bytes_read, 0) !=
         client->bytes_read) {
+        if (replay)
+            goto resend;
         log_err("Failed to send.");
 #ifdef __OPENSSL_SUPPORT__
         send_error(io, 503);
@@ -725,24 +1288,24 @@ proxy(int sfd)
     client->bytes_read = 0;
     server->bytes_read = 0;
 
+    collected_length = 0;
+    sized = 0;
+    orphaned = 0;
+    collect_size = max(cache_max_object(), (size_t) PEER_BUFFER_SIZE);
+    if (collecting && collected == NULL) {
+        collected = malloc(collect_size);
+        collecting = collected != NULL;
+    }
+    splicing = rp.fd[0] != -1 && !collecting;
+
     FD_ZERO(&master);
     FD_SET(server->socketfd, &master);
-
-#ifdef __OPENSSL_SUPPORT__
     FD_SET(client->socketfd, &master);
     fdmax = max(server->socketfd, client->socketfd);
-#else
-    fdmax = server->socketfd;
-#endif
 
     tv.tv_sec = 5;
     tv.tv_usec = 0;
 
-    if (rate != -1)
-        factor = USECOND_PER_SECOND / rate;
-
-    memset(&ts, 0, sizeof(ts));
-
     if (rate != -1)
         chunk_size = min(PEER_BUFFER_SIZE, KBYTES_TO_BYTES(rate));
     else
@@ -750,13 +1313,54 @@ proxy(int sfd)
 
     for (;;) {
         /*
-         * Start a timer.
+         * RFC 2616 Section 8.1.1
+         * HTTP implementations SHOULD implement persistent
+         * connections.
+         *
+         * Once the response has been relayed, the server connection waits
+         * for the next request, and what the client sends next belongs to
+         * it. A response that ends before its request leaves the server in
+         * the middle of it.
          */
-        gettimeofday(&current_time, NULL);
+        if (response.state == FRAME_DONE && fed == 0) {
+            if (request.state != FRAME_DONE)
+                goto cleanup;
+            if (filling != NULL) {
+                disk_commit(filling);
+                filling = NULL;
+            } else if (collecting) {
+                cache_put(key, client->buffer, head_length, collected,
+                          collected_length);
+            }
+            if (flight != -1) {
+                collapse_done(flight);
+                flight = -1;
+            }
+            if (response.persistent) {
+                idle = 1;
+            } else {
+                close(server->socketfd);
+                server->socketfd = -1;
+            }
+            if (orphaned)
+                goto cleanup;
+            goto start;
+        }
 
         read_fds = master;
+        if (request.state == FRAME_DONE)
+            FD_CLR(client->socketfd, &read_fds);
 
-        if (select(fdmax + 1, &read_fds, NULL, NULL, &tv) == -1) {
+        if (request.state != FRAME_DONE && rbuf_pending(&rb) > 0) {
+            /*
+             * The body or the next request is already buffered: poll the
+             * server, and treat the client as readable.
+             */
+            memset(&poll_tv, 0, sizeof(poll_tv));
+            if (select(fdmax + 1, &read_fds, NULL, NULL, &poll_tv) == -1)
+                FD_ZERO(&read_fds);
+            FD_SET(client->socketfd, &read_fds);
+        } else if (select(fdmax + 1, &read_fds, NULL, NULL, &tv) == -1) {
             log_warn("Cannot select.");
 #ifdef __OPENSSL_SUPPORT__
             send_error(io, 503);
@@ -769,8 +1373,28 @@ proxy(int sfd)
 
             tv.tv_sec = 2;
 
-            byte_count = recv(server->socketfd,
-                              server->buffer, chunk_size, 0);
+            /*
+             * Nothing past the end of the response is read.
+             */
+            if (fed == 0) {
+                byte_count = frame_ahead(&response, server->socketfd,
+                                         chunk_size);
+                if (byte_count > 0)
+                    fed = byte_count;
+            }
+            if (fed > 0) {
+                if (splicing)
+                    byte_count = relay_in(&rp, server->socketfd, fed);
+                else
+                    byte_count = recv(server->socketfd,
+                                      server->buffer, fed, 0);
+                if (byte_count > 0)
+                    fed -= min((size_t) byte_count, fed);
+            }
+
+            if (byte_count <= 0 && replay)
+                goto resend;
+            replay = 0;
 
             if (byte_count == -1) {
                 log_err("Error when receiving data from the real server.");
@@ -782,72 +1406,119 @@ proxy(int sfd)
                 goto error;
             }
 
-            if (byte_count == 0)
-                goto cleanup;
-
-            /*
-             * If reads the "100 Continue" HTTP response message, allows the
-             * client to write.
-             */
-            if (byte_count == HTTP_CONTINUE_MESSAGE_LENGTH &&
-                strncasecmp(server->buffer, HTTP_CONTINUE_MESSAGE,
-                            HTTP_CONTINUE_MESSAGE_LENGTH) == 0)
-                content_flag = 0;
-            else
-                content_flag = 1;
-
-#ifndef __OPENSSL_SUPPORT__
-            byte_count =
-                send(client->socketfd, server->buffer, byte_count, 0);
-#else
-            byte_count = BIO_write(io, server->buffer, byte_count);
-            check(BIO_flush(io) >= 0, "Error flushing BIO");
-#endif
-
-            if (byte_count == -1) {
-                log_err("Error when sending data to the client.");
+            if (byte_count == 0 && server->bytes_read == 0) {
+                log_err("%s closed the connection without responding.",
+                        hostname);
 #ifdef __OPENSSL_SUPPORT__
                 send_error(io, 503);
 #else
                 send_error(client->socketfd, 503);
 #endif
+                goto error;
             }
 
             if (byte_count == 0)
                 goto cleanup;
+            server->bytes_read = byte_count;
 
             /*
-             * Get the elapsed time
+             * A response that may be cached is copied rather than spliced,
+             * and given up on if it is too large. Once its header is in, it
+             * goes to the disk cache if its length is known to be too large
+             * for memory.
              */
-            prev_second = current_time.tv_sec;
-            prev_usecond = current_time.tv_usec;
-
-            gettimeofday(&current_time, NULL);
+            if (collecting && filling != NULL) {
+                if (disk_write(filling, server->buffer, byte_count) == -1) {
+                    disk_abort(filling);
+                    filling = NULL;
+                    collecting = 0;
+                }
+            } else if (collecting) {
+                if (collected_length + byte_count <= collect_size) {
+                    memcpy(collected + collected_length, server->buffer,
+                           byte_count);
+                    collected_length += byte_count;
+                } else {
+                    collecting = 0;
+                }
+                if (collecting && !sized)
+                    total = cache_header_length(collected, collected_length);
+                if (collecting && !sized && total > 0) {
+                    sized = 1;
+                    total += response.length;
+                    if (response.has_length && !response.chunked
+                        && total > cache_max_object()) {
+                        filling = disk_begin(key, client->buffer, head_length,
+                                             collected, collected_length,
+                                             total);
+                        collecting = filling != NULL;
+                    }
+                }
+            }
 
             /*
-             * Use nanosleep(2) to tune the speed to `rate`.
-             *
-             * I build a calibration mechanism here.
-             * 1. If current rate is under the rate the user wants to limit to,
-             * do NOT sleep.
-             * 2. Subtract the time spending on receiving from the server and
-             * sending to the client from the calculated sleep time.
+             * The followers are let go as soon as the response is known
+             * not to be cached.
              */
-            if (rate != -1) {
-                sleep_time =
-                    (useconds_t) (factor *
-                                  BYTES_TO_KBYTES(byte_count)) -
-                    ((useconds_t)
-                     (current_time.tv_sec -
-                      prev_second)) * USECOND_PER_SECOND -
-                    (current_time.tv_usec - prev_usecond);
+            if (flight != -1 && filling != NULL) {
+                collapse_stream(flight, filling);
+            } else if (flight != -1 && !collecting) {
+                collapse_leave(flight, leader);
+                flight = -1;
+            }
+            if (orphaned && flight == -1)
+                goto cleanup;
+            if (orphaned)
+                continue;
+
+#ifdef __OPENSSL_SUPPORT__
+            if (!ktls) {
+                byte_count = tls_write(io, server->buffer, byte_count);
+
                 /*
-                 * If sleep_time is less than zero, the current speed is way
-                 * below the rate we want to limit to. Do not sleep in this
-                 * case.
+                 * What the server sends at once shares records: it is only
+                 * flushed when no more of it is there yet.
                  */
+                if (byte_count > 0 && (rule != NULL
+                                       || (response.state == FRAME_DONE
+                                           && fed == 0)
+                                       || !readable(server->socketfd)))
+                    check(BIO_flush(io) >= 0, "Error flushing BIO");
+            } else
+#endif
+            if (splicing) {
+                while (rp.pending > 0
+                       && relay_out(&rp, client->socketfd) > 0);
+                if (rp.pending > 0)
+                    byte_count = -1;
+            } else {
+                byte_count =
+                    send(client->socketfd, server->buffer, byte_count, 0);
+            }
+
+            if (byte_count == -1 && filling != NULL && flight != -1) {
+                log_info("The client is gone, still fetching %s", key);
+                orphaned = 1;
+                continue;
+            }
+            if (byte_count == -1) {
+                log_err("Error when sending data to the client.");
+                goto error;
+            }
+
+            if (byte_count == 0)
+                goto cleanup;
+
+            /*
+             * Every connection to the host draws from the same bucket, so
+             * the rate holds however many of them there are.
+             */
+            if (rule != NULL) {
+                sleep_time = bucket_take(rule->bucket, byte_count, rule->rate,
+                                         rule->burst);
                 if (sleep_time > 0) {
-                    ts.tv_nsec = sleep_time * 1000;
+                    ts.tv_sec = sleep_time / USECOND_PER_SECOND;
+                    ts.tv_nsec = sleep_time % USECOND_PER_SECOND * 1000;
                     nanosleep(&ts, NULL);
                 }
             }
@@ -859,26 +1530,16 @@ proxy(int sfd)
           read_client:
 #endif
             /*
-             *
-             * RFC 2616 Section 8.1.1
-             * HTTP implementations SHOULD implement persistent
-             * connections.
-             *
-             * If the server has responded any HTTP response message other than
-             * 100 Continue and the client has written data, data written
-             * appears to belong to the next request/response exchange.
-             *
+             * The body is read up to its end, and a chunk-size line at a
+             * time, so that the next request stays in `rb`.
              */
-            if (content_flag == 1)
-                goto start;
-
-#ifdef __OPENSSL_SUPPORT__
-            byte_count = BIO_read(io, client->buffer, KBYTES_TO_BYTES(10));
-#else
-            byte_count =
-                recv(client->socketfd, client->buffer,
-                     KBYTES_TO_BYTES(10), 0);
-#endif
+            if (frame_bulk(&request) > 0)
+                byte_count = rbuf_read(&rb, client->buffer,
+                                       min(frame_bulk(&request),
+                                           (size_t) KBYTES_TO_BYTES(10)));
+            else
+                byte_count = readLine(&rb, client->buffer,
+                                      KBYTES_TO_BYTES(10));
 
             if (byte_count == -1) {
                 log_err("Error when receiving data from the client.");
@@ -892,6 +1553,11 @@ proxy(int sfd)
             if (byte_count == 0)
                 goto cleanup;
 
+            if (frame_feed(&request, client->buffer, byte_count) == -1) {
+                log_warn("The body of the request is malformed");
+                goto error;
+            }
+
             byte_count =
                 send(server->socketfd, client->buffer, byte_count, 0);
 
@@ -908,51 +1574,235 @@ proxy(int sfd)
             continue;
         } else {                /* Timeout */
 #ifdef __OPENSSL_SUPPORT__
-            if (SSL_pending(ssl))
+            if (request.state != FRAME_DONE && SSL_pending(ssl))
                 goto read_client;
 #endif
-            break;
+            log_info("timeout");
+            goto cleanup;
         }
     }
 
-  cleanup:
-#ifdef __OPENSSL_SUPPORT__
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-#endif
-    CLOSEFD(client->socketfd);
+  resend:
+    log_info("The connection to %s was closed, reconnecting", hostname);
     CLOSEFD(server->socketfd);
-    FREEMEM(server->hostname);
-    FREEMEM(client->buffer);
-    FREEMEM(server->buffer);
-    FREEMEM(client);
-    FREEMEM(server);
-    FREEMEM(hostname);
-    FREEMEM(port);
-    FREEMEM(request_hostname);
-    FREEMEM(request_port);
-    config_destroy(conf);
-    _exit(EXIT_SUCCESS);
+    server->socketfd = -1;
+    client->bytes_read = head_length;
+    retried = 1;
+    goto connect;
+
+  cleanup:
+    status = EXIT_SUCCESS;
 
   error:
 #ifdef __OPENSSL_SUPPORT__
+    BIO_flush(io);
     SSL_shutdown(ssl);
     SSL_free(ssl);
 #endif
-    log_info("Child process %ld exiting.", (long) getpid());
-    CLOSEFD(client->socketfd);
-    CLOSEFD(server->socketfd);
-    FREEMEM(server->hostname);
-    FREEMEM(client->buffer);
-    FREEMEM(server->buffer);
-    FREEMEM(client);
-    FREEMEM(server);
-    FREEMEM(hostname);
-    FREEMEM(port);
-    FREEMEM(request_hostname);
-    FREEMEM(request_port);
+    if (status == EXIT_FAILURE)
+        log_info("Child process %ld exiting.", (long) getpid());
+    CLOSEFD(sfd);
+    relay_pipe_close(&rp);
+    if (server != NULL) {
+        if (idle)
+            pool_put(server->hostname, server_port, server->socketfd);
+        else
+            CLOSEFD(server->socketfd);
+        bufpool_put(server->buffer);
+    }
+    if (client != NULL)
+        bufpool_put(client->buffer);
+    bufpool_put(read_buffer);
+    arena_destroy(&arena);
+    FREEMEM(collected);
+    if (filling != NULL)
+        disk_abort(filling);
+    if (flight != -1)
+        collapse_leave(flight, leader);
     config_destroy(conf);
-    _exit(EXIT_FAILURE);
+    _exit(status);
+}
+
+/*
+ * Creates a socket listening at `port`. If `reuseport` is 1, other sockets
+ * may listen at the same port and the kernel spreads the incoming connections
+ * among them (SO_REUSEPORT).
+ * Returns the socket file descriptor, or -1 on failure.
+ */
+int
+open_listener(const char *port, const int backlog, const int reuseport)
+{
+    struct addrinfo hints,
+                   *servinfo = NULL,
+        *p = NULL;
+    int             sfd = -1;
+    int             optval = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    check(getaddrinfo(NULL, port, &hints, &servinfo) == 0,
+          "cannot getaddrinfo");
+
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        sfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (sfd == -1)
+            continue;
+
+        if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &optval,
+                       sizeof(optval)) == -1
+            || (reuseport == 1
+                && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                              sizeof(optval)) == -1)
+            || bind(sfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sfd);
+            sfd = -1;
+            continue;
+        }
+
+        break;
+    }
+
+    freeaddrinfo(servinfo);
+
+    check(sfd != -1, "Failed to bind");
+
+    check(listen(sfd, backlog) != -1, "Cannot listen");
+
+    return sfd;
+
+  error:
+    CLOSEFD(sfd);
+    return -1;
+}
+
+/*
+ * Forks a long-lived worker that accepts connections on its own SO_REUSEPORT
+ * socket and serves them with the event engine. The socket is created by the
+ * parent, so a failure to bind is reported at start-up.
+ * Returns the pid of the worker, or -1 on failure.
+ */
+pid_t
+spawn_worker(const char *port, const int backlog)
+{
+    int             sfd;
+    pid_t           pid;
+
+    sfd = open_listener(port, backlog, 1);
+    if (sfd == -1)
+        return -1;
+
+    pid = fork();
+    switch (pid) {
+    case 0:
+        /*
+         * The parent handles SIGINT for the whole process group.
+         */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, childSigHandler);
+        free(worker_pids);
+        worker_pids = NULL;
+        num_workers = 0;
+        event_loop(sfd);
+        _exit(EXIT_FAILURE);
+    case -1:
+        log_err("Cannot fork()");
+        break;
+    default:
+        break;
+    }
+
+    close(sfd);
+    return pid;
+}
+
+/*
+ * Takes the buffers of the next child of the fork engine, reaping the
+ * children that have left, and waiting for one to leave while the buffers
+ * are spent: the connection waits in the listen queue rather than go to a
+ * child that could not have them.
+ * Returns -1 if a signal came first.
+ */
+static int
+reserve_buffers(void)
+{
+    pid_t           pid;
+    int             i;
+
+    for (;;) {
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+            bufpool_release(pid);
+
+        for (i = 0; i < PROXY_BUFFERS; i++) {
+            if (next_buffers[i] == NULL
+                && (next_buffers[i] = bufpool_get()) == NULL)
+                break;
+        }
+        if (i == PROXY_BUFFERS)
+            return 0;
+
+        pid = waitpid(-1, NULL, 0);
+        if (pid > 0) {
+            bufpool_release(pid);
+        } else if (errno == EINTR) {
+            reload_settings();
+            return -1;
+        } else {
+            log_warn("No buffer left, and no child to give one back");
+            sleep(1);
+        }
+    }
+}
+
+/*
+ * Waits for the workers and replaces the ones that die.
+ */
+void
+supervise_workers(const char *port, const int backlog)
+{
+    pid_t           pid;
+    time_t         *started;
+    int             status;
+    int             i;
+
+    started = calloc(num_workers, sizeof(*started));
+    check_mem(started);
+    for (i = 0; i < num_workers; i++)
+        started[i] = time(NULL);
+
+    for (;;) {
+        pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                reload_settings();
+                continue;
+            }
+            log_err("Cannot wait for the workers");
+            break;
+        }
+
+        bufpool_release(pid);
+
+        for (i = 0; i < num_workers && worker_pids[i] != pid; i++);
+        if (i == num_workers)
+            continue;
+
+        log_warn("Worker %ld has died, starting a new one", (long) pid);
+
+        /*
+         * Do not spin if the worker dies right after starting.
+         */
+        if (time(NULL) - started[i] < 1)
+            sleep(1);
+
+        worker_pids[i] = spawn_worker(port, backlog);
+        started[i] = time(NULL);
+    }
+
+  error:
+    FREEMEM(started);
 }
 
 void
@@ -981,18 +1831,34 @@ main(int argc, char *argv[])
 {
     int             sfd = -1,
         newfd = -1;
-    struct addrinfo hints,
-                   *servinfo = NULL,
-        *p = NULL;
-    int             optval;
-    int             fd = -1;
+    int             records;
+    int             engine;
+    int             backlog;
+    int             pool_size,
+                    pool_idle;
+    int             cache_size,
+                    cache_object,
+                    disk_size,
+                    disk_object,
+                    collapse_size;
+    char           *disk_dir;
+    int             resolvers,
+                    negative_ttl;
+    int             buffer_budget;
+    int             i,
+                    n;
+    pid_t           pid;
     char           *listen_port;
     char           *ptr;
+    struct sigaction sa;
+    struct settings *current;
 
 #ifdef __OPENSSL_SUPPORT__
     BIO            *sbio;
     SSL_CTX        *ctx;
     SSL            *ssl;
+    int             sessions,
+                    ticket_lifetime;
 
     ctx = initialize_ctx(KEYFILE, PASSWORD);
     load_dh_params(ctx, DHFILE);
@@ -1005,6 +1871,15 @@ main(int argc, char *argv[])
     signal(SIGINT, sigHandler);
     signal(SIGTERM, sigHandler);
 
+    /*
+     * Without SA_RESTART, so that a blocking accept(2) or wait(2) returns and
+     * the reload is not held up until the next connection.
+     */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = hupHandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+
     switch (argc) {
     case 1:
         log_info
@@ -1026,8 +1901,10 @@ main(int argc, char *argv[])
                 log_warn("Cannot find configuration file.");
                 return EXIT_FAILURE;
             }
+            conf_path = argv[2];
             break;
         }
+        /* FALLTHROUGH */
     default:
         usage(1);
         return EXIT_FAILURE;
@@ -1035,99 +1912,309 @@ main(int argc, char *argv[])
 
     ptr = config_get_value(conf, "dns", "records", 1);
     if (ptr == NULL)
-        cache_size = NUM_RECORD * sizeof(struct record);
+        records = NUM_RECORD;
     else
-        cache_size =
-            (int) strtol(ptr, (char **) NULL, 10) * sizeof(struct record);
+        records = (int) strtol(ptr, (char **) NULL, 10);
 
-    fd = shm_open(SHM_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
-    check(fd != -1, "Cannot create shared memory.");
+    check(dns_cache_init(records) == 0, "Cannot create the DNS cache.");
 
-    check(ftruncate(fd, cache_size) != -1, "Cannot resize the object");
+    setbuf(stdout, NULL);
 
-    addr =
-        mmap(NULL, cache_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    check(addr != MAP_FAILED, "Cannot map?!");
+    /*
+     * The settings that SIGHUP reloads, debug among them.
+     */
+    check(bucket_init(config_count(conf, "rates")) == 0,
+          "Cannot create the rate buckets.");
+    current = settings_build(conf);
+    check(current != NULL, "Cannot compile the settings.");
+    settings_install(current);
 
-    sem =
-        sem_open(SEM_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR,
-                 1);
-    check(sem != SEM_FAILED, "Cannot create semaphores.");
-    memset(addr, 0, cache_size);
+    ptr = config_get_value(conf, "dns", "ttl", 1);
+    if (ptr != NULL)
+        dns_ttl = (int) strtol(ptr, (char **) NULL, 10);
+    if (dns_ttl < 60) {
+        log_warn("TTL is too small. I will now set it to 60s.");
+        dns_ttl = 60;
+    }
 
-    setbuf(stdout, NULL);
+    /*
+     * Start with the names of the previous run, rather than resolving all
+     * of them again.
+     */
+    dns_snapshot = config_get_value(conf, "dns", "snapshot", 1);
+    if (dns_snapshot != NULL) {
+        n = dns_cache_load(dns_snapshot, dns_ttl);
+        if (n > 0)
+            log_info("Loaded %d DNS records from %s", n, dns_snapshot);
+    }
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+    ptr = config_get_value(conf, "default", "proxy_port", 1);
+    if (ptr == NULL)
+        listen_port = "8080";
+    else
+        listen_port = ptr;
 
+    /*
+     * The event engine drives every connection from this process. The fork
+     * engine (one child per connection) is kept for compatibility and is
+     * the only one that supports OpenSSL.
+     */
+    engine = ENGINE_EPOLL;
+    ptr = config_get_value(conf, "default", "engine", 1);
+    if (ptr != NULL && strcasecmp(ptr, "fork") == 0)
+        engine = ENGINE_FORK;
+#ifdef __OPENSSL_SUPPORT__
+    if (engine == ENGINE_EPOLL)
+        log_info("The event engine does not support OpenSSL, "
+                 "fall back to the fork engine");
+    engine = ENGINE_FORK;
+#endif
 
-    ptr = config_get_value(conf, "default", "debug", 1);
+    ptr = config_get_value(conf, "default", "backlog", 1);
     if (ptr == NULL)
-        debug_level = 0;
+        backlog = DEFAULT_BACKLOG;
     else
-        debug_level = (int) strtol(ptr, (char **) NULL, 10);
+        backlog = (int) strtol(ptr, (char **) NULL, 10);
 
-    ptr = config_get_value(conf, "default", "no_abs", 0);
-    if (ptr != NULL)
-        use_abs_url = 0;
+    /*
+     * "workers = auto" pre-forks one worker per online CPU.
+     */
+    ptr = config_get_value(conf, "default", "workers", 1);
+    if (ptr == NULL)
+        num_workers = 0;
+    else if (strcasecmp(ptr, "auto") == 0)
+        num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    else
+        num_workers = (int) strtol(ptr, (char **) NULL, 10);
 
-    ptr = config_get_value(conf, "default", "proxy_port", 1);
+    if (num_workers > 0 && engine != ENGINE_EPOLL) {
+        log_warn("Workers require the event engine, ignored.");
+        num_workers = 0;
+    }
+
+    /*
+     * "buffer_budget" megabytes of connection buffers are shared by all the
+     * processes.
+     */
+    ptr = config_get_value(conf, "default", "buffer_budget", 1);
     if (ptr == NULL)
-        listen_port = "8080";
+        buffer_budget = BUFPOOL_DEFAULT_BUDGET;
     else
-        listen_port = ptr;
+        buffer_budget = (int) strtol(ptr, (char **) NULL, 10);
+    check(bufpool_init((size_t) max(buffer_budget, 0)
+                       * KBYTES_TO_BYTES(1024)) == 0,
+          "Cannot create the buffer pool.");
 
-    check(getaddrinfo(NULL, listen_port, &hints, &servinfo) == 0,
-          "cannot getaddrinfo");
+    /*
+     * [cache]
+     * size            = megabytes of responses kept, 0 disables the cache
+     * max_object      = kbytes of the largest response kept
+     * disk            = megabytes of responses kept on disk, 0 disables it
+     * disk_dir        = directory of the disk cache
+     * disk_max_object = megabytes of the largest response kept on disk
+     * collapse        = responses fetched for several clients at a time,
+     *                   0 lets every client fetch its own
+     */
+    ptr = config_get_value(conf, "cache", "size", 1);
+    if (ptr == NULL)
+        cache_size = CACHE_DEFAULT_SIZE;
+    else
+        cache_size = (int) strtol(ptr, (char **) NULL, 10);
 
-    optval = 1;
-    for (p = servinfo; p != NULL; p = p->ai_next) {
-        sfd = socket(servinfo->ai_family, servinfo->ai_socktype,
-                     servinfo->ai_protocol);
-        if (sfd == -1) {
-            continue;
-        }
+    ptr = config_get_value(conf, "cache", "max_object", 1);
+    if (ptr == NULL)
+        cache_object = CACHE_DEFAULT_MAX_OBJECT;
+    else
+        cache_object = (int) strtol(ptr, (char **) NULL, 10);
 
-        if (setsockopt
-            (sfd, SOL_SOCKET, SO_REUSEADDR, &optval,
-             sizeof(optval)) == -1) {
-            continue;
-        }
+    ptr = config_get_value(conf, "cache", "disk", 1);
+    if (ptr == NULL)
+        disk_size = DISK_DEFAULT_SIZE;
+    else
+        disk_size = (int) strtol(ptr, (char **) NULL, 10);
 
-        if (bind(sfd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
-            close(sfd);
-            continue;
-        }
+    disk_dir = config_get_value(conf, "cache", "disk_dir", 1);
 
-        break;
+    ptr = config_get_value(conf, "cache", "disk_max_object", 1);
+    if (ptr == NULL)
+        disk_object = DISK_DEFAULT_MAX_OBJECT;
+    else
+        disk_object = (int) strtol(ptr, (char **) NULL, 10);
+
+    ptr = config_get_value(conf, "cache", "collapse", 1);
+    if (ptr == NULL)
+        collapse_size = COLLAPSE_DEFAULT_SIZE;
+    else
+        collapse_size = (int) strtol(ptr, (char **) NULL, 10);
+
+    /*
+     * [pool]
+     * size = number of idle server connections kept, 0 disables the pool
+     * idle = seconds an idle connection is kept
+     */
+    ptr = config_get_value(conf, "pool", "size", 1);
+    if (ptr == NULL)
+        pool_size = POOL_DEFAULT_SIZE;
+    else
+        pool_size = (int) strtol(ptr, (char **) NULL, 10);
+
+    ptr = config_get_value(conf, "pool", "idle", 1);
+    if (ptr == NULL)
+        pool_idle = POOL_DEFAULT_IDLE;
+    else
+        pool_idle = (int) strtol(ptr, (char **) NULL, 10);
+
+    /*
+     * The broker must not inherit the listening sockets.
+     */
+    pool_pid = pool_start(pool_size, pool_idle);
+    if (pool_pid == -1) {
+        log_warn("Cannot start the connection pool, continuing without it");
+        pool_pid = 0;
     }
 
-    log_info("The proxy is listening at port: %s", listen_port);
+    if (cache_size > 0 && cache_object > 0
+        && cache_init((size_t) cache_size * KBYTES_TO_BYTES(1024),
+                      (size_t) KBYTES_TO_BYTES(cache_object)) == -1)
+        log_warn("Cannot create the response cache, continuing without it");
+    if (disk_size > 0 && disk_dir == NULL) {
+        log_warn("The disk cache requires disk_dir, ignored.");
+    } else if (disk_size > 0 && disk_object > 0
+               && disk_open(disk_dir,
+                            (size_t) disk_size * KBYTES_TO_BYTES(1024),
+                            (size_t) disk_object
+                            * KBYTES_TO_BYTES(1024)) == -1) {
+        log_warn("Cannot open the disk cache, continuing without it");
+    }
+    if ((cache_max_object() > 0 || disk_max_object() > 0)
+        && collapse_size > 0 && collapse_init(collapse_size) == -1)
+        log_warn("Cannot collapse the requests, continuing without it");
 
-    freeaddrinfo(servinfo);
+    /*
+     * [dns]
+     * resolvers    = number of concurrent queries, 0 resolves inline
+     * negative_ttl = seconds a failed query is remembered
+     */
+    ptr = config_get_value(conf, "dns", "resolvers", 1);
+    if (ptr == NULL)
+        resolvers = RESOLVER_DEFAULT_THREADS;
+    else
+        resolvers = (int) strtol(ptr, (char **) NULL, 10);
+
+    ptr = config_get_value(conf, "dns", "negative_ttl", 1);
+    if (ptr == NULL)
+        negative_ttl = RESOLVER_DEFAULT_NEGATIVE_TTL;
+    else
+        negative_ttl = (int) strtol(ptr, (char **) NULL, 10);
+
+#ifdef __OPENSSL_SUPPORT__
+    /*
+     * [ssl]
+     * ktls            = 1 lets the kernel encrypt the responses, if it can
+     * sessions        = TLS sessions kept for every child to resume, 0 only
+     *                   resumes them from tickets
+     * ticket_lifetime = seconds a session, and a ticket key, is good for
+     */
+    ptr = config_get_value(conf, "ssl", "ktls", 1);
+    if (ptr != NULL && strtol(ptr, (char **) NULL, 10) == 1) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        log_warn("This OpenSSL cannot hand the keys to the kernel, "
+                 "ktls is ignored.");
+#endif
+    }
+
+    ptr = config_get_value(conf, "ssl", "sessions", 1);
+    if (ptr == NULL)
+        sessions = SESSION_DEFAULT_SIZE;
+    else
+        sessions = (int) strtol(ptr, (char **) NULL, 10);
+
+    ptr = config_get_value(conf, "ssl", "ticket_lifetime", 1);
+    if (ptr == NULL)
+        ticket_lifetime = SESSION_DEFAULT_LIFETIME;
+    else
+        ticket_lifetime = (int) strtol(ptr, (char **) NULL, 10);
+    if (ticket_lifetime <= 0)
+        ticket_lifetime = SESSION_DEFAULT_LIFETIME;
+
+    if (session_init(ctx, sessions > 0 ? sessions : 0, ticket_lifetime) == -1)
+        log_warn("Cannot share the TLS sessions, continuing without it");
+#endif
 
-    check(p != NULL, "Failed to bind\n");
+    resolver_pid = resolver_start(resolvers, negative_ttl);
+    if (resolver_pid == -1) {
+        log_warn("Cannot start the resolver, names are resolved inline");
+        resolver_pid = 0;
+    }
 
-    check(listen(sfd, 10) != -1, "Cannot listen");
+    if (num_workers > 0) {
+        /*
+         * The workers must be waited for to be replaced.
+         */
+        signal(SIGCHLD, SIG_DFL);
 
-    switch (fork()) {
+        worker_pids = calloc(num_workers, sizeof(*worker_pids));
+        check_mem(worker_pids);
+
+        for (i = 0; i < num_workers; i++) {
+            worker_pids[i] = spawn_worker(listen_port, backlog);
+            if (worker_pids[i] == -1) {
+                kill_workers();
+                goto error;
+            }
+        }
+        log_info("%d workers are listening at port: %s", num_workers,
+                 listen_port);
+    } else {
+        sfd = open_listener(listen_port, backlog, 0);
+        check(sfd != -1, "Cannot listen at port: %s", listen_port);
+        log_info("The proxy is listening at port: %s", listen_port);
+    }
+
+    switch (cleaner_pid = fork()) {
     case 0:
         dnscleaner();
         _exit(EXIT_SUCCESS);
     case -1:
         log_err("Cannot fork()");
+        kill_workers();
         goto error;
     default:
         break;
 
     }
 
+    if (num_workers > 0) {
+        supervise_workers(listen_port, backlog);
+        kill_workers();
+        goto error;
+    }
+
+    if (engine == ENGINE_EPOLL) {
+        event_loop(sfd);
+        goto error;
+    }
+
+    /*
+     * The children are reaped here, to give back the buffers of the ones
+     * that did not.
+     */
+    signal(SIGCHLD, SIG_DFL);
+
     while (1) {
-        check((newfd = accept(sfd, NULL, NULL)) != -1, "cannot accept");
+        if (reserve_buffers() == -1)
+            continue;
 
-        switch (fork()) {
+        newfd = accept(sfd, NULL, NULL);
+        if (newfd == -1 && errno == EINTR) {
+            reload_settings();
+            continue;
+        }
+        check(newfd != -1, "cannot accept");
+
+        switch (pid = fork()) {
         case 0:
 
 #ifdef __OPENSSL_SUPPORT__
@@ -1150,6 +2237,10 @@ main(int argc, char *argv[])
         case -1:
             goto error;
         default:
+            for (i = 0; i < PROXY_BUFFERS; i++) {
+                bufpool_hand(next_buffers[i], pid);
+                next_buffers[i] = NULL;
+            }
             close(newfd);
         }
     }
@@ -1157,9 +2248,15 @@ main(int argc, char *argv[])
     return EXIT_SUCCESS;
 
   error:
-    shm_unlink(SHM_NAME);
-    sem_unlink(SEM_NAME);
+    dns_cache_destroy();
+    cache_destroy();
+    disk_close();
+    collapse_destroy();
+    bufpool_destroy();
+#ifdef __OPENSSL_SUPPORT__
+    session_destroy();
+#endif
     CLOSEFD(sfd);
-    freeaddrinfo(servinfo);
+    FREEMEM(worker_pids);
     return EXIT_FAILURE;
 }
@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2012, Meitian Huang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution
+ *
+ * THIS SOFTWARE IS PROVIDED BY Meitian Huang AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AN ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef WEBPROXY_H_
+#define WEBPROXY_H_
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netdb.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "settings.h"
+
+/*
+ * Please do NOT change PEER_BUFFER_SIZE to a small value. If the
+ * PEER_BUFFER_SIZE is too small, CPU will be interrupted too frequently and it
+ * will do too many context switches, which can be expensive and lead to higher
+ * CPU usage.
+ */
+#define PEER_BUFFER_SIZE INT16_MAX
+
+/*
+ * Units and units conversion.
+ */
+#define USECOND_PER_SECOND 1000000
+#define BYTES_TO_KBYTES(A) (A / 1024)
+#define KBYTES_TO_BYTES(A) (A * 1024)
+
+struct peer {
+    int             socketfd;   /* Socket file descriptor */
+    char           *hostname;   /* Hostname of the peer, only set for
+                                 * "server" */
+    char           *buffer;     /* Buffer area for the incoming data */
+    int             bytes_read; /* Number of bytes read or the amount of
+                                 * data in buffer */
+};
+
+extern struct config_sect *conf;
+extern int      debug_level;
+
+const char     *error_head(const int code);
+
+int             make_socket(const char *name, const char *port);
+
+/*
+ * Has the kernel pace the client socket `fd` at `rate` kbytes/sec
+ * (SO_MAX_PACING_RATE), or at full speed if `rate` is -1. `paced` tells
+ * whether `fd` is paced, and is updated. Nothing happens unless pacing is
+ * on in `s`; the rate is then still enforced by sleeping if the kernel
+ * refuses.
+ */
+void            pace_client(const struct settings *s, int fd, const int rate,
+                            int *paced);
+
+/*
+ * Installs the settings of the configuration file if SIGHUP asked for it.
+ */
+void            reload_settings(void);
+
+#endif                          /* WEBPROXY_H_ */